@@ -0,0 +1,439 @@
+/*
+ * CBORDecoder.cpp
+ *
+ * Minimal CBOR (RFC 8949) decoder reading from a buffer without copying.
+ */
+
+#include "CBORDecoder.h"
+#include <string.h>
+
+#define CBOR_UINT	0
+#define CBOR_NEGINT	1
+#define CBOR_BYTES	2
+#define CBOR_TEXT	3
+#define CBOR_ARRAY	4
+#define CBOR_MAP	5
+#define CBOR_TAG	6
+#define CBOR_SIMPLE	7
+
+#define CBOR_FALSE	20
+#define CBOR_TRUE	21
+#define CBOR_NULL	22
+#define CBOR_FLOAT16 25
+#define CBOR_FLOAT32 26
+#define CBOR_FLOAT64 27
+
+/***
+ * Constructor
+ * @param buf - CBOR data, must remain valid while decoding
+ * @param len - length of data
+ */
+CBORDecoder::CBORDecoder(const uint8_t *buf, size_t len) {
+	pBuf = buf;
+	xLen = len;
+}
+
+/***
+ * Destructor
+ */
+CBORDecoder::~CBORDecoder() {
+	// NOP
+}
+
+/***
+ * Read item head
+ * @param major - output major type
+ * @param value - output argument
+ * @param minor - output additional information
+ * @return false if malformed or at end
+ */
+bool CBORDecoder::getHead(uint8_t *major, uint64_t *value, uint8_t *minor){
+	uint8_t n;
+
+	if (xPos >= xLen){
+		return false;
+	}
+	*major = pBuf[xPos] >> 5;
+	*minor = pBuf[xPos] & 0x1F;
+	xPos++;
+
+	if (*minor < 24){
+		*value = *minor;
+		return true;
+	}
+	switch(*minor){
+	case 24:
+		n = 1;
+		break;
+	case 25:
+		n = 2;
+		break;
+	case 26:
+		n = 4;
+		break;
+	case 27:
+		n = 8;
+		break;
+	default:
+		//Reserved or indefinite length
+		xOk = false;
+		return false;
+	}
+	if ((xLen - xPos) < n){
+		xOk = false;
+		return false;
+	}
+	*value = 0;
+	for (uint8_t i=0; i < n; i++){
+		*value = (*value << 8) | pBuf[xPos++];
+	}
+	return true;
+}
+
+/***
+ * Type of the next item
+ * @return
+ */
+CBORType CBORDecoder::peekType(){
+	uint8_t major, minor;
+	uint64_t value;
+	size_t pos = xPos;
+	CBORType res;
+
+	if (xPos >= xLen){
+		return CBOREnd;
+	}
+	if (!getHead(&major, &value, &minor)){
+		xPos = pos;
+		return CBORError;
+	}
+	xPos = pos;
+
+	switch(major){
+	case CBOR_UINT:
+		res = CBORUInt;
+		break;
+	case CBOR_NEGINT:
+		res = CBORNegInt;
+		break;
+	case CBOR_BYTES:
+		res = CBORBytes;
+		break;
+	case CBOR_TEXT:
+		res = CBORText;
+		break;
+	case CBOR_ARRAY:
+		res = CBORArray;
+		break;
+	case CBOR_MAP:
+		res = CBORMap;
+		break;
+	case CBOR_SIMPLE:
+		if ((minor == CBOR_FALSE) || (minor == CBOR_TRUE)){
+			res = CBORBool;
+		} else if (minor == CBOR_NULL){
+			res = CBORNull;
+		} else if (minor >= CBOR_FLOAT16){
+			res = CBORFloat;
+		} else {
+			res = CBORError;
+		}
+		break;
+	default:
+		//Tags are not used
+		res = CBORError;
+		break;
+	}
+	return res;
+}
+
+/***
+ * Read start of a map. mapFind can then look up keys within it.
+ * @param pairs - output, number of pairs
+ * @return false if next item is not a map
+ */
+bool CBORDecoder::getMap(uint32_t *pairs){
+	uint8_t major, minor;
+	uint64_t value;
+	size_t pos = xPos;
+
+	if (!getHead(&major, &value, &minor) || (major != CBOR_MAP) || (value > 0xFFFF)){
+		xPos = pos;
+		return false;
+	}
+	*pairs = value;
+	xMapStart = xPos;
+	xMapPairs = value;
+	return true;
+}
+
+/***
+ * Read start of an array
+ * @param items - output, number of items
+ * @return false if next item is not an array
+ */
+bool CBORDecoder::getArray(uint32_t *items){
+	uint8_t major, minor;
+	uint64_t value;
+	size_t pos = xPos;
+
+	if (!getHead(&major, &value, &minor) || (major != CBOR_ARRAY) || (value > 0xFFFF)){
+		xPos = pos;
+		return false;
+	}
+	*items = value;
+	return true;
+}
+
+/***
+ * Position on the value for a text key in the map last read by getMap
+ * @param key - zero terminated key
+ * @return false if not found
+ */
+bool CBORDecoder::mapFind(const char *key){
+	size_t keyLen = strlen(key);
+	const char *str;
+	size_t len;
+
+	xPos = xMapStart;
+	for (uint32_t i=0; i < xMapPairs; i++){
+		if (getString(&str, &len)){
+			if ((len == keyLen) && (memcmp(str, key, len) == 0)){
+				return true;
+			}
+		} else if (!skip()){
+			break;
+		}
+		if (!skip()){
+			break;
+		}
+	}
+	xPos = xMapStart;
+	return false;
+}
+
+/***
+ * Read unsigned integer
+ * @param value - output
+ * @return false if next item is not an unsigned integer
+ */
+bool CBORDecoder::getUInt(uint32_t *value){
+	uint8_t major, minor;
+	uint64_t v;
+	size_t pos = xPos;
+
+	if (!getHead(&major, &v, &minor) || (major != CBOR_UINT) || (v > 0xFFFFFFFF)){
+		xPos = pos;
+		return false;
+	}
+	*value = v;
+	return true;
+}
+
+/***
+ * Read signed integer
+ * @param value - output
+ * @return false if next item is not an integer in range
+ */
+bool CBORDecoder::getInt(int32_t *value){
+	uint8_t major, minor;
+	uint64_t v;
+	size_t pos = xPos;
+
+	if (!getHead(&major, &v, &minor) || (v > 0x7FFFFFFF) ||
+			((major != CBOR_UINT) && (major != CBOR_NEGINT))){
+		xPos = pos;
+		return false;
+	}
+	*value = (major == CBOR_UINT) ? (int32_t)v : (-1 - (int32_t)v);
+	return true;
+}
+
+/***
+ * Read boolean
+ * @param value - output
+ * @return false if next item is not a boolean
+ */
+bool CBORDecoder::getBool(bool *value){
+	uint8_t major, minor;
+	uint64_t v;
+	size_t pos = xPos;
+
+	if (!getHead(&major, &v, &minor) || (major != CBOR_SIMPLE) ||
+			((minor != CBOR_FALSE) && (minor != CBOR_TRUE))){
+		xPos = pos;
+		return false;
+	}
+	*value = (minor == CBOR_TRUE);
+	return true;
+}
+
+/***
+ * Read a number as float, half, single and integer items are accepted
+ * @param value - output
+ * @return false if next item is not a number
+ */
+bool CBORDecoder::getFloat(float *value){
+	uint8_t major, minor;
+	uint64_t v;
+	size_t pos = xPos;
+
+	if (!getHead(&major, &v, &minor)){
+		xPos = pos;
+		return false;
+	}
+	if (major == CBOR_UINT){
+		*value = (float)v;
+		return true;
+	}
+	if (major == CBOR_NEGINT){
+		*value = -1.0f - (float)v;
+		return true;
+	}
+	if (major == CBOR_SIMPLE){
+		if (minor == CBOR_FLOAT16){
+			//Sign, 5 bit exponent, 10 bit mantissa
+			uint32_t exp = (v >> 10) & 0x1F;
+			uint32_t mant = v & 0x3FF;
+			float f;
+			if (exp == 0){
+				f = mant / 16777216.0f;
+			} else if (exp == 31){
+				f = (mant == 0) ? __builtin_inff() : __builtin_nanf("");
+			} else {
+				f = (float)(mant + 1024) * (float)(1 << exp) / 33554432.0f;
+			}
+			*value = (v & 0x8000) ? -f : f;
+			return true;
+		}
+		if (minor == CBOR_FLOAT32){
+			uint32_t bits = v;
+			memcpy(value, &bits, sizeof(float));
+			return true;
+		}
+		if (minor == CBOR_FLOAT64){
+			double d;
+			memcpy(&d, &v, sizeof(double));
+			*value = (float)d;
+			return true;
+		}
+	}
+	xPos = pos;
+	return false;
+}
+
+/***
+ * Read text string, returned in place and not terminated
+ * @param str - output, pointer into the buffer
+ * @param len - output, length
+ * @return false if next item is not a text string
+ */
+bool CBORDecoder::getString(const char **str, size_t *len){
+	uint8_t major, minor;
+	uint64_t v;
+	size_t pos = xPos;
+
+	if (!getHead(&major, &v, &minor) || (major != CBOR_TEXT)){
+		xPos = pos;
+		return false;
+	}
+	if ((xLen - xPos) < v){
+		xOk = false;
+		xPos = pos;
+		return false;
+	}
+	*str = (const char *)&pBuf[xPos];
+	xPos += v;
+	*len = v;
+	return true;
+}
+
+/***
+ * Read byte string, returned in place
+ * @param data - output, pointer into the buffer
+ * @param len - output, length
+ * @return false if next item is not a byte string
+ */
+bool CBORDecoder::getBytes(const uint8_t **data, size_t *len){
+	uint8_t major, minor;
+	uint64_t v;
+	size_t pos = xPos;
+
+	if (!getHead(&major, &v, &minor) || (major != CBOR_BYTES)){
+		xPos = pos;
+		return false;
+	}
+	if ((xLen - xPos) < v){
+		xOk = false;
+		xPos = pos;
+		return false;
+	}
+	*data = &pBuf[xPos];
+	xPos += v;
+	*len = v;
+	return true;
+}
+
+/***
+ * Skip the next item, including anything nested in it
+ * @return false if malformed
+ */
+bool CBORDecoder::skip(){
+	return skipItem(0);
+}
+
+/***
+ * Skip an item
+ * @param depth - current nesting
+ * @return false if malformed
+ */
+bool CBORDecoder::skipItem(uint8_t depth){
+	uint8_t major, minor;
+	uint64_t v;
+
+	if ((depth > CBOR_MAX_DEPTH) || !getHead(&major, &v, &minor)){
+		xOk = false;
+		return false;
+	}
+	switch(major){
+	case CBOR_BYTES:
+	case CBOR_TEXT:
+		if ((xLen - xPos) < v){
+			xOk = false;
+			return false;
+		}
+		xPos += v;
+		break;
+	case CBOR_MAP:
+		//A map is an array of keys and values
+		v = v * 2;
+		// fall through
+	case CBOR_ARRAY:
+		if (v > (xLen - xPos)){
+			//Every item is at least one byte
+			xOk = false;
+			return false;
+		}
+		for (uint64_t i=0; i < v; i++){
+			if (!skipItem(depth + 1)){
+				return false;
+			}
+		}
+		break;
+	case CBOR_TAG:
+		//Skip the tagged item
+		return skipItem(depth + 1);
+	default:
+		//Integers and simple values are all in the head
+		break;
+	}
+	return true;
+}
+
+/***
+ * Has everything read been well formed
+ * @return
+ */
+bool CBORDecoder::isOk(){
+	return xOk;
+}
@@ -0,0 +1,147 @@
+/*
+ * CBORDecoder.h
+ *
+ * Minimal CBOR (RFC 8949) decoder reading from a buffer without copying,
+ * the binary alternative to tiny_json for incoming deltas. Indefinite
+ * length items are not supported.
+ */
+
+#ifndef SRC_CBORDECODER_H_
+#define SRC_CBORDECODER_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+//Deepest nesting skipped over
+#ifndef CBOR_MAX_DEPTH
+#define CBOR_MAX_DEPTH 8
+#endif
+
+enum CBORType { CBORUInt, CBORNegInt, CBORBytes, CBORText, CBORArray,
+	CBORMap, CBORBool, CBORNull, CBORFloat, CBOREnd, CBORError };
+
+class CBORDecoder {
+public:
+	/***
+	 * Constructor
+	 * @param buf - CBOR data, must remain valid while decoding
+	 * @param len - length of data
+	 */
+	CBORDecoder(const uint8_t *buf, size_t len);
+
+	/***
+	 * Destructor
+	 */
+	virtual ~CBORDecoder();
+
+	/***
+	 * Type of the next item
+	 * @return
+	 */
+	CBORType peekType();
+
+	/***
+	 * Read start of a map. mapFind can then look up keys within it.
+	 * @param pairs - output, number of pairs
+	 * @return false if next item is not a map
+	 */
+	bool getMap(uint32_t *pairs);
+
+	/***
+	 * Read start of an array
+	 * @param items - output, number of items
+	 * @return false if next item is not an array
+	 */
+	bool getArray(uint32_t *items);
+
+	/***
+	 * Position on the value for a text key in the map last read by getMap
+	 * @param key - zero terminated key
+	 * @return false if not found
+	 */
+	bool mapFind(const char *key);
+
+	/***
+	 * Read unsigned integer
+	 * @param value - output
+	 * @return false if next item is not an unsigned integer
+	 */
+	bool getUInt(uint32_t *value);
+
+	/***
+	 * Read signed integer
+	 * @param value - output
+	 * @return false if next item is not an integer in range
+	 */
+	bool getInt(int32_t *value);
+
+	/***
+	 * Read boolean
+	 * @param value - output
+	 * @return false if next item is not a boolean
+	 */
+	bool getBool(bool *value);
+
+	/***
+	 * Read a number as float, half, single and integer items are accepted
+	 * @param value - output
+	 * @return false if next item is not a number
+	 */
+	bool getFloat(float *value);
+
+	/***
+	 * Read text string, returned in place and not terminated
+	 * @param str - output, pointer into the buffer
+	 * @param len - output, length
+	 * @return false if next item is not a text string
+	 */
+	bool getString(const char **str, size_t *len);
+
+	/***
+	 * Read byte string, returned in place
+	 * @param data - output, pointer into the buffer
+	 * @param len - output, length
+	 * @return false if next item is not a byte string
+	 */
+	bool getBytes(const uint8_t **data, size_t *len);
+
+	/***
+	 * Skip the next item, including anything nested in it
+	 * @return false if malformed
+	 */
+	bool skip();
+
+	/***
+	 * Has everything read been well formed
+	 * @return
+	 */
+	bool isOk();
+
+private:
+	/***
+	 * Read item head
+	 * @param major - output major type
+	 * @param value - output argument
+	 * @param minor - output additional information
+	 * @return false if malformed or at end
+	 */
+	bool getHead(uint8_t *major, uint64_t *value, uint8_t *minor);
+
+	/***
+	 * Skip an item
+	 * @param depth - current nesting
+	 * @return false if malformed
+	 */
+	bool skipItem(uint8_t depth);
+
+	const uint8_t *pBuf;
+	size_t xLen;
+	size_t xPos = 0;
+	bool xOk = true;
+
+	//Map last read by getMap
+	size_t xMapStart = 0;
+	uint32_t xMapPairs = 0;
+};
+
+#endif /* SRC_CBORDECODER_H_ */
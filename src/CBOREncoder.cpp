@@ -0,0 +1,214 @@
+/*
+ * CBOREncoder.cpp
+ *
+ * Minimal CBOR (RFC 8949) encoder writing into a caller supplied buffer.
+ */
+
+#include "CBOREncoder.h"
+#include <string.h>
+
+#define CBOR_UINT	0
+#define CBOR_NEGINT	1
+#define CBOR_BYTES	2
+#define CBOR_TEXT	3
+#define CBOR_ARRAY	4
+#define CBOR_MAP	5
+#define CBOR_SIMPLE	7
+
+#define CBOR_FALSE	20
+#define CBOR_TRUE	21
+#define CBOR_NULL	22
+#define CBOR_FLOAT32 26
+
+/***
+ * Constructor
+ * @param buf - buffer to write to
+ * @param len - length of buffer
+ */
+CBOREncoder::CBOREncoder(uint8_t *buf, size_t len) {
+	pBuf = buf;
+	xLen = len;
+}
+
+/***
+ * Destructor
+ */
+CBOREncoder::~CBOREncoder() {
+	// NOP
+}
+
+/***
+ * Write item head, major type and argument
+ * @param major - major type 0 to 7
+ * @param value - argument
+ * @return false if buffer full
+ */
+bool CBOREncoder::putHead(uint8_t major, uint32_t value){
+	uint8_t head[5];
+	size_t n;
+
+	major = major << 5;
+	if (value < 24){
+		head[0] = major | value;
+		n = 1;
+	} else if (value <= 0xFF){
+		head[0] = major | 24;
+		head[1] = value;
+		n = 2;
+	} else if (value <= 0xFFFF){
+		head[0] = major | 25;
+		head[1] = value >> 8;
+		head[2] = value & 0xFF;
+		n = 3;
+	} else {
+		head[0] = major | 26;
+		head[1] = value >> 24;
+		head[2] = (value >> 16) & 0xFF;
+		head[3] = (value >> 8) & 0xFF;
+		head[4] = value & 0xFF;
+		n = 5;
+	}
+	return putRaw(head, n);
+}
+
+/***
+ * Write raw bytes
+ * @param data
+ * @param len
+ * @return false if buffer full
+ */
+bool CBOREncoder::putRaw(const void *data, size_t len){
+	if (!xOk || ((xLen - xPos) < len)){
+		xOk = false;
+		return false;
+	}
+	memcpy(&pBuf[xPos], data, len);
+	xPos += len;
+	return true;
+}
+
+/***
+ * Start a map, followed by pairs key then value
+ * @param pairs - number of pairs
+ * @return false if buffer full
+ */
+bool CBOREncoder::beginMap(uint32_t pairs){
+	return putHead(CBOR_MAP, pairs);
+}
+
+/***
+ * Start an array, followed by items
+ * @param items - number of items
+ * @return false if buffer full
+ */
+bool CBOREncoder::beginArray(uint32_t items){
+	return putHead(CBOR_ARRAY, items);
+}
+
+/***
+ * Write unsigned integer
+ * @param value
+ * @return false if buffer full
+ */
+bool CBOREncoder::putUInt(uint32_t value){
+	return putHead(CBOR_UINT, value);
+}
+
+/***
+ * Write signed integer
+ * @param value
+ * @return false if buffer full
+ */
+bool CBOREncoder::putInt(int32_t value){
+	if (value >= 0){
+		return putHead(CBOR_UINT, value);
+	}
+	//Negative n is held as -1 - n
+	return putHead(CBOR_NEGINT, (uint32_t)(-1 - value));
+}
+
+/***
+ * Write boolean
+ * @param value
+ * @return false if buffer full
+ */
+bool CBOREncoder::putBool(bool value){
+	return putHead(CBOR_SIMPLE, value ? CBOR_TRUE : CBOR_FALSE);
+}
+
+/***
+ * Write null
+ * @return false if buffer full
+ */
+bool CBOREncoder::putNull(){
+	return putHead(CBOR_SIMPLE, CBOR_NULL);
+}
+
+/***
+ * Write single precision float
+ * @param value
+ * @return false if buffer full
+ */
+bool CBOREncoder::putFloat(float value){
+	uint8_t b[5];
+	uint32_t bits;
+
+	memcpy(&bits, &value, sizeof(bits));
+	b[0] = (CBOR_SIMPLE << 5) | CBOR_FLOAT32;
+	b[1] = bits >> 24;
+	b[2] = (bits >> 16) & 0xFF;
+	b[3] = (bits >> 8) & 0xFF;
+	b[4] = bits & 0xFF;
+	return putRaw(b, sizeof(b));
+}
+
+/***
+ * Write text string
+ * @param str - zero terminated string
+ * @return false if buffer full
+ */
+bool CBOREncoder::putString(const char *str){
+	return putString(str, strlen(str));
+}
+
+/***
+ * Write text string
+ * @param str - string, not terminated
+ * @param len - length of string
+ * @return false if buffer full
+ */
+bool CBOREncoder::putString(const char *str, size_t len){
+	if (!putHead(CBOR_TEXT, len)){
+		return false;
+	}
+	return putRaw(str, len);
+}
+
+/***
+ * Write byte string
+ * @param data
+ * @param len
+ * @return false if buffer full
+ */
+bool CBOREncoder::putBytes(const void *data, size_t len){
+	if (!putHead(CBOR_BYTES, len)){
+		return false;
+	}
+	return putRaw(data, len);
+}
+
+/***
+ * Bytes written so far
+ * @return
+ */
+size_t CBOREncoder::length(){
+	return xPos;
+}
+
+/***
+ * Has everything written fitted in the buffer
+ * @return
+ */
+bool CBOREncoder::isOk(){
+	return xOk;
+}
@@ -0,0 +1,135 @@
+/*
+ * CBOREncoder.h
+ *
+ * Minimal CBOR (RFC 8949) encoder writing into a caller supplied buffer,
+ * a compact binary alternative to json_maker for state payloads.
+ * Only definite length items are written.
+ */
+
+#ifndef SRC_CBORENCODER_H_
+#define SRC_CBORENCODER_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+class CBOREncoder {
+public:
+	/***
+	 * Constructor
+	 * @param buf - buffer to write to
+	 * @param len - length of buffer
+	 */
+	CBOREncoder(uint8_t *buf, size_t len);
+
+	/***
+	 * Destructor
+	 */
+	virtual ~CBOREncoder();
+
+	/***
+	 * Start a map, followed by pairs key then value
+	 * @param pairs - number of pairs
+	 * @return false if buffer full
+	 */
+	bool beginMap(uint32_t pairs);
+
+	/***
+	 * Start an array, followed by items
+	 * @param items - number of items
+	 * @return false if buffer full
+	 */
+	bool beginArray(uint32_t items);
+
+	/***
+	 * Write unsigned integer
+	 * @param value
+	 * @return false if buffer full
+	 */
+	bool putUInt(uint32_t value);
+
+	/***
+	 * Write signed integer
+	 * @param value
+	 * @return false if buffer full
+	 */
+	bool putInt(int32_t value);
+
+	/***
+	 * Write boolean
+	 * @param value
+	 * @return false if buffer full
+	 */
+	bool putBool(bool value);
+
+	/***
+	 * Write null
+	 * @return false if buffer full
+	 */
+	bool putNull();
+
+	/***
+	 * Write single precision float
+	 * @param value
+	 * @return false if buffer full
+	 */
+	bool putFloat(float value);
+
+	/***
+	 * Write text string
+	 * @param str - zero terminated string
+	 * @return false if buffer full
+	 */
+	bool putString(const char *str);
+
+	/***
+	 * Write text string
+	 * @param str - string, not terminated
+	 * @param len - length of string
+	 * @return false if buffer full
+	 */
+	bool putString(const char *str, size_t len);
+
+	/***
+	 * Write byte string
+	 * @param data
+	 * @param len
+	 * @return false if buffer full
+	 */
+	bool putBytes(const void *data, size_t len);
+
+	/***
+	 * Bytes written so far
+	 * @return
+	 */
+	size_t length();
+
+	/***
+	 * Has everything written fitted in the buffer
+	 * @return
+	 */
+	bool isOk();
+
+private:
+	/***
+	 * Write item head, major type and argument
+	 * @param major - major type 0 to 7
+	 * @param value - argument
+	 * @return false if buffer full
+	 */
+	bool putHead(uint8_t major, uint32_t value);
+
+	/***
+	 * Write raw bytes
+	 * @param data
+	 * @param len
+	 * @return false if buffer full
+	 */
+	bool putRaw(const void *data, size_t len);
+
+	uint8_t *pBuf;
+	size_t xLen;
+	size_t xPos = 0;
+	bool xOk = true;
+};
+
+#endif /* SRC_CBORENCODER_H_ */
@@ -0,0 +1,203 @@
+/*
+ * DNSCache.cpp
+ *
+ * Small fixed capacity cache of DNS answers, honouring the TTL returned
+ * by the server.
+ */
+
+#include "DNSCache.h"
+#include <string.h>
+
+extern "C" {
+#include <FreeRTOS.h>
+#include <task.h>
+}
+
+/***
+ * Constructor
+ */
+DNSCache::DNSCache() {
+	memset(xEntries, 0, sizeof(xEntries));
+	memset(&xStats, 0, sizeof(xStats));
+}
+
+/***
+ * Destructor
+ */
+DNSCache::~DNSCache() {
+	// NOP
+}
+
+/***
+ * Find entry for host
+ * @param host
+ * @return entry or NULL
+ */
+DNSCache::DNSCacheEntry *DNSCache::find(const char *host){
+	for (uint8_t i=0; i < DNS_CACHE_SIZE; i++){
+		if (xEntries[i].valid && (strcmp(xEntries[i].host, host) == 0)){
+			return &xEntries[i];
+		}
+	}
+	return NULL;
+}
+
+/***
+ * Lookup host in the cache
+ * @param host - host name
+ * @param ip - output uint8_t[4]
+ * @param nowMs - current time in ms
+ * @return true if found, including a stale entry within DNS_CACHE_STALE_SECS
+ */
+bool DNSCache::lookup(const char *host, uint8_t *ip, uint32_t nowMs){
+	bool res = false;
+
+	taskENTER_CRITICAL();
+	DNSCacheEntry *e = find(host);
+	if (e != NULL){
+		uint32_t age = nowMs - e->storedMs;
+		if (age < e->ttlMs){
+			xStats.hits++;
+			res = true;
+		} else if ((age - e->ttlMs) < (DNS_CACHE_STALE_SECS * 1000)){
+			xStats.staleHits++;
+			res = true;
+		} else {
+			e->valid = false;
+		}
+		if (res){
+			memcpy(ip, e->ip, 4);
+			e->lastUsedMs = nowMs;
+			if (xStats.lookups > 0){
+				xStats.savedMs += xStats.lookupMs / xStats.lookups;
+			}
+		}
+	}
+	if (!res){
+		xStats.misses++;
+	}
+	taskEXIT_CRITICAL();
+
+	return res;
+}
+
+/***
+ * Store an answer in the cache
+ * @param host - host name
+ * @param ip - uint8_t[4]
+ * @param ttl - TTL in seconds from the DNS answer
+ * @param nowMs - current time in ms
+ */
+void DNSCache::store(const char *host, const uint8_t *ip, uint32_t ttl, uint32_t nowMs){
+	if (strlen(host) >= DNS_CACHE_HOST_LEN){
+		return;
+	}
+	if (ttl < DNS_CACHE_MIN_TTL){
+		ttl = DNS_CACHE_MIN_TTL;
+	}
+	if (ttl > DNS_CACHE_MAX_TTL){
+		ttl = DNS_CACHE_MAX_TTL;
+	}
+
+	taskENTER_CRITICAL();
+	DNSCacheEntry *e = find(host);
+	if (e == NULL){
+		//Take a free slot or evict the least recently used
+		e = &xEntries[0];
+		for (uint8_t i=0; i < DNS_CACHE_SIZE; i++){
+			if (!xEntries[i].valid){
+				e = &xEntries[i];
+				break;
+			}
+			if ((nowMs - xEntries[i].lastUsedMs) > (nowMs - e->lastUsedMs)){
+				e = &xEntries[i];
+			}
+		}
+		if (e->valid){
+			xStats.evictions++;
+		}
+		strcpy(e->host, host);
+		e->lastUsedMs = nowMs;
+	}
+	memcpy(e->ip, ip, 4);
+	e->storedMs = nowMs;
+	e->ttlMs = ttl * 1000;
+	e->lastTryMs = nowMs;
+	e->valid = true;
+	taskEXIT_CRITICAL();
+}
+
+/***
+ * Find an entry that is due a background refresh
+ * @param host - output buffer of DNS_CACHE_HOST_LEN
+ * @param nowMs - current time in ms
+ * @return true if host has been filled in
+ */
+bool DNSCache::nextRefresh(char *host, uint32_t nowMs){
+	bool res = false;
+
+	taskENTER_CRITICAL();
+	for (uint8_t i=0; i < DNS_CACHE_SIZE; i++){
+		DNSCacheEntry *e = &xEntries[i];
+		if (!e->valid){
+			continue;
+		}
+		uint32_t age = nowMs - e->storedMs;
+		if ((age >= (e->ttlMs / 100) * DNS_CACHE_REFRESH_PERCENT) &&
+				((nowMs - e->lastTryMs) >= DNS_CACHE_RETRY_MS)){
+			e->lastTryMs = nowMs;
+			strcpy(host, e->host);
+			res = true;
+			break;
+		}
+	}
+	taskEXIT_CRITICAL();
+
+	return res;
+}
+
+/***
+ * Record the outcome of a background refresh
+ * @param ok - true if the refresh succeeded
+ */
+void DNSCache::refreshed(bool ok){
+	taskENTER_CRITICAL();
+	if (ok){
+		xStats.refreshes++;
+	} else {
+		xStats.refreshFails++;
+	}
+	taskEXIT_CRITICAL();
+}
+
+/***
+ * Record time taken for a network lookup
+ * @param ms
+ */
+void DNSCache::recordLookup(uint32_t ms){
+	taskENTER_CRITICAL();
+	xStats.lookups++;
+	xStats.lookupMs += ms;
+	taskEXIT_CRITICAL();
+}
+
+/***
+ * Remove all entries
+ */
+void DNSCache::flush(){
+	taskENTER_CRITICAL();
+	for (uint8_t i=0; i < DNS_CACHE_SIZE; i++){
+		xEntries[i].valid = false;
+	}
+	taskEXIT_CRITICAL();
+}
+
+/***
+ * Copy of the counters
+ * @param stats - output
+ */
+void DNSCache::getStats(DNSCacheStats *stats){
+	taskENTER_CRITICAL();
+	memcpy(stats, &xStats, sizeof(DNSCacheStats));
+	taskEXIT_CRITICAL();
+}
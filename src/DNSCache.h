@@ -0,0 +1,145 @@
+/*
+ * DNSCache.h
+ *
+ * Small fixed capacity cache of DNS answers, honouring the TTL returned
+ * by the server. Entries are refreshed ahead of expiry and a stale answer
+ * is kept if a refresh fails.
+ */
+
+#ifndef SRC_DNSCACHE_H_
+#define SRC_DNSCACHE_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifndef DNS_CACHE_SIZE
+#define DNS_CACHE_SIZE 4
+#endif
+
+#ifndef DNS_CACHE_HOST_LEN
+#define DNS_CACHE_HOST_LEN 64
+#endif
+
+//TTL clamps in seconds
+#ifndef DNS_CACHE_MIN_TTL
+#define DNS_CACHE_MIN_TTL 30
+#endif
+
+#ifndef DNS_CACHE_MAX_TTL
+#define DNS_CACHE_MAX_TTL 86400
+#endif
+
+//Percentage of TTL after which entry is refreshed in the background
+#ifndef DNS_CACHE_REFRESH_PERCENT
+#define DNS_CACHE_REFRESH_PERCENT 75
+#endif
+
+//Minimum ms between refresh attempts of one entry
+#ifndef DNS_CACHE_RETRY_MS
+#define DNS_CACHE_RETRY_MS 10000
+#endif
+
+//Seconds past expiry that a stale answer is still served
+#ifndef DNS_CACHE_STALE_SECS
+#define DNS_CACHE_STALE_SECS 3600
+#endif
+
+/***
+ * Counters for the cache
+ */
+typedef struct {
+	uint32_t hits;			//Answered from cache
+	uint32_t staleHits;		//Answered from an expired entry
+	uint32_t misses;		//Had to go to the network
+	uint32_t refreshes;		//Background refresh succeeded
+	uint32_t refreshFails;	//Background refresh failed
+	uint32_t evictions;		//Entry replaced to make room
+	uint32_t lookups;		//Network lookups timed
+	uint32_t lookupMs;		//Total ms spent in network lookups
+	uint32_t savedMs;		//Estimate of ms saved by hits
+} DNSCacheStats;
+
+class DNSCache {
+public:
+	/***
+	 * Constructor
+	 */
+	DNSCache();
+
+	/***
+	 * Destructor
+	 */
+	virtual ~DNSCache();
+
+	/***
+	 * Lookup host in the cache
+	 * @param host - host name
+	 * @param ip - output uint8_t[4]
+	 * @param nowMs - current time in ms
+	 * @return true if found, including a stale entry within DNS_CACHE_STALE_SECS
+	 */
+	bool lookup(const char *host, uint8_t *ip, uint32_t nowMs);
+
+	/***
+	 * Store an answer in the cache
+	 * @param host - host name
+	 * @param ip - uint8_t[4]
+	 * @param ttl - TTL in seconds from the DNS answer
+	 * @param nowMs - current time in ms
+	 */
+	void store(const char *host, const uint8_t *ip, uint32_t ttl, uint32_t nowMs);
+
+	/***
+	 * Find an entry that is due a background refresh
+	 * @param host - output buffer of DNS_CACHE_HOST_LEN
+	 * @param nowMs - current time in ms
+	 * @return true if host has been filled in
+	 */
+	bool nextRefresh(char *host, uint32_t nowMs);
+
+	/***
+	 * Record the outcome of a background refresh
+	 * @param ok - true if the refresh succeeded
+	 */
+	void refreshed(bool ok);
+
+	/***
+	 * Record time taken for a network lookup
+	 * @param ms
+	 */
+	void recordLookup(uint32_t ms);
+
+	/***
+	 * Remove all entries
+	 */
+	void flush();
+
+	/***
+	 * Copy of the counters
+	 * @param stats - output
+	 */
+	void getStats(DNSCacheStats *stats);
+
+private:
+	typedef struct {
+		char host[DNS_CACHE_HOST_LEN];
+		uint8_t ip[4];
+		uint32_t storedMs;
+		uint32_t ttlMs;
+		uint32_t lastUsedMs;
+		uint32_t lastTryMs;
+		bool valid;
+	} DNSCacheEntry;
+
+	/***
+	 * Find entry for host
+	 * @param host
+	 * @return entry or NULL
+	 */
+	DNSCacheEntry *find(const char *host);
+
+	DNSCacheEntry xEntries[DNS_CACHE_SIZE];
+	DNSCacheStats xStats;
+};
+
+#endif /* SRC_DNSCACHE_H_ */
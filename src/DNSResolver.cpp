@@ -0,0 +1,364 @@
+/*
+ * DNSResolver.cpp
+ *
+ * Non blocking DNS resolver
+ */
+
+#include "DNSResolver.h"
+#include "EthHelper.h"
+#include "MQTTConfig.h"
+#include <string.h>
+
+#define DNS_PORT 53
+#define DNS_HEADER_LEN 12
+#define DNS_TYPE_A 1
+#define DNS_CLASS_IN 1
+
+/***
+ * Constructor, requires init to be called
+ */
+DNSResolver::DNSResolver() {
+	xHost[0] = 0;
+}
+
+/***
+ * Destructor
+ */
+DNSResolver::~DNSResolver() {
+	// NOP
+}
+
+/***
+ * Provide socket and ethernet helper
+ * @param sock - UDP socket id
+ * @param eth - Ethernet helper
+ */
+void DNSResolver::init(uint8_t sock, EthHelper *eth){
+	xSock = sock;
+	pEth = eth;
+}
+
+/***
+ * Set secondary server which is raced against the primary
+ * @param ip - uint8_t[4], NULL or 0.0.0.0 to disable
+ */
+void DNSResolver::setSecondary(const uint8_t *ip){
+	if (ip == NULL){
+		memset(xSecondary, 0, 4);
+	} else {
+		memcpy(xSecondary, ip, 4);
+	}
+}
+
+/***
+ * Start a query
+ * @param host - host name, copied
+ * @param primary - uint8_t[4] primary DNS server
+ * @return true if query was sent
+ */
+bool DNSResolver::start(const char *host, const uint8_t *primary){
+	if (xState == DNSPending){
+		cancel();
+	}
+	if (strlen(host) >= DNS_HOST_MAX){
+		LogError(("DNS host name too long %s", host));
+		xState = DNSFailed;
+		return false;
+	}
+	strcpy(xHost, host);
+	memcpy(xPrimary, primary, 4);
+
+	if (!pEth->udpSockOpen(xSock, 0)){
+		LogError(("DNS socket failed"));
+		xState = DNSFailed;
+		return false;
+	}
+
+	xId++;
+	xSends = 0;
+	xStartMs = to_ms_since_boot(get_absolute_time ());
+	xState = DNSPending;
+	if (!sendQuery()){
+		finish(DNSFailed);
+		return false;
+	}
+	return true;
+}
+
+/***
+ * Send query to both servers
+ * @return true if sent to at least one
+ */
+bool DNSResolver::sendQuery(){
+	bool res = false;
+	uint16_t len = makeQuery(xBuf, DNS_MSG_MAX, xId, xHost);
+	if (len == 0){
+		LogError(("DNS bad host name %s", xHost));
+		return false;
+	}
+
+	if (pEth->udpSockSendTo(xSock, xBuf, len, xPrimary, DNS_PORT) == len){
+		res = true;
+	}
+	if ((xSecondary[0] != 0) && (memcmp(xSecondary, xPrimary, 4) != 0)){
+		if (pEth->udpSockSendTo(xSock, xBuf, len, xSecondary, DNS_PORT) == len){
+			res = true;
+		}
+	}
+
+	xSends++;
+	xSentMs = to_ms_since_boot(get_absolute_time ());
+	return res;
+}
+
+/***
+ * Progress the query, does not block
+ * @return state of query
+ */
+DNSResolverState DNSResolver::poll(){
+	uint8_t srcIp[4];
+	uint16_t srcPort = 0;
+
+	if (xState != DNSPending){
+		return xState;
+	}
+
+	int32_t len = pEth->udpSockRecvFrom(xSock, xBuf, DNS_MSG_MAX, srcIp, &srcPort);
+	if (len < 0){
+		finish(DNSFailed);
+		return xState;
+	}
+	if (len > 0){
+		bool fromServer = (memcmp(srcIp, xPrimary, 4) == 0) ||
+				(memcmp(srcIp, xSecondary, 4) == 0);
+		if ((srcPort == DNS_PORT) && fromServer &&
+				parseReply(xBuf, len, xId, xIp, &xTtl)){
+			finish(DNSDone);
+			return xState;
+		}
+	}
+
+	uint32_t now = to_ms_since_boot(get_absolute_time ());
+	if ((now - xStartMs) >= DNS_TIMEOUT_MS){
+		LogDebug(("DNS timeout for %s\n", xHost));
+		finish(DNSFailed);
+	} else if ((xSends < DNS_RETRY_COUNT) &&
+			((now - xSentMs) >= (DNS_TIMEOUT_MS / DNS_RETRY_COUNT))){
+		sendQuery();
+	}
+	return xState;
+}
+
+/***
+ * Finish the query and close the socket
+ * @param s - final state
+ */
+void DNSResolver::finish(DNSResolverState s){
+	pEth->udpSockClose(xSock);
+	xElapsedMs = to_ms_since_boot(get_absolute_time ()) - xStartMs;
+	xState = s;
+}
+
+/***
+ * Abandon any running query
+ */
+void DNSResolver::cancel(){
+	if (xState == DNSPending){
+		finish(DNSFailed);
+	}
+}
+
+/***
+ * Get current state
+ * @return
+ */
+DNSResolverState DNSResolver::getState(){
+	return xState;
+}
+
+/***
+ * Get result of a completed query
+ * @param ip - output uint8_t[4]
+ * @param ttl - output TTL in seconds
+ * @return true if query succeeded
+ */
+bool DNSResolver::getResult(uint8_t *ip, uint32_t *ttl){
+	if (xState != DNSDone){
+		return false;
+	}
+	memcpy(ip, xIp, 4);
+	*ttl = xTtl;
+	return true;
+}
+
+/***
+ * Host of current or last query
+ * @return
+ */
+const char *DNSResolver::getHost(){
+	return xHost;
+}
+
+/***
+ * Time taken by last query in ms
+ * @return
+ */
+uint32_t DNSResolver::getElapsedMs(){
+	return xElapsedMs;
+}
+
+/***
+ * Parse a dotted decimal IP address
+ * @param host - string
+ * @param ip - output uint8_t[4]
+ * @return true if host was an IP address
+ */
+bool DNSResolver::parseIP(const char *host, uint8_t *ip){
+	uint16_t octet = 0;
+	uint8_t dots = 0;
+	uint8_t digits = 0;
+
+	for (const char *c = host; *c != 0; c++){
+		if ((*c >= '0') && (*c <= '9')){
+			octet = octet * 10 + (*c - '0');
+			digits++;
+			if ((octet > 255) || (digits > 3)){
+				return false;
+			}
+		} else if ((*c == '.') && (digits > 0) && (dots < 3)){
+			ip[dots++] = octet;
+			octet = 0;
+			digits = 0;
+		} else {
+			return false;
+		}
+	}
+	if ((dots != 3) || (digits == 0)){
+		return false;
+	}
+	ip[3] = octet;
+	return true;
+}
+
+/***
+ * Build a DNS query for an A record
+ * @param buf - buffer to write to
+ * @param len - length of buffer
+ * @param id - query id
+ * @param host - host name
+ * @return length of query, 0 if it did not fit
+ */
+uint16_t DNSResolver::makeQuery(uint8_t *buf, uint16_t len, uint16_t id, const char *host){
+	uint16_t pos = DNS_HEADER_LEN;
+	size_t hostLen = strlen(host);
+
+	if ((hostLen == 0) || (hostLen > 253) || ((DNS_HEADER_LEN + hostLen + 6) > len)){
+		return 0;
+	}
+
+	memset(buf, 0, DNS_HEADER_LEN);
+	buf[0] = id >> 8;
+	buf[1] = id & 0xFF;
+	buf[2] = 0x01;	//Recursion desired
+	buf[5] = 1;		//One question
+
+	const char *label = host;
+	while (*label != 0){
+		const char *dot = strchr(label, '.');
+		size_t l = (dot == NULL) ? strlen(label) : (size_t)(dot - label);
+		if ((l == 0) || (l > 63)){
+			return 0;
+		}
+		buf[pos++] = l;
+		memcpy(&buf[pos], label, l);
+		pos += l;
+		label += l;
+		if (*label == '.'){
+			label++;
+		}
+	}
+	buf[pos++] = 0;
+	buf[pos++] = 0;
+	buf[pos++] = DNS_TYPE_A;
+	buf[pos++] = 0;
+	buf[pos++] = DNS_CLASS_IN;
+	return pos;
+}
+
+/***
+ * Skip over a possibly compressed name in a DNS message
+ * @param buf - message
+ * @param len - message length
+ * @param pos - start of name
+ * @return position after name or -1 if malformed
+ */
+int32_t DNSResolver::skipName(const uint8_t *buf, uint16_t len, int32_t pos){
+	while (pos < len){
+		uint8_t l = buf[pos];
+		if (l == 0){
+			return pos + 1;
+		}
+		if ((l & 0xC0) == 0xC0){
+			return pos + 2;
+		}
+		pos += l + 1;
+	}
+	return -1;
+}
+
+/***
+ * Parse DNS reply for first A record
+ * @param buf - message
+ * @param len - message length
+ * @param id - id of the query
+ * @param ip - output uint8_t[4]
+ * @param ttl - output, lowest TTL in seconds on the answer chain
+ * @return true if an A record was found
+ */
+bool DNSResolver::parseReply(const uint8_t *buf, uint16_t len, uint16_t id, uint8_t *ip, uint32_t *ttl){
+	if (len < DNS_HEADER_LEN){
+		return false;
+	}
+	if ((((buf[0] << 8) | buf[1]) != id) || ((buf[2] & 0x80) == 0) || ((buf[3] & 0x0F) != 0)){
+		return false;
+	}
+
+	uint16_t qdCount = (buf[4] << 8) | buf[5];
+	uint16_t anCount = (buf[6] << 8) | buf[7];
+	int32_t pos = DNS_HEADER_LEN;
+	uint32_t minTtl = 0xFFFFFFFF;
+
+	for (uint16_t i=0; i < qdCount; i++){
+		pos = skipName(buf, len, pos);
+		if ((pos < 0) || ((pos + 4) > len)){
+			return false;
+		}
+		pos += 4;
+	}
+
+	for (uint16_t i=0; i < anCount; i++){
+		pos = skipName(buf, len, pos);
+		if ((pos < 0) || ((pos + 10) > len)){
+			return false;
+		}
+		uint16_t type  = (buf[pos] << 8) | buf[pos+1];
+		uint16_t cls   = (buf[pos+2] << 8) | buf[pos+3];
+		uint32_t t     = ((uint32_t)buf[pos+4] << 24) | ((uint32_t)buf[pos+5] << 16) |
+						 ((uint32_t)buf[pos+6] << 8) | buf[pos+7];
+		uint16_t rdLen = (buf[pos+8] << 8) | buf[pos+9];
+		pos += 10;
+		if ((pos + rdLen) > len){
+			return false;
+		}
+		if (t < minTtl){
+			minTtl = t;
+		}
+		if ((type == DNS_TYPE_A) && (cls == DNS_CLASS_IN) && (rdLen == 4)){
+			memcpy(ip, &buf[pos], 4);
+			*ttl = minTtl;
+			return true;
+		}
+		pos += rdLen;
+	}
+	return false;
+}
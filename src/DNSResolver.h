@@ -0,0 +1,188 @@
+/*
+ * DNSResolver.h
+ *
+ * Non blocking DNS resolver. A query is started and then progressed by
+ * calling poll, the Ethernet mutex is only held for each UDP operation.
+ * The query is raced against a primary and secondary server and the
+ * first valid answer is taken.
+ */
+
+#ifndef SRC_DNSRESOLVER_H_
+#define SRC_DNSRESOLVER_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+//Overall timeout for a query
+#ifndef DNS_TIMEOUT_MS
+#define DNS_TIMEOUT_MS 3000
+#endif
+
+//Number of times query is sent within the timeout
+#ifndef DNS_RETRY_COUNT
+#define DNS_RETRY_COUNT 2
+#endif
+
+//Largest DNS message over UDP
+#ifndef DNS_MSG_MAX
+#define DNS_MSG_MAX 512
+#endif
+
+#ifndef DNS_HOST_MAX
+#define DNS_HOST_MAX 64
+#endif
+
+class EthHelper;
+
+enum DNSResolverState { DNSIdle, DNSPending, DNSDone, DNSFailed };
+
+/***
+ * Callback on completion of an asynchronous query
+ * @param host - host name queried
+ * @param ip - uint8_t[4] address or NULL if failed
+ * @param ctx - context provided when query started
+ */
+typedef void (*DNSResolverCallback)(const char *host, const uint8_t *ip, void *ctx);
+
+class DNSResolver {
+public:
+	/***
+	 * Constructor, requires init to be called
+	 */
+	DNSResolver();
+
+	/***
+	 * Destructor
+	 */
+	virtual ~DNSResolver();
+
+	/***
+	 * Provide socket and ethernet helper
+	 * @param sock - UDP socket id
+	 * @param eth - Ethernet helper
+	 */
+	void init(uint8_t sock, EthHelper *eth);
+
+	/***
+	 * Set secondary server which is raced against the primary
+	 * @param ip - uint8_t[4], NULL or 0.0.0.0 to disable
+	 */
+	void setSecondary(const uint8_t *ip);
+
+	/***
+	 * Start a query
+	 * @param host - host name, copied
+	 * @param primary - uint8_t[4] primary DNS server
+	 * @return true if query was sent
+	 */
+	bool start(const char *host, const uint8_t *primary);
+
+	/***
+	 * Progress the query, does not block
+	 * @return state of query
+	 */
+	DNSResolverState poll();
+
+	/***
+	 * Abandon any running query
+	 */
+	void cancel();
+
+	/***
+	 * Get current state
+	 * @return
+	 */
+	DNSResolverState getState();
+
+	/***
+	 * Get result of a completed query
+	 * @param ip - output uint8_t[4]
+	 * @param ttl - output TTL in seconds
+	 * @return true if query succeeded
+	 */
+	bool getResult(uint8_t *ip, uint32_t *ttl);
+
+	/***
+	 * Host of current or last query
+	 * @return
+	 */
+	const char *getHost();
+
+	/***
+	 * Time taken by last query in ms
+	 * @return
+	 */
+	uint32_t getElapsedMs();
+
+	/***
+	 * Parse a dotted decimal IP address
+	 * @param host - string
+	 * @param ip - output uint8_t[4]
+	 * @return true if host was an IP address
+	 */
+	static bool parseIP(const char *host, uint8_t *ip);
+
+private:
+	/***
+	 * Send query to both servers
+	 * @return true if sent to at least one
+	 */
+	bool sendQuery();
+
+	/***
+	 * Finish the query and close the socket
+	 * @param s - final state
+	 */
+	void finish(DNSResolverState s);
+
+	/***
+	 * Build a DNS query for an A record
+	 * @param buf - buffer to write to
+	 * @param len - length of buffer
+	 * @param id - query id
+	 * @param host - host name
+	 * @return length of query, 0 if it did not fit
+	 */
+	static uint16_t makeQuery(uint8_t *buf, uint16_t len, uint16_t id, const char *host);
+
+	/***
+	 * Skip over a possibly compressed name in a DNS message
+	 * @param buf - message
+	 * @param len - message length
+	 * @param pos - start of name
+	 * @return position after name or -1 if malformed
+	 */
+	static int32_t skipName(const uint8_t *buf, uint16_t len, int32_t pos);
+
+	/***
+	 * Parse DNS reply for first A record
+	 * @param buf - message
+	 * @param len - message length
+	 * @param id - id of the query
+	 * @param ip - output uint8_t[4]
+	 * @param ttl - output, lowest TTL in seconds on the answer chain
+	 * @return true if an A record was found
+	 */
+	static bool parseReply(const uint8_t *buf, uint16_t len, uint16_t id, uint8_t *ip, uint32_t *ttl);
+
+	EthHelper *pEth = NULL;
+	uint8_t xSock = 0;
+
+	uint8_t xPrimary[4];
+	uint8_t xSecondary[4] = {0, 0, 0, 0};
+
+	DNSResolverState xState = DNSIdle;
+	char xHost[DNS_HOST_MAX];
+	uint16_t xId = 1;
+	uint8_t xSends = 0;
+	uint32_t xStartMs = 0;
+	uint32_t xSentMs = 0;
+	uint32_t xElapsedMs = 0;
+
+	uint8_t xIp[4];
+	uint32_t xTtl = 0;
+
+	uint8_t xBuf[DNS_MSG_MAX];
+};
+
+#endif /* SRC_DNSRESOLVER_H_ */
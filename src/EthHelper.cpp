@@ -11,19 +11,69 @@
 #include "FreeRTOS.h"
 #include "task.h"
 
-#include "sntp.h"
 #include "hardware/rtc.h"
 #include "pico/unique_id.h"
-
-#define SOCKET_SNTP 2
-#define SOCKET_DNS  1
-#define SOCKET_DHCP 0
+#include "hardware/gpio.h"
+
+
+//Lease time reported by ioLibrary for an infinite lease
+#ifndef INFINITE_LEASETIME
+#define INFINITE_LEASETIME 0xffffffff
+#endif
+
+//Leases are timed in ms so longer ones are treated as this
+#define DHCP_MAX_LEASE_SECS 2000000
+
+//Seconds after T1 before the renewal is started, so ioLibrary's own one
+//second lease tick is past T1 and it sends the REQUEST on the first run
+#define DHCP_T1_SLACK_SECS 2
+
+//WIZnet SNTP time zone index, 22 is UTC
+#define SNTP_TZ 22
+
+#if _WIZCHIP_SOCK_NUM_ == 8
+const EthMemProfile EthHelper::MEM_BALANCED = {
+		{2, 2, 2, 2, 2, 2, 2, 2},
+		{2, 2, 2, 2, 2, 2, 2, 2}
+};
+const EthMemProfile EthHelper::MEM_BULK = {
+		{1, 8, 2, 1, 1, 1, 1, 1},
+		{1, 8, 2, 1, 1, 1, 1, 1}
+};
+#else
+const EthMemProfile EthHelper::MEM_BALANCED = {
+		{2, 2, 2, 2},
+		{2, 2, 2, 2}
+};
+const EthMemProfile EthHelper::MEM_BULK = {
+		{1, 4, 2, 1},
+		{1, 4, 2, 1}
+};
+#endif
 
 /***
 * Constructor, requires init to be called afterwoods
 */
 EthHelper::EthHelper() {
 	EthHelper::obj = this;
+	memset(&xSockStats, 0, sizeof(xSockStats));
+	memset(xSockAllocMs, 0, sizeof(xSockAllocMs));
+	memcpy(xSockTxKB, MEM_BALANCED.tx, sizeof(xSockTxKB));
+	memcpy(xSockRxKB, MEM_BALANCED.rx, sizeof(xSockRxKB));
+	xHelperSock = sockAlloc();
+	xDNSResolver.init(xHelperSock, this);
+	memset(pSockEventCb, 0, sizeof(pSockEventCb));
+	memset(pSockEventCtx, 0, sizeof(pSockEventCtx));
+	memset(xSockLastPoll, 0, sizeof(xSockLastPoll));
+	memset(&xReadStats, 0, sizeof(xReadStats));
+	memset(&xServiceStats, 0, sizeof(xServiceStats));
+	xSntpMutex = xSemaphoreCreateMutexStatic(&xSntpMutexBuffer);
+	xSntpDone = xSemaphoreCreateBinaryStatic(&xSntpDoneBuffer);
+	xDhcpDone = xSemaphoreCreateBinaryStatic(&xDhcpDoneBuffer);
+	memset(pDhcpCb, 0, sizeof(pDhcpCb));
+	memset(pDhcpCtx, 0, sizeof(pDhcpCtx));
+	memset(pLinkCb, 0, sizeof(pLinkCb));
+	memset(pLinkCtx, 0, sizeof(pLinkCtx));
 }
 
 /***
@@ -39,13 +89,23 @@ void EthHelper::enableMutex(){
 	} else {
 		xSemaphoreGive( xSemaphore );
 	}
+
+	xDnsSemaphore = xSemaphoreCreateBinary();
+	if( xDnsSemaphore == NULL )
+	{
+		LogError(("Can't create DNS semaphore"));
+	} else {
+		xSemaphoreGive( xDnsSemaphore );
+	}
 }
 
 /***
  * Initialise and provide a buffer of length ETHERNET_BUF_MAX_SIZE
  * @param pBuf
+ * @param profile - socket memory split, NULL leaves the even split
+ * set by wizchip_initialize
  */
-void EthHelper::init(uint8_t * pBuf){
+void EthHelper::init(uint8_t * pBuf, const EthMemProfile *profile){
 	pEthernetBuf = pBuf;
 
 	wizchip_spi_initialize();
@@ -55,10 +115,69 @@ void EthHelper::init(uint8_t * pBuf){
 	wizchip_initialize();
 	wizchip_check();
 
+	if (profile != NULL){
+		setMemProfile(profile);
+	}
+
 	wizchip_1ms_timer_initialize(EthHelper::cbRepeatingTimer);
 
 }
 
+/***
+ * Set the split of socket memory, sockets should be closed
+ * @param profile - sizes for each socket
+ * @return false if the profile does not fit and was not applied
+ */
+bool EthHelper::setMemProfile(const EthMemProfile *profile){
+	int8_t memsize[2][8];
+	uint16_t txTotal = 0;
+	uint16_t rxTotal = 0;
+	int8_t res = -1;
+
+	memset(memsize, 0, sizeof(memsize));
+	for (uint8_t i=0; i < _WIZCHIP_SOCK_NUM_; i++){
+		uint8_t t = profile->tx[i];
+		uint8_t r = profile->rx[i];
+		if ((t & (t - 1)) || (r & (r - 1)) || (t > 16) || (r > 16)){
+			LogError(("Socket %d memory must be 0, 1, 2, 4, 8 or 16 KB", i));
+			return false;
+		}
+		txTotal += t;
+		rxTotal += r;
+		memsize[0][i] = t;
+		memsize[1][i] = r;
+	}
+	if ((txTotal > ETH_CHIP_MEM_KB) || (rxTotal > ETH_CHIP_MEM_KB)){
+		LogError(("Memory profile TX %dKB RX %dKB exceeds %dKB",
+				txTotal, rxTotal, ETH_CHIP_MEM_KB));
+		return false;
+	}
+
+	if (lock()){
+		res = ctlwizchip(CW_INIT_WIZCHIP, (void *)memsize);
+		unlock();
+	}
+	if (res != 0){
+		LogError(("Memory profile rejected by chip"));
+		return false;
+	}
+	memcpy(xSockTxKB, profile->tx, sizeof(xSockTxKB));
+	memcpy(xSockRxKB, profile->rx, sizeof(xSockRxKB));
+	return true;
+}
+
+/***
+ * TX memory of a socket
+ * @param sock - socket id
+ * @return size in bytes
+ */
+uint16_t EthHelper::getSockTxSize(uint8_t sock){
+	if (sock >= _WIZCHIP_SOCK_NUM_){
+		return 0;
+	}
+	return xSockTxKB[sock] * 1024;
+}
+
 
 /***
  * Destructor
@@ -67,6 +186,9 @@ EthHelper::~EthHelper() {
 	if (xSemaphore != NULL){
 		vSemaphoreDelete( xSemaphore );
 	}
+	if (xDnsSemaphore != NULL){
+		vSemaphoreDelete( xDnsSemaphore );
+	}
 }
 
 
@@ -167,25 +289,7 @@ bool EthHelper::setMACAddress(uint8_t *mac){
  * @return true if sync was successful
  */
 bool EthHelper::syncRTCwithSNTP(const char **sntpSvrHosts, uint8_t count){
-	uint8_t ip[4];
-	char s[256]; // Local buffer as WizNet library does not use const properly
-
-	for (uint8_t j=0; j < 3; j++){
-		for (uint8_t i=0; i < count; i++){
-			strcpy(s, sntpSvrHosts[i]);
-			if (dnsClient(ip, s)){
-				//printf("SNTP for %s\n", s);
-				if (syncRTCwithSNTP(ip)){
-					printf("SNTP Success host %s\n", sntpSvrHosts[i]);
-					return true;
-				}
-				//vTaskDelay(10);
-			} else {
-				printf("SNTP DNS failed for %s\n", s);
-			}
-		}
-	}
-	return false;
+	return sntpSync(sntpSvrHosts, count, NULL);
 }
 
 /***
@@ -194,12 +298,8 @@ bool EthHelper::syncRTCwithSNTP(const char **sntpSvrHosts, uint8_t count){
  * @return true if sync was successful
  */
 bool EthHelper::syncRTCwithSNTP(char *sntpSvrHost){
-	uint8_t ip[4];
-	if (dnsClient(ip, sntpSvrHost)){
-		//printf("SNTP for %s\n", sntpSvrHost);
-		return syncRTCwithSNTP(ip);
-	}
-	return false;
+	const char *hosts[1] = {sntpSvrHost};
+	return sntpSync(hosts, 1, NULL);
 }
 
 /***
@@ -233,69 +333,261 @@ void EthHelper::rtcInit(){
 }
 
 /***
- * Set RTC from SNTP Servers
- * @param sntpSvrHosts - array of strings
- * @param count - number of strings in array
- * @return true if sync was successful
+ * Set RTC from the SNTP server
+ * @param sntpSvrIp - ip address as uint8_t[4]
+ * @return true if sync with good date and time
  */
 bool EthHelper::syncRTCwithSNTP(uint8_t *sntpSvrIp){
-	uint8_t tz = 22;
-	uint8_t res, i;
-	datetime d;
-
+	return sntpSync(NULL, 0, sntpSvrIp);
+}
 
-	if( xSemaphore != NULL ){
-		if( xSemaphoreTake( xSemaphore, ( TickType_t ) ETHMUTEXTICKS ) == pdTRUE ){
+/***
+ * Run an SNTP sync and wait for the result. The work is done by the
+ * service task if running, only holding the mutex per packet.
+ * @param hosts - servers to try, NULL if ip given
+ * @param count - number of hosts
+ * @param ip - uint8_t[4] server, NULL if hosts given
+ * @return true if the RTC was set
+ */
+bool EthHelper::sntpSync(const char **hosts, uint8_t count, const uint8_t *ip){
+	bool res;
 
-			SNTP_init(SOCKET_SNTP, sntpSvrIp, tz, pEthernetBuf );
+	xSemaphoreTake(xSntpMutex, portMAX_DELAY);
 
-			for (uint32_t i=0; i < 0x10000; i++){
-				res = SNTP_run(&d);
-				if (d.yy >= 2022){
-					break;
-				}
-				vTaskDelay(10);
+	if ((xHandle == NULL) || (xTaskGetCurrentTaskHandle() == xHandle)){
+		//No service task so run the cycle here
+		if (xSntpState != SntpIdle){
+			sntpFinish(false);
+		}
+		sntpBegin(hosts, count, ip, false);
+		while (sntpPoll()){
+			vTaskDelay(SNTP_POLL_DELAY);
+			if (xDnsAsync){
+				dnsPoll();
 			}
-			xSemaphoreGive( xSemaphore );
-		} else {
-			LogError(("Did not get Mutex to initialise"));
-			return false;
 		}
 	} else {
-		SNTP_init(SOCKET_SNTP, sntpSvrIp, tz, pEthernetBuf );
+		//Wait for any background sync to finish then hand ours over
+		while (!sntpBegin(hosts, count, ip, true)){
+			vTaskDelay(SNTP_POLL_DELAY);
+		}
+		xTaskNotifyGive(xHandle);
+		xSemaphoreTake(xSntpDone, portMAX_DELAY);
+	}
+	res = xSntpOk;
+
+	xSemaphoreGive(xSntpMutex);
+	return res;
+}
+
+/***
+ * Start an SNTP cycle if none is running
+ * @param hosts - servers to try, NULL if ip given
+ * @param count - number of hosts
+ * @param ip - uint8_t[4] server, NULL if hosts given
+ * @param notify - give xSntpDone when finished
+ * @return true if started
+ */
+bool EthHelper::sntpBegin(const char **hosts, uint8_t count, const uint8_t *ip, bool notify){
+	bool res = false;
 
-		for (uint8_t i=0; i < 5; i++){
+	taskENTER_CRITICAL();
+	if (xSntpState == SntpIdle){
+		pSntpCycleHosts = hosts;
+		xSntpCycleCount = count;
+		xSntpIndex = 0;
+		xSntpNotify = notify;
+		xSntpOk = false;
+		if (ip != NULL){
+			memcpy(xSntpIp, ip, 4);
+			xSntpState = SntpQuery;
+		} else {
+			xSntpState = SntpResolve;
+		}
+		res = true;
+	}
+	taskEXIT_CRITICAL();
+
+	return res;
+}
+
+/***
+ * Progress the SNTP cycle, does not block. SNTP_run opens the socket,
+ * sends the request and collects the reply once the socket has data,
+ * it is called once per poll with the mutex held only for that call.
+ * @return true while the cycle is running
+ */
+bool EthHelper::sntpPoll(){
+	datetime d;
+	int8_t res = 0;
+
+	switch(xSntpState){
+	case SntpResolve:{
+		if ((xSntpCycleCount == 0) || (xSntpIndex >= (xSntpCycleCount * SNTP_ROUNDS))){
+			sntpFinish(false);
+			return false;
+		}
+		const char *host = pSntpCycleHosts[xSntpIndex % xSntpCycleCount];
+		if (xHandle == NULL){
+			sntpDnsCb(host, dnsClient(xSntpIp, host) ? xSntpIp : NULL, this);
+		} else {
+			xSntpState = SntpWaitDns;
+			if (!dnsStart(host, EthHelper::sntpDnsCb, this) &&
+					(xSntpState == SntpWaitDns)){
+				//Resolver busy, try again next poll
+				xSntpState = SntpResolve;
+			}
+		}
+		return true;
+	}
+	case SntpWaitDns:{
+		return true;
+	}
+	case SntpQuery:{
+		if (xHelperUser != EthHelperSntp){
+			//Wait for the shared helper socket
+			if (!helperClaim(EthHelperSntp)){
+				return true;
+			}
+			SNTP_init(xHelperSock, xSntpIp, SNTP_TZ, pEthernetBuf);
+			xSntpStartMs = nowMs();
+		}
+		if (lock((xHandle == NULL) ? ETHMUTEXTICKS : portMAX_DELAY)){
 			res = SNTP_run(&d);
-			if (d.yy >= 2022){
-				break;
+			unlock();
+		}
+		if ((res == 1) && rtcSet(&d)){
+			sntpFinish(true);
+			return false;
+		}
+		if ((nowMs() - xSntpStartMs) >= SNTP_SERVER_TIMEOUT_MS){
+			LogDebug(("SNTP timeout %d.%d.%d.%d\n",
+					xSntpIp[0], xSntpIp[1], xSntpIp[2], xSntpIp[3]));
+			if (lock((xHandle == NULL) ? ETHMUTEXTICKS : portMAX_DELAY)){
+				close(xHelperSock);
+				unlock();
 			}
-			vTaskDelay(10);
+			helperRelease(EthHelperSntp);
+			if (xSntpCycleCount == 0){
+				sntpFinish(false);
+				return false;
+			}
+			xSntpIndex++;
+			xSntpState = SntpResolve;
+		}
+		return true;
+	}
+	default:{
+		return false;
+	}
+	}
+}
+
+/***
+ * DNS answer for an SNTP server
+ * @param host - host queried
+ * @param ip - address or NULL on failure
+ * @param ctx - this object
+ */
+void EthHelper::sntpDnsCb(const char *host, const uint8_t *ip, void *ctx){
+	EthHelper *e = (EthHelper *)ctx;
+
+	if ((e->xSntpState != SntpWaitDns) && (e->xSntpState != SntpResolve)){
+		return;
+	}
+	if (ip == NULL){
+		printf("SNTP DNS failed for %s\n", host);
+		e->xSntpIndex++;
+		e->xSntpState = SntpResolve;
+		return;
+	}
+	if (ip != e->xSntpIp){
+		memcpy(e->xSntpIp, ip, 4);
+	}
+	e->xSntpState = SntpQuery;
+}
+
+/***
+ * End the SNTP cycle
+ * @param ok - true if RTC was set
+ */
+void EthHelper::sntpFinish(bool ok){
+	uint32_t now = nowMs();
+
+	helperRelease(EthHelperSntp);
+	xSntpOk = ok;
+	if (ok){
+		xSntpSynced = true;
+		xSntpSyncMs = now;
+		xSntpNextMs = now + SNTP_SYNC_INTERVAL_MS;
+	} else {
+		printf("SNTP Failed\n");
+		xSntpNextMs = now + SNTP_RETRY_MS;
+	}
+
+	taskENTER_CRITICAL();
+	bool notify = xSntpNotify;
+	xSntpNotify = false;
+	xSntpState = SntpIdle;
+	taskEXIT_CRITICAL();
+
+	if (notify){
+		xSemaphoreGive(xSntpDone);
+	}
+}
+
+/***
+ * Start a background sync if one is due
+ */
+void EthHelper::sntpSchedule(){
+	if ((pSntpSvrHosts == NULL) || (xSntpState != SntpIdle)){
+		return;
+	}
+	if (xSntpSynced || (xSntpNextMs != 0)){
+		if ((int32_t)(nowMs() - xSntpNextMs) < 0){
+			return;
 		}
 	}
+	sntpBegin(pSntpSvrHosts, xSntpCount, NULL, false);
+}
 
-	if ((d.yy < 2022) || (d.yy > 3000)){
-		printf("SNTP Failed %d\n", res);
-		printf("Failed: %d-%d-%d %d:%d:%d\n", d.yy, d.mo, d.dd, d.hh, d.mm, d.ss);
+/***
+ * Set the RTC from SNTP time
+ * @param d - time from server
+ * @return true if time was good
+ */
+bool EthHelper::rtcSet(datetime *d){
+	if ((d->yy < 2022) || (d->yy > 3000)){
+		printf("Failed: %d-%d-%d %d:%d:%d\n", d->yy, d->mo, d->dd, d->hh, d->mm, d->ss);
 		return false;
 	}
 
-	//rtc_init();
 	datetime_t t = {
-			 .year  = (int16_t)d.yy,
-			 .month = (int8_t) d.mo,
-			 .day   = (int8_t) d.dd,
-			 .hour  = (int8_t) d.hh,
-			 .min   = (int8_t) d.mm,
-			 .sec   = (int8_t) d.ss
+			 .year  = (int16_t)d->yy,
+			 .month = (int8_t) d->mo,
+			 .day   = (int8_t) d->dd,
+			 .hour  = (int8_t) d->hh,
+			 .min   = (int8_t) d->mm,
+			 .sec   = (int8_t) d->ss
 	 };
 	rtc_set_datetime(&t);
 
-	printf("Good DateTime: %d-%d-%d %d:%d:%d\n", d.yy, d.mo, d.dd, d.hh, d.mm, d.ss);
-
-
+	printf("Good DateTime: %d-%d-%d %d:%d:%d\n", d->yy, d->mo, d->dd, d->hh, d->mm, d->ss);
 	return true;
 }
 
+/***
+ * Has the RTC been set from SNTP
+ * @param ageMs - output ms since last good sync, may be NULL
+ * @return true if synced at least once
+ */
+bool EthHelper::isRTCSynced(uint32_t *ageMs){
+	if (xSntpSynced && (ageMs != NULL)){
+		*ageMs = nowMs() - xSntpSyncMs;
+	}
+	return xSntpSynced;
+}
+
 
 
 /***
@@ -349,114 +641,291 @@ void EthHelper::cbRepeatingTimer(void)
 }
 
 /***
- * Run DHCP to update the ip address
- * @return
+ * Run DHCP to update the ip address. Starts DHCP if needed and
+ * waits up to DHCP_CLIENT_TIMEOUT_MS for a lease.
+ * @return true if leased
  */
 bool EthHelper::dhcpClient(){
-	bool res = false;
-	if( xSemaphore != NULL ){
-		if( xSemaphoreTake( xSemaphore, ( TickType_t ) ETHMUTEXTICKS ) == pdTRUE ){
-			res = dhcpClientLocal();
-			xSemaphoreGive( xSemaphore );
-		} else {
-			LogError(("Did not get Mutex to initialise"));
+	uint32_t start = nowMs();
+
+	if (xNetInfo.dhcp != NETINFO_DHCP){
+		dhcpStart();
+		return true;
+	}
+
+	if ((xDhcpState == DhcpBound) || (xDhcpState == DhcpRenew)){
+		return true;
+	}
+	xSemaphoreTake(xDhcpDone, 0);
+	dhcpStart();
+
+	if ((xHandle == NULL) || (xTaskGetCurrentTaskHandle() == xHandle)){
+		//No service task so run the exchange here
+		while ((xDhcpState != DhcpBound) && ((nowMs() - start) < DHCP_CLIENT_TIMEOUT_MS)){
+			dhcpPoll();
+			if (xSemaphoreTake(xDhcpDone, 0) == pdTRUE){
+				break;
+			}
+			vTaskDelay(DHCP_POLL_DELAY);
 		}
 	} else {
-		res = dhcpClientLocal();
+		xSemaphoreTake(xDhcpDone, pdMS_TO_TICKS(DHCP_CLIENT_TIMEOUT_MS));
 	}
-
-	return res;
+	return (xDhcpState == DhcpBound) || (xDhcpState == DhcpRenew);
 }
 
 /***
- * DHCP renewal without mutex
- * @return
+ * Start DHCP in the background, does not block. The lease is
+ * renewed at T1 and T2 by the service task.
  */
-bool EthHelper::dhcpClientLocal(){
-    int retval = 0;
-    uint8_t link;
-    uint16_t len = 0;
-    uint32_t dhcpRetry = 0;
-    uint8_t dhcpGetIpFlag=0;
-
-    if (xNetInfo.dhcp == NETINFO_DHCP) // DHCP
-    {
-    	dhcpInit();
-    	dhcpGetIpFlag=0;
-    }
-    else // static
-    {
-        network_initialize(xNetInfo);
-
-        /* Get network information */
-        print_network_information(xNetInfo);
-
-        return true;
-    }
-
-    while (1)
-    {
-        link = wizphy_getphylink();
-
-        if (link == PHY_LINK_OFF)
-        {
-            printf("PHY_LINK_OFF\r\n");
-
-            DHCP_stop();
-
-            while (1)
-            {
-                link = wizphy_getphylink();
-
-                if (link == PHY_LINK_ON)
-                {
-                	dhcpInit();
-					dhcpGetIpFlag=0;
+void EthHelper::dhcpStart(){
+	if (xNetInfo.dhcp != NETINFO_DHCP){
+		if (lock()){
+			network_initialize(xNetInfo);
+			unlock();
+		}
+		print_network_information(xNetInfo);
+		return;
+	}
 
-                    dhcpRetry = 0;
+	if (xDhcpState != DhcpOff){
+		return;
+	}
+	xDhcpStartMs = nowMs();
+	xDhcpNextMs = xDhcpStartMs;
+	xDhcpRetry = 0;
+	xDhcpTimeToIp = 0;
+	xDhcpState = DhcpLinkWait;
+	if (xHandle != NULL){
+		xTaskNotifyGive(xHandle);
+	}
+}
 
-                    break;
-                }
+/***
+ * Progress the DHCP client, does not block. DHCP_run is called once per
+ * poll while an exchange is running, the mutex is only held for that
+ * call. Once bound the DHCP socket is closed and the lease timed here.
+ * At T1 the socket is reopened and ioLibrary, still in its leased state,
+ * sends a unicast REQUEST with ciaddr. The interface is never reset while
+ * bound. If the lease runs out the address is dropped.
+ */
+void EthHelper::dhcpPoll(){
+	uint8_t link = PHY_LINK_OFF;
+	uint8_t ret = DHCP_RUNNING;
+	uint32_t now = nowMs();
+	TickType_t ticks = (xHandle == NULL) ? ETHMUTEXTICKS : portMAX_DELAY;
+
+	if (xDhcpState == DhcpOff){
+		return;
+	}
+	if ((xDhcpState == DhcpLinkWait) && ((int32_t)(now - xDhcpNextMs) < 0)){
+		return;
+	}
 
-                vTaskDelay(1000);
-            }
-        }
+	if (!lock(ticks)){
+		return;
+	}
+	link = wizphy_getphylink();
+	if (link != PHY_LINK_ON){
+		if (xDhcpState != DhcpLinkWait){
+			printf("PHY_LINK_OFF\r\n");
+			DHCP_stop();
+			helperRelease(EthHelperDhcp);
+			memset(xNetInfo.ip, 0, 4);
+			bool bound = (xDhcpState == DhcpBound) || (xDhcpState == DhcpRenew);
+			xDhcpState = DhcpLinkWait;
+			xDhcpStartMs = now;
+			unlock();
+			if (bound){
+				dhcpEvent(DhcpExpired);
+			}
+			return;
+		}
+		xDhcpNextMs = now + DHCP_LINK_POLL_MS;
+		unlock();
+		return;
+	}
 
-        retval = DHCP_run();
+	if (((xDhcpState == DhcpBound) || (xDhcpState == DhcpRenew)) &&
+			(xDhcpLease != INFINITE_LEASETIME) &&
+			((now - xDhcpLeaseMs) >= xDhcpLease * 1000)){
+		printf("DHCP lease expired\n");
+		memset(xNetInfo.ip, 0, 4);
+		network_initialize(xNetInfo);
+		if (helperClaim(EthHelperDhcp)){
+			dhcpInit();
+			xDhcpState = DhcpAcquire;
+		} else {
+			xDhcpState = DhcpLinkWait;
+			xDhcpNextMs = now;
+		}
+		xDhcpStartMs = now;
+		xDhcpRetry = 0;
+		unlock();
+		dhcpEvent(DhcpExpired);
+		return;
+	}
 
-        if (retval == DHCP_IP_LEASED)
-        {
-            if (dhcpGetIpFlag == 0)
-            {
-            	dhcpRetry = 0;
+	switch(xDhcpState){
+	case DhcpLinkWait:{
+		//Wait for the shared helper socket
+		if (helperClaim(EthHelperDhcp)){
+			dhcpInit();
+			xDhcpState = DhcpAcquire;
+		}
+		break;
+	}
+	case DhcpAcquire:{
+		ret = DHCP_run();
+		break;
+	}
+	case DhcpBound:{
+		uint32_t elapsed = now - xDhcpLeaseMs;
+		if ((xDhcpLease == INFINITE_LEASETIME) ||
+				(elapsed < (xDhcpLease / 2 + DHCP_T1_SLACK_SECS) * 1000) ||
+				((int32_t)(now - xDhcpNextMs) < 0) ||
+				!helperClaim(EthHelperDhcp)){
+			break;
+		}
+		//T1 renew or T2 rebind. ioLibrary is still leased so the first run
+		//sends a unicast REQUEST for the current address, DHCP_init would
+		//clear the address under live connections and start a DISCOVER.
+		bool t2 = (elapsed >= (xDhcpLease / 8) * 7 * 1000);
+		bool report = t2 ? !xDhcpRebind : !xDhcpRenewing;
+		xDhcpRenewing = true;
+		xDhcpRebind = xDhcpRebind || t2;
+		memcpy(xDhcpOldIp, xNetInfo.ip, 4);
+		//Helper socket may be left open on another port, DHCP_run reopens it
+		close(xHelperSock);
+		DHCP_run();
+		xDhcpState = DhcpRenew;
+		unlock();
+		if (report){
+			dhcpEvent(t2 ? DhcpRebinding : DhcpRenewing);
+		}
+		return;
+	}
+	case DhcpRenew:{
+		ret = DHCP_run();
+		break;
+	}
+	default:{
+		break;
+	}
+	}
+	unlock();
+
+	if ((ret == DHCP_IP_LEASED) || (ret == DHCP_IP_CHANGED)){
+		dhcpBound();
+	} else if ((ret == DHCP_FAILED) && (xDhcpState == DhcpRenew)){
+		//Keep the address and try again later, until the lease runs out.
+		//DHCP_stop would leave ioLibrary needing DHCP_init, so only close.
+		if (lock(ticks)){
+			close(xHelperSock);
+			unlock();
+		}
+		helperRelease(EthHelperDhcp);
+		xDhcpState = DhcpBound;
+		xDhcpNextMs = now + DHCP_RETRY_MS;
+	} else if ((ret == DHCP_FAILED) && (xDhcpState == DhcpAcquire)){
+		xDhcpRetry++;
+		if (xDhcpRetry <= DHCP_RETRY_COUNT){
+			printf(" DHCP timeout occurred and retry %d\n", xDhcpRetry);
+		} else {
+			printf(" DHCP failed\n");
+			if (lock(ticks)){
+				DHCP_stop();
+				unlock();
+			}
+			helperRelease(EthHelperDhcp);
+			xDhcpState = DhcpLinkWait;
+			xDhcpNextMs = now + DHCP_RETRY_MS;
+			dhcpEvent(DhcpFailed);
+			xSemaphoreGive(xDhcpDone);
+			xDhcpRetry = 0;
+		}
+	}
+}
 
-                printf(" JD: DHCP success\n");
+/***
+ * Lease gained, renewed or changed
+ */
+void EthHelper::dhcpBound(){
+	uint32_t now = nowMs();
+	EthDhcpEvent event = DhcpLeased;
 
-                return true;
-            }
-        }
-        else if (retval == DHCP_FAILED)
-        {
-            dhcpGetIpFlag = 0;
-            dhcpRetry++;
+	if (xDhcpState == DhcpRenew){
+		event = (memcmp(xDhcpOldIp, xNetInfo.ip, 4) == 0) ? DhcpRenewed : DhcpChanged;
+	} else {
+		xDhcpTimeToIp = now - xDhcpStartMs;
+		printf(" JD: DHCP success in %lu ms\n", (unsigned long)xDhcpTimeToIp);
+	}
+	xDhcpLease = getDHCPLeasetime();
+	if ((xDhcpLease != INFINITE_LEASETIME) && (xDhcpLease > DHCP_MAX_LEASE_SECS)){
+		xDhcpLease = DHCP_MAX_LEASE_SECS;
+	}
+	xDhcpLeaseMs = now;
+	xDhcpNextMs = now;
+	xDhcpRetry = 0;
+	xDhcpRenewing = false;
+	xDhcpRebind = false;
+	xDhcpState = DhcpBound;
+
+	//Socket is not needed until T1
+	if (lock((xHandle == NULL) ? ETHMUTEXTICKS : portMAX_DELAY)){
+		close(xHelperSock);
+		unlock();
+	}
+	helperRelease(EthHelperDhcp);
 
-            if (dhcpRetry <= DHCP_RETRY_COUNT)
-            {
-                printf(" DHCP timeout occurred and retry %d\n", dhcpRetry);
-            }
-        }
+	dhcpEvent(event);
+	xSemaphoreGive(xDhcpDone);
+}
 
-        if (dhcpRetry > DHCP_RETRY_COUNT)
-        {
-            printf(" DHCP failed\n");
+/***
+ * Make DHCP lease callbacks
+ * @param event
+ */
+void EthHelper::dhcpEvent(EthDhcpEvent event){
+	for (uint8_t i=0; i < ETH_DHCP_CB_MAX; i++){
+		if (pDhcpCb[i] != NULL){
+			pDhcpCb[i](event, xNetInfo.ip, pDhcpCtx[i]);
+		}
+	}
+}
 
-            DHCP_stop();
+/***
+ * Register for callback on DHCP lease events
+ * @param cb - callback
+ * @param ctx - context passed to callback
+ * @return false if no space for callback
+ */
+bool EthHelper::addDhcpCallback(EthDhcpCallback cb, void *ctx){
+	for (uint8_t i=0; i < ETH_DHCP_CB_MAX; i++){
+		if (pDhcpCb[i] == NULL){
+			pDhcpCtx[i] = ctx;
+			pDhcpCb[i] = cb;
+			return true;
+		}
+	}
+	LogError(("No space for DHCP callback"));
+	return false;
+}
 
-            return false;
-        }
+/***
+ * Get state of the DHCP client
+ * @return
+ */
+EthDhcpState EthHelper::getDhcpState(){
+	return xDhcpState;
+}
 
-        vTaskDelay(10);
-    }
+/***
+ * Time taken from starting DHCP to having an address
+ * @return ms, 0 if not yet leased
+ */
+uint32_t EthHelper::getDhcpTimeToIp(){
+	return xDhcpTimeToIp;
 }
 
 
@@ -467,7 +936,7 @@ void EthHelper::dhcpInit(void)
 {
     printf(" JD: DHCP client running\n");
 
-    DHCP_init(SOCKET_DHCP, pEthernetBuf);
+    DHCP_init(xHelperSock, pEthernetBuf);
 
     reg_dhcp_cbfunc(EthHelper::cbDhcpAssign, EthHelper::cbDhcpAssign, EthHelper::cbDhcpConflict);
 
@@ -510,101 +979,735 @@ EthHelper *EthHelper::obj = NULL;
 uint32_t EthHelper::gMseCnt = 0;
 
 /***
- * Perform a DNS lookup
- * @param ip - uint8_t[4] ip address of host
- * @param host - string host name to lookup
- * @return true if successful
+ * Current time in ms
+ * @return
  */
-bool EthHelper::dnsClient(uint8_t *ip, const char * host){
-	 char s[256];
-	 strcpy(s, host);
-	 bool res = false;
-
-	 if( xSemaphore != NULL ){
-		if( xSemaphoreTake( xSemaphore, ( TickType_t ) ETHMUTEXTICKS ) == pdTRUE ){
-			DNS_init(SOCKET_DNS, pEthernetBuf);
-			 if (DNS_run(xNetInfo.dns, (uint8_t *)s, ip) > 0){
-				 res = true;
-			 }
-			xSemaphoreGive( xSemaphore );
-		} else {
-			LogError(("Did not get Mutex to initialise"));
-		}
-	 } else {
-		 DNS_init(SOCKET_DNS, pEthernetBuf);
-		 if (DNS_run(xNetInfo.dns, (uint8_t *)s, ip) > 0){
-			 res = true;
-		 }
-	 }
-	 return res;
+uint32_t EthHelper::nowMs(){
+	return to_ms_since_boot(get_absolute_time ());
 }
 
 /***
- * Connect a TCP Socket
- * @param sock - Socket id
- * @param localPort - local port number
- * @param hostIP - host ip address
- * @param hostPort - host port number
- * @return true if successful
+ * Take the Ethernet mutex if enabled
+ * @param ticks - max time to wait
+ * @return true if caller may access the chip
  */
-bool EthHelper::tcpSockConnect(uint8_t sock, uint16_t localPort, uint8_t * hostIP, uint16_t hostPort){
-	 bool res = true;
-	 int8_t b;
-
-	 if( xSemaphore != NULL ){
-		if( xSemaphoreTake( xSemaphore, ( TickType_t ) ETHMUTEXTICKS ) == pdTRUE ){
-
-			b = socket(sock, Sn_MR_TCP, localPort, SF_TCP_NODELAY);
-			if (b != sock){
-				LogError(("Socket %d", res));
-				res = false;
-			} else {
-				b = connect(sock, hostIP, hostPort);
-				if (b != SOCK_OK){
-					LogError(("Socket connect error %d", res));
-					res = false;
-				}
-			}
-
-			xSemaphoreGive( xSemaphore );
-		} else {
-			LogError(("Did not get Mutex to initialise"));
-		}
-	 } else {
-		 b = socket(sock, Sn_MR_TCP, localPort, SF_TCP_NODELAY);
-		if (b != sock){
-			LogError(("Socket %d", res));
-			res = false;
-		} else {
-			b = connect(sock, hostIP, hostPort);
-			if (b != SOCK_OK){
-				LogError(("Socket connect error %d", res));
-				res = false;
-			}
-		}
-	 }
-	 return res;
+bool EthHelper::lock(TickType_t ticks){
+	if( xSemaphore == NULL ){
+		return true;
+	}
+	if( xSemaphoreTake( xSemaphore, ticks ) == pdTRUE ){
+		return true;
+	}
+	LogError(("Did not get Mutex to initialise"));
+	return false;
 }
 
 /***
- * Close a TCP socket
- * @param sock = socket id
- * @return true if successful
+ * Release the Ethernet mutex
  */
-bool EthHelper::tcpSockClose(uint8_t sock){
-	bool res = false;
+void EthHelper::unlock(){
 	if( xSemaphore != NULL ){
-		if( xSemaphoreTake( xSemaphore, ( TickType_t ) ETHMUTEXTICKS ) == pdTRUE ){
-			disconnect(sock);
-			res = true;
-			xSemaphoreGive( xSemaphore );
+		xSemaphoreGive( xSemaphore );
+	}
+}
+
+/***
+ * Open a UDP socket
+ * @param sock - socket id
+ * @param localPort - local port, 0 for any
+ * @return true if successful
+ */
+bool EthHelper::udpSockOpen(uint8_t sock, uint16_t localPort){
+	EthRequest req = {EthReqUdpOpen};
+	req.sock = sock;
+	req.port = localPort;
+	return (request(&req, false) == 1);
+}
+
+/***
+ * Send a datagram from UDP socket
+ * @param sock - socket id
+ * @param buf - buffer to send from
+ * @param len - length of datagram
+ * @param ip - uint8_t[4] destination
+ * @param port - destination port
+ * @return bytes sent, negative on error
+ */
+int32_t EthHelper::udpSockSendTo(uint8_t sock, uint8_t *buf, size_t len, const uint8_t *ip, uint16_t port){
+	EthRequest req = {EthReqUdpSendTo};
+	req.sock = sock;
+	req.buf = buf;
+	req.len = len;
+	req.ip = (uint8_t *)ip;
+	req.port = port;
+	return request(&req, false);
+}
+
+/***
+ * Receive a datagram on UDP socket if one is waiting
+ * @param sock - socket id
+ * @param buf - buffer to read into
+ * @param len - length of buffer
+ * @param ip - output uint8_t[4] source
+ * @param port - output source port
+ * @return bytes read, 0 if none, negative on error
+ */
+int32_t EthHelper::udpSockRecvFrom(uint8_t sock, uint8_t *buf, size_t len, uint8_t *ip, uint16_t *port){
+	EthRequest req = {EthReqUdpRecvFrom};
+	req.sock = sock;
+	req.buf = buf;
+	req.len = len;
+	req.ip = ip;
+	req.pPort = port;
+	return request(&req, false);
+}
+
+/***
+ * Close a UDP socket
+ * @param sock - socket id
+ * @return true if successful
+ */
+bool EthHelper::udpSockClose(uint8_t sock){
+	EthRequest req = {EthReqUdpClose};
+	req.sock = sock;
+	return (request(&req, false) == 1);
+}
+
+/***
+ * Run a socket operation. Queued to the service task if it is
+ * running, otherwise run in the calling task under the mutex.
+ * The caller waits for completion so a request is never dropped,
+ * except before start() where a TCP read or write returns 0 if the
+ * mutex stays busy.
+ * @param req - request, result is filled in
+ * @param high - true to serve ahead of low priority requests
+ * @return result of the operation
+ */
+int32_t EthHelper::request(EthRequest *req, bool high){
+	StaticSemaphore_t doneBuffer;
+
+	req->result = -1;
+	if ((xHandle == NULL) || (xTaskGetCurrentTaskHandle() == xHandle)){
+		if (lock((xHandle == NULL) ? ETHMUTEXTICKS : portMAX_DELAY)){
+			execute(req);
+			unlock();
+		} else if ((req->type == EthReqTcpRead) || (req->type == EthReqTcpWritev)){
+			//Busy is not a socket error, 0 lets coreMQTT retry as before
+			req->result = 0;
+		}
+		taskENTER_CRITICAL();
+		xServiceStats.directReqs++;
+		taskEXIT_CRITICAL();
+		return req->result;
+	}
+
+	req->done = xSemaphoreCreateBinaryStatic(&doneBuffer);
+	req->queuedUs = time_us_32();
+	xQueueSend(high ? xReqHigh : xReqLow, &req, portMAX_DELAY);
+	xTaskNotifyGive(xHandle);
+	xSemaphoreTake(req->done, portMAX_DELAY);
+	vSemaphoreDelete(req->done);
+	return req->result;
+}
+
+/***
+ * Serve all waiting requests, high priority queue first
+ */
+void EthHelper::serviceRequests(){
+	EthRequest *req;
+	bool high;
+
+	for (;;){
+		uint32_t queued = uxQueueMessagesWaiting(xReqHigh) +
+				uxQueueMessagesWaiting(xReqLow);
+		if (xQueueReceive(xReqHigh, &req, 0) == pdTRUE){
+			high = true;
+		} else if (xQueueReceive(xReqLow, &req, 0) == pdTRUE){
+			high = false;
 		} else {
-			LogError(("Did not get Mutex to initialise"));
+			return;
+		}
+
+		uint32_t wait = time_us_32() - req->queuedUs;
+		taskENTER_CRITICAL();
+		if (high){
+			xServiceStats.highReqs++;
+		} else {
+			xServiceStats.lowReqs++;
+		}
+		if (queued > xServiceStats.maxQueued){
+			xServiceStats.maxQueued = queued;
+		}
+		xServiceStats.waitUs += wait;
+		if (wait > xServiceStats.maxWaitUs){
+			xServiceStats.maxWaitUs = wait;
+		}
+		taskEXIT_CRITICAL();
+
+		if (lock(portMAX_DELAY)){
+			execute(req);
+			unlock();
+		}
+		xSemaphoreGive(req->done);
+	}
+}
+
+/***
+ * Perform the operation, caller holds the mutex
+ * @param req - request, result is filled in
+ */
+void EthHelper::execute(EthRequest *req){
+	uint16_t remaining = 0;
+	uint8_t status;
+	int8_t b;
+
+	switch(req->type){
+	case EthReqTcpConnect:{
+		req->result = 0;
+		b = socket(req->sock, Sn_MR_TCP, req->port, SF_TCP_NODELAY);
+		if (b != req->sock){
+			LogError(("Socket %d", b));
+		} else {
+			b = connect(req->sock, req->ip, *req->pPort);
+			if (b != SOCK_OK){
+				LogError(("Socket connect error %d", b));
+			} else {
+				req->result = 1;
+			}
+		}
+		break;
+	}
+	case EthReqTcpClose:{
+		disconnect(req->sock);
+		req->result = 1;
+		break;
+	}
+	case EthReqTcpRead:{
+		req->result = (int32_t)tcpSockReadLocal(req->sock, req->buf, req->len);
+		break;
+	}
+	case EthReqTcpWritev:{
+		req->result = tcpSockWritevLocal(req->sock, req->frags, req->count);
+		break;
+	}
+	case EthReqUdpOpen:{
+		req->result = (socket(req->sock, Sn_MR_UDP, req->port, 0) == req->sock) ? 1 : 0;
+		break;
+	}
+	case EthReqUdpSendTo:{
+		req->result = sendto(req->sock, req->buf, req->len, req->ip, req->port);
+		break;
+	}
+	case EthReqUdpRecvFrom:{
+		req->result = 0;
+		getsockopt(req->sock, SO_STATUS, &status);
+		if (status != SOCK_UDP){
+			req->result = -1;
+		} else {
+			getsockopt(req->sock, SO_REMAINSIZE, &remaining);
+			if (remaining > 0){
+				req->result = recvfrom(req->sock, req->buf, req->len, req->ip, req->pPort);
+			}
+		}
+		break;
+	}
+	case EthReqUdpClose:{
+		close(req->sock);
+		req->result = 1;
+		break;
+	}
+	}
+}
+
+/***
+ * Get the service task queue counters
+ * @param stats - output
+ */
+void EthHelper::getServiceStats(EthServiceStats *stats){
+	taskENTER_CRITICAL();
+	memcpy(stats, &xServiceStats, sizeof(EthServiceStats));
+	taskEXIT_CRITICAL();
+}
+
+/***
+ * Claim the resolver
+ * @param ticks - time to wait
+ * @return true if claimed
+ */
+bool EthHelper::dnsAcquire(TickType_t ticks){
+	if (xDnsSemaphore == NULL){
+		if (xDNSResolver.getState() == DNSPending){
+			return false;
+		}
+		return true;
+	}
+	return (xSemaphoreTake(xDnsSemaphore, ticks) == pdTRUE);
+}
+
+/***
+ * Release the resolver
+ */
+void EthHelper::dnsRelease(){
+	if (xDnsSemaphore != NULL){
+		xSemaphoreGive(xDnsSemaphore);
+	}
+}
+
+/***
+ * Perform a DNS lookup
+ * Answers are served from the cache where possible, otherwise blocks
+ * until the query completes but only holds the mutex per packet.
+ * @param ip - uint8_t[4] ip address of host
+ * @param host - string host name to lookup
+ * @param fresh - true to skip the cache and ask the server, for when
+ * the cached address has stopped answering
+ * @return true if successful
+ */
+bool EthHelper::dnsClient(uint8_t *ip, const char * host, bool fresh){
+	uint32_t ttl = 0;
+	bool res = false;
+
+	if (DNSResolver::parseIP(host, ip)){
+		return true;
+	}
+
+	if (!fresh && xDNSCache.lookup(host, ip, nowMs())){
+		return true;
+	}
+
+	if (!dnsAcquire(pdMS_TO_TICKS(DNS_TIMEOUT_MS))){
+		LogError(("DNS resolver busy"));
+		return false;
+	}
+
+	uint32_t start = nowMs();
+	while (!helperClaim(EthHelperDns)){
+		if ((nowMs() - start) >= DNS_TIMEOUT_MS){
+			LogError(("DNS helper socket busy"));
+			dnsRelease();
+			return false;
+		}
+		vTaskDelay(DNS_POLL_DELAY);
+	}
+
+	if (xDNSResolver.start(host, xNetInfo.dns)){
+		while (xDNSResolver.poll() == DNSPending){
+			vTaskDelay(DNS_POLL_DELAY);
+		}
+		if (xDNSResolver.getResult(ip, &ttl)){
+			xDNSCache.recordLookup(xDNSResolver.getElapsedMs());
+			xDNSCache.store(host, ip, ttl, nowMs());
+			res = true;
+		}
+	}
+
+	helperRelease(EthHelperDns);
+	dnsRelease();
+	return res;
+}
+
+/***
+ * Start an asynchronous DNS lookup. Callback is made from the
+ * background task, or from dnsPoll if the task is not started.
+ * @param host - host name, copied
+ * @param cb - callback on completion
+ * @param ctx - context passed to callback
+ * @return true if lookup started or answered from cache
+ */
+bool EthHelper::dnsStart(const char * host, DNSResolverCallback cb, void *ctx){
+	uint8_t ip[4];
+
+	if (DNSResolver::parseIP(host, ip) || xDNSCache.lookup(host, ip, nowMs())){
+		if (cb != NULL){
+			cb(host, ip, ctx);
+		}
+		return true;
+	}
+
+	if (!dnsAcquire(0)){
+		return false;
+	}
+	if (!helperClaim(EthHelperDns)){
+		dnsRelease();
+		return false;
+	}
+	pDnsCb = cb;
+	pDnsCtx = ctx;
+	xDnsRefresh = false;
+	if (!xDNSResolver.start(host, xNetInfo.dns)){
+		pDnsCb = NULL;
+		helperRelease(EthHelperDns);
+		dnsRelease();
+		if (cb != NULL){
+			cb(host, NULL, ctx);
+		}
+		return false;
+	}
+	xDnsAsync = true;
+	if (xHandle != NULL){
+		xTaskNotifyGive(xHandle);
+	}
+	return true;
+}
+
+/***
+ * Progress an asynchronous DNS lookup
+ * @return state of the resolver
+ */
+DNSResolverState EthHelper::dnsPoll(){
+	DNSResolverState state = xDNSResolver.poll();
+	if (xDnsAsync && (state != DNSPending)){
+		dnsComplete();
+	}
+	return state;
+}
+
+/***
+ * Complete an asynchronous lookup, update cache and make callback
+ */
+void EthHelper::dnsComplete(){
+	char host[DNS_HOST_MAX];
+	uint8_t ip[4];
+	uint32_t ttl;
+	bool ok = xDNSResolver.getResult(ip, &ttl);
+
+	strcpy(host, xDNSResolver.getHost());
+	if (ok){
+		xDNSCache.recordLookup(xDNSResolver.getElapsedMs());
+		xDNSCache.store(host, ip, ttl, nowMs());
+	}
+	if (xDnsRefresh){
+		//Entry is left in place on failure so stale answer is still served
+		xDNSCache.refreshed(ok);
+	}
+
+	DNSResolverCallback cb = pDnsCb;
+	void *ctx = pDnsCtx;
+	pDnsCb = NULL;
+	xDnsAsync = false;
+	xDnsRefresh = false;
+	helperRelease(EthHelperDns);
+	dnsRelease();
+
+	if (cb != NULL){
+		cb(host, ok ? ip : NULL, ctx);
+	}
+}
+
+/***
+ * Start a refresh of any DNS cache entry close to expiry
+ */
+void EthHelper::dnsRefresh(){
+	char host[DNS_CACHE_HOST_LEN];
+
+	if (!dnsAcquire(0)){
+		return;
+	}
+	if (!xDNSCache.nextRefresh(host, nowMs())){
+		dnsRelease();
+		return;
+	}
+	if (!helperClaim(EthHelperDns)){
+		dnsRelease();
+		return;
+	}
+	pDnsCb = NULL;
+	xDnsRefresh = true;
+	if (xDNSResolver.start(host, xNetInfo.dns)){
+		xDnsAsync = true;
+	} else {
+		dnsComplete();
+	}
+}
+
+/***
+ * Set secondary DNS server, raced against the one from DHCP
+ * @param ip - uint8_t[4], NULL to disable
+ */
+void EthHelper::setSecondaryDNS(const uint8_t *ip){
+	xDNSResolver.setSecondary(ip);
+}
+
+/***
+ * Get the DNS cache counters
+ * @param stats - output
+ */
+void EthHelper::getDNSStats(DNSCacheStats *stats){
+	xDNSCache.getStats(stats);
+}
+
+/***
+ * Allocate a hardware socket
+ * @return socket id or -1 if none free
+ */
+int8_t EthHelper::sockAlloc(){
+	int8_t res = -1;
+
+	taskENTER_CRITICAL();
+	for (uint8_t i=0; i < _WIZCHIP_SOCK_NUM_; i++){
+		if (!(xSockInUse & (1 << i)) && (xSockTxKB[i] > 0) && (xSockRxKB[i] > 0)){
+			xSockInUse |= (1 << i);
+			xSockStats.uses[i]++;
+			xSockAllocMs[i] = nowMs();
+			res = i;
+			break;
+		}
+	}
+	if (res < 0){
+		xSockStats.allocFails++;
+	} else {
+		xSockStats.allocs++;
+	}
+	taskEXIT_CRITICAL();
+
+	if (res < 0){
+		LogError(("No free socket"));
+	}
+	return res;
+}
+
+/***
+ * Reserve a specific hardware socket, for callers that pick their own
+ * @param sock - socket id
+ * @return true if it was free
+ */
+bool EthHelper::sockReserve(uint8_t sock){
+	bool res = false;
+
+	if (sock >= _WIZCHIP_SOCK_NUM_){
+		return false;
+	}
+	taskENTER_CRITICAL();
+	if (!(xSockInUse & (1 << sock))){
+		xSockInUse |= (1 << sock);
+		xSockStats.uses[sock]++;
+		xSockStats.allocs++;
+		xSockAllocMs[sock] = nowMs();
+		res = true;
+	} else {
+		xSockStats.allocFails++;
+	}
+	taskEXIT_CRITICAL();
+
+	if (!res){
+		LogError(("Socket %d already in use", sock));
+	}
+	return res;
+}
+
+/***
+ * Return a socket to the allocator
+ * @param sock - socket id
+ */
+void EthHelper::sockFree(uint8_t sock){
+	if (sock >= _WIZCHIP_SOCK_NUM_){
+		return;
+	}
+	taskENTER_CRITICAL();
+	if (xSockInUse & (1 << sock)){
+		xSockInUse &= ~(1 << sock);
+		xSockStats.heldMs[sock] += nowMs() - xSockAllocMs[sock];
+	}
+	taskEXIT_CRITICAL();
+}
+
+/***
+ * Get the socket allocation counters
+ * @param stats - output
+ */
+void EthHelper::getSockStats(EthSockStats *stats){
+	uint32_t now = nowMs();
+
+	taskENTER_CRITICAL();
+	memcpy(stats, &xSockStats, sizeof(EthSockStats));
+	stats->inUse = xSockInUse;
+	for (uint8_t i=0; i < _WIZCHIP_SOCK_NUM_; i++){
+		if (xSockInUse & (1 << i)){
+			stats->heldMs[i] += now - xSockAllocMs[i];
 		}
-	 } else {
-		 disconnect(sock);
-	 }
-	 return res;
+	}
+	taskEXIT_CRITICAL();
+}
+
+/***
+ * Claim the shared helper socket used in turn by DNS, SNTP and DHCP
+ * @param user - client claiming
+ * @return true if claimed or already held by user
+ */
+bool EthHelper::helperClaim(EthHelperUser user){
+	bool res = false;
+
+	taskENTER_CRITICAL();
+	if (xHelperUser == user){
+		res = true;
+	} else if (xHelperUser == EthHelperFree){
+		xHelperUser = user;
+		xSockStats.helperClaims[user]++;
+		res = true;
+	} else {
+		xSockStats.helperBusy++;
+	}
+	taskEXIT_CRITICAL();
+	return res;
+}
+
+/***
+ * Release the shared helper socket if held by user
+ * @param user - client releasing
+ */
+void EthHelper::helperRelease(EthHelperUser user){
+	taskENTER_CRITICAL();
+	if (xHelperUser == user){
+		xHelperUser = EthHelperFree;
+	}
+	taskEXIT_CRITICAL();
+}
+
+/***
+ * Start the service task. Once running the task owns the W5x00 and
+ * socket operations from other tasks are queued to it.
+ * @param priority - priority to run within FreeRTOS
+ */
+void EthHelper::start(UBaseType_t priority){
+	if (xHandle == NULL){
+		xReqHigh = xQueueCreateStatic(ETH_REQ_QUEUE_LEN, sizeof(EthRequest *),
+				xReqHighStorage, &xReqHighStruct);
+		xReqLow = xQueueCreateStatic(ETH_REQ_QUEUE_LEN, sizeof(EthRequest *),
+				xReqLowStorage, &xReqLowStruct);
+		xTaskCreate(
+			EthHelper::vTask,
+			"EthHelper",
+			1024,
+			( void * ) this,
+			priority,
+			&xHandle
+		);
+	}
+}
+
+/***
+ * Task function for background housekeeping
+ * @param pvParameters - EthHelper object
+ */
+void EthHelper::vTask( void * pvParameters ){
+	EthHelper *task = (EthHelper *) pvParameters;
+	task->run();
+}
+
+/***
+ * Run loop for the service task. Requests are served as they arrive,
+ * housekeeping runs when its interval is up.
+ */
+void EthHelper::run(){
+	TickType_t last = xTaskGetTickCount();
+	TickType_t lastHousekeeping = last;
+
+	for(;;){
+		TickType_t interval = ETH_HOUSEKEEPING_DELAY;
+		bool dhcpBusy = (xDhcpState != DhcpOff) && (xDhcpState != DhcpBound);
+		if (xDnsAsync){
+			interval = DNS_POLL_DELAY;
+		} else if (dhcpBusy){
+			interval = DHCP_POLL_DELAY;
+		} else if (xSntpState != SntpIdle){
+			interval = SNTP_POLL_DELAY;
+		}
+		TickType_t elapsed = xTaskGetTickCount() - last;
+		ulTaskNotifyTake(pdTRUE, (elapsed < interval) ? (interval - elapsed) : 0);
+
+		serviceRequests();
+
+		//A sync handed over by sntpSync starts straight away
+		if ((xSntpState == SntpResolve) || ((xTaskGetTickCount() - last) >= interval)){
+			last = xTaskGetTickCount();
+			if (xDnsAsync){
+				dnsPoll();
+			}
+			if (dhcpBusy){
+				dhcpPoll();
+			}
+			if (xSntpState != SntpIdle){
+				sntpPoll();
+			}
+		}
+
+		if ((xTaskGetTickCount() - lastHousekeeping) >= ETH_HOUSEKEEPING_DELAY){
+			lastHousekeeping = xTaskGetTickCount();
+			if (xDhcpState == DhcpBound){
+				dhcpPoll();
+			}
+			linkCheck();
+			if (xLinkJoined){
+				if (!xDnsAsync){
+					dnsRefresh();
+				}
+				sntpSchedule();
+			}
+		}
+	}
+}
+
+/***
+ * Register for callback when network is joined or lost.
+ * Requires the background task to be started.
+ * @param cb - callback
+ * @param ctx - context passed to callback
+ * @return false if no space for callback
+ */
+bool EthHelper::addLinkCallback(EthLinkCallback cb, void *ctx){
+	for (uint8_t i=0; i < ETH_LINK_CB_MAX; i++){
+		if (pLinkCb[i] == NULL){
+			pLinkCtx[i] = ctx;
+			pLinkCb[i] = cb;
+			return true;
+		}
+	}
+	LogError(("No space for link callback"));
+	return false;
+}
+
+/***
+ * Check for change in joined state and make link callbacks
+ */
+void EthHelper::linkCheck(){
+	bool joined = isJoined();
+	if (joined != xLinkJoined){
+		xLinkJoined = joined;
+		LogInfo(("Network %s\n", joined ? "joined" : "lost"));
+		for (uint8_t i=0; i < ETH_LINK_CB_MAX; i++){
+			if (pLinkCb[i] != NULL){
+				pLinkCb[i](joined, pLinkCtx[i]);
+			}
+		}
+	}
+}
+
+/***
+ * Connect a TCP Socket
+ * @param sock - Socket id
+ * @param localPort - local port number
+ * @param hostIP - host ip address
+ * @param hostPort - host port number
+ * @return true if successful
+ */
+bool EthHelper::tcpSockConnect(uint8_t sock, uint16_t localPort, uint8_t * hostIP, uint16_t hostPort){
+	EthRequest req = {EthReqTcpConnect};
+	req.sock = sock;
+	req.port = localPort;
+	req.ip = hostIP;
+	req.pPort = &hostPort;
+	return (request(&req, true) == 1);
+}
+
+/***
+ * Close a TCP socket
+ * @param sock = socket id
+ * @return true if successful
+ */
+bool EthHelper::tcpSockClose(uint8_t sock){
+	EthRequest req = {EthReqTcpClose};
+	req.sock = sock;
+	return (request(&req, true) == 1);
 }
 
 /***
@@ -619,28 +1722,108 @@ uint32_t EthHelper::tcpSockReadLocal(uint8_t sock, uint8_t *buf, size_t bytesToR
 	uint16_t remaining=0;
 	int8_t res;
 	uint8_t status;
+	uint8_t bit = 1 << sock;
+
+	xReadStats.polls++;
+	if ((xSockEventMask & bit) && !sockEventCheck(sock)){
+		xReadStats.idleSkips++;
+		return 0;
+	}
 
 	getsockopt(sock,SO_STATUS, &status);
+	xReadStats.spiOps++;
 	if (status != SOCK_ESTABLISHED){
 		printf("SOCKET NOT OPEN\n");
 		return -1;
 	}
 
 	res = getsockopt(sock,SO_REMAINSIZE, &remaining);
+	xReadStats.spiOps++;
 	if (res != SOCK_OK){
 		return -1;
 	}
 
 	if  (remaining > 0){
 		dataIn = recv(sock, buf, bytesToRecv);
+		xReadStats.spiOps++;
 
 		if (dataIn == SOCK_BUSY){
 			dataIn = 0;
 		}
 	}
+
+	if (xSockEventMask & bit){
+		if ((dataIn > 0) && (xSockFromInt & bit)){
+			xReadStats.latencyUs += time_us_32() - xIntUs;
+			xReadStats.latencyCount++;
+		}
+		xSockFromInt &= ~bit;
+		if ((dataIn > 0) && (remaining > dataIn)){
+			xSockRxMore |= bit;
+		} else {
+			xSockRxMore &= ~bit;
+		}
+	}
 	return dataIn;
 }
 
+/***
+ * Check event state for socket before a read, clears Sn_IR if
+ * an interrupt is pending, and that of any other event driven socket
+ * so INTn can fall again
+ * @param sock - socket id
+ * @return true if read should go to the chip
+ */
+bool EthHelper::sockEventCheck(uint8_t sock){
+	uint8_t bit = 1 << sock;
+	uint8_t ir;
+	bool pending;
+
+	taskENTER_CRITICAL();
+	pending = (xSockPending & bit) != 0;
+	xSockPending &= ~bit;
+	taskEXIT_CRITICAL();
+
+	uint32_t now = nowMs();
+	bool fallback = (now - xSockLastPoll[sock]) >= ETH_INT_FALLBACK_MS;
+	if (!pending && !fallback){
+		return (xSockRxMore & bit) != 0;
+	}
+	xSockLastPoll[sock] = now;
+	if (pending){
+		xSockFromInt |= bit;
+	}
+
+	//Clear before reading size so data arriving later raises a new interrupt
+	ctlsocket(sock, CS_GET_INTERRUPT, &ir);
+	ir &= (SIK_CONNECTED | SIK_RECEIVED | SIK_DISCONNECTED | SIK_TIMEOUT);
+	xReadStats.spiOps++;
+	if (ir != 0){
+		ctlsocket(sock, CS_CLR_INTERRUPT, &ir);
+		xReadStats.spiOps++;
+	}
+
+	//INTn is shared and only rises again, giving a new falling edge, once
+	//every socket's Sn_IR is clear. Clear the others now and leave them
+	//pending so their next read goes to the chip.
+	intr_kind intr;
+	ctlwizchip(CW_GET_INTERRUPT, &intr);
+	xReadStats.spiOps++;
+	uint8_t others = ((uint32_t)intr >> 8) & xSockEventMask & ~bit;
+	for (uint8_t i=0; i < _WIZCHIP_SOCK_NUM_; i++){
+		if (!(others & (1 << i))){
+			continue;
+		}
+		ir = SIK_CONNECTED | SIK_RECEIVED | SIK_DISCONNECTED | SIK_TIMEOUT;
+		ctlsocket(i, CS_CLR_INTERRUPT, &ir);
+		xReadStats.spiOps++;
+		taskENTER_CRITICAL();
+		xSockPending |= (1 << i);
+		taskEXIT_CRITICAL();
+	}
+	return true;
+}
+
 /***
  * Read data from TCP Socket. Returns 0 if no data available.
  * @param sock - socket id
@@ -649,20 +1832,11 @@ uint32_t EthHelper::tcpSockReadLocal(uint8_t sock, uint8_t *buf, size_t bytesToR
  * @return bytes read. 0 if none. Negative if error
  */
 uint32_t EthHelper::tcpSockRead(uint8_t sock, uint8_t *buf, size_t bytesToRecv){
-	int32_t dataIn=0;
-
-	 if( xSemaphore != NULL ){
-		if( xSemaphoreTake( xSemaphore, ( TickType_t ) ETHMUTEXTICKS ) == pdTRUE ){
-			dataIn = tcpSockReadLocal(sock, buf, bytesToRecv);
-
-			xSemaphoreGive( xSemaphore );
-		} else {
-			LogError(("Did not get Mutex to initialise"));
-		}
-	 } else {
-		 dataIn = tcpSockReadLocal(sock, buf, bytesToRecv);
-	 }
-	 return dataIn;
+	EthRequest req = {EthReqTcpRead};
+	req.sock = sock;
+	req.buf = buf;
+	req.len = bytesToRecv;
+	return request(&req, true);
 }
 
 /***
@@ -673,25 +1847,256 @@ uint32_t EthHelper::tcpSockRead(uint8_t sock, uint8_t *buf, size_t bytesToRecv){
  * @return number of bytes writtem
  */
 uint32_t EthHelper::tcpSockWrite(uint8_t sock, uint8_t *buf, size_t bytesToSend){
-	int32_t dataOut=0;
+	EthFragment frag = {buf, bytesToSend};
+	return tcpSockWritev(sock, &frag, 1);
+}
 
-	 if( xSemaphore != NULL ){
-		if( xSemaphoreTake( xSemaphore, ( TickType_t ) ETHMUTEXTICKS ) == pdTRUE ){
-			dataOut = send(sock, buf, bytesToSend);
-			xSemaphoreGive( xSemaphore );
-		} else {
-			LogError(("Did not get Mutex to initialise"));
+/***
+ * Write several fragments to TCP socket. Fragments are copied to
+ * consecutive offsets in the socket TX memory and sent with one SEND,
+ * unless they do not fit in the free TX memory.
+ * @param sock - socket id
+ * @param frags - array of fragments
+ * @param count - number of fragments
+ * @return number of bytes written, negative on error
+ */
+int32_t EthHelper::tcpSockWritev(uint8_t sock, const EthFragment *frags, uint8_t count){
+	EthRequest req = {EthReqTcpWritev};
+	req.sock = sock;
+	req.frags = frags;
+	req.count = count;
+	return request(&req, true);
+}
+
+/***
+ * Write fragments without mutex
+ * @param sock - socket id
+ * @param frags - array of fragments
+ * @return number of bytes written, short if an error follows some data,
+ * negative on error
+ * @return number of bytes written, negative on error
+ */
+int32_t EthHelper::tcpSockWritevLocal(uint8_t sock, const EthFragment *frags, uint8_t count){
+	int32_t sent = 0;
+	uint16_t pending = 0;
+	uint8_t status;
+
+	for (uint8_t i=0; i < count; i++){
+		const uint8_t *p = (const uint8_t *)frags[i].pBuffer;
+		size_t left = frags[i].length;
+
+		while (left > 0){
+			uint16_t free = getSn_TX_FSR(sock);
+			free = (free > pending) ? (free - pending) : 0;
+			if (free == 0){
+				if (pending > 0){
+					if (!tcpSendCmd(sock)){
+						//Report what did go so the caller does not resend it
+						return (sent > 0) ? sent : SOCKERR_TIMEOUT;
+					}
+					sent += pending;
+					pending = 0;
+				} else {
+					status = getSn_SR(sock);
+					if ((status != SOCK_ESTABLISHED) && (status != SOCK_CLOSE_WAIT)){
+						return (sent > 0) ? sent : SOCKERR_SOCKSTATUS;
+					}
+					//Peer window is closed, let other tasks run meanwhile
+					vTaskDelay(1);
+				}
+				continue;
+			}
+			uint16_t n = (left < free) ? left : free;
+			wiz_send_data(sock, (uint8_t *)p, n);
+			p += n;
+			left -= n;
+			pending += n;
+		}
+	}
+
+	if (pending > 0){
+		if (!tcpSendCmd(sock)){
+			return (sent > 0) ? sent : SOCKERR_TIMEOUT;
+		}
+		sent += pending;
+	}
+	return sent;
+}
+
+/***
+ * Issue SEND for data already in the TX memory and wait for it to go
+ * @param sock - socket id
+ * @return true if sent
+ */
+bool EthHelper::tcpSendCmd(uint8_t sock){
+	uint8_t ir;
+	uint8_t status;
+	uint32_t polls = 0;
+
+	setSn_CR(sock, Sn_CR_SEND);
+	while (getSn_CR(sock)){
+		taskYIELD();
+	}
+
+	for (;;){
+		//A slow peer can hold SENDOK off until the chip times out
+		if (polls++ >= ETH_SEND_SPIN){
+			vTaskDelay(1);
+		}
+		ir = getSn_IR(sock);
+		if (ir & Sn_IR_SENDOK){
+			setSn_IR(sock, Sn_IR_SENDOK);
+			return true;
+		}
+		if (ir & Sn_IR_TIMEOUT){
+			setSn_IR(sock, Sn_IR_TIMEOUT);
+			LogError(("Send timeout on socket %d", sock));
+			return false;
+		}
+		status = getSn_SR(sock);
+		if ((status != SOCK_ESTABLISHED) && (status != SOCK_CLOSE_WAIT)){
+			return false;
+		}
+	}
+}
+
+
+/***
+ * Switch socket to event driven mode. The W5x00 INTn line is used to
+ * flag RECV, DISCON and TIMEOUT so tcpSockRead does not touch the chip
+ * while the socket is idle.
+ * @param sock - socket id
+ * @param cb - callback made from interrupt context, may be NULL
+ * @param ctx - context passed to callback
+ * @return true if successful
+ */
+bool EthHelper::enableSockEvents(uint8_t sock, EthSockEventCallback cb, void *ctx){
+	uint8_t sockMask = SIK_RECEIVED | SIK_DISCONNECTED | SIK_TIMEOUT;
+	intr_kind intMask;
+
+	if (sock >= _WIZCHIP_SOCK_NUM_){
+		return false;
+	}
+
+	if (!lock()){
+		return false;
+	}
+	ctlsocket(sock, CS_SET_INTMASK, &sockMask);
+	ctlwizchip(CW_GET_INTRMASK, &intMask);
+	intMask = (intr_kind)(intMask | (IK_SOCK_0 << sock));
+	ctlwizchip(CW_SET_INTRMASK, &intMask);
+	unlock();
+
+	taskENTER_CRITICAL();
+	pSockEventCb[sock] = cb;
+	pSockEventCtx[sock] = ctx;
+	xSockEventMask |= (1 << sock);
+	xSockPending |= (1 << sock);
+	taskEXIT_CRITICAL();
+
+	if (!xIntConfigured){
+		gpio_init(ETH_INT_PIN);
+		gpio_set_dir(ETH_INT_PIN, GPIO_IN);
+		gpio_pull_up(ETH_INT_PIN);
+		//Raw handler so the application keeps its own GPIO callback
+		gpio_add_raw_irq_handler(ETH_INT_PIN, EthHelper::cbGpioIrq);
+		gpio_set_irq_enabled(ETH_INT_PIN, GPIO_IRQ_EDGE_FALL, true);
+		irq_set_enabled(IO_IRQ_BANK0, true);
+		xIntConfigured = true;
+	}
+	return true;
+}
+
+/***
+ * Return socket to polled mode
+ * @param sock - socket id
+ */
+void EthHelper::disableSockEvents(uint8_t sock){
+	uint8_t sockMask = 0;
+	intr_kind intMask;
+
+	if (sock >= _WIZCHIP_SOCK_NUM_){
+		return;
+	}
+
+	taskENTER_CRITICAL();
+	xSockEventMask &= ~(1 << sock);
+	xSockPending &= ~(1 << sock);
+	pSockEventCb[sock] = NULL;
+	taskEXIT_CRITICAL();
+	xSockRxMore &= ~(1 << sock);
+
+	if (lock()){
+		ctlsocket(sock, CS_SET_INTMASK, &sockMask);
+		ctlwizchip(CW_GET_INTRMASK, &intMask);
+		intMask = (intr_kind)(intMask & ~(IK_SOCK_0 << sock));
+		ctlwizchip(CW_SET_INTRMASK, &intMask);
+		unlock();
+	}
+}
+
+/***
+ * Is there possibly data to read on the socket.
+ * Always true for a polled socket.
+ * @param sock - socket id
+ * @return
+ */
+bool EthHelper::tcpSockReady(uint8_t sock){
+	uint8_t bit = 1 << sock;
+	if (!(xSockEventMask & bit)){
+		return true;
+	}
+	if ((xSockPending | xSockRxMore) & bit){
+		return true;
+	}
+	return (nowMs() - xSockLastPoll[sock]) >= ETH_INT_FALLBACK_MS;
+}
+
+/***
+ * Get the TCP read counters
+ * @param stats - output
+ */
+void EthHelper::getReadStats(EthReadStats *stats){
+	taskENTER_CRITICAL();
+	memcpy(stats, &xReadStats, sizeof(EthReadStats));
+	taskEXIT_CRITICAL();
+}
+
+/***
+ * Raw interrupt handler for the INTn GPIO, shares the bank with any
+ * application GPIO callback
+ */
+void EthHelper::cbGpioIrq(){
+	if (gpio_get_irq_event_mask(ETH_INT_PIN) & GPIO_IRQ_EDGE_FALL){
+		gpio_acknowledge_irq(ETH_INT_PIN, GPIO_IRQ_EDGE_FALL);
+		if (EthHelper::obj != NULL){
+			EthHelper::obj->sockEventISR();
 		}
-	 } else {
-		 dataOut = send(sock, buf, bytesToSend);
-	 }
-	 return dataOut;
+	}
 }
 
+/***
+ * Handle the socket interrupt. INTn is shared so every event driven
+ * socket is flagged and checked on its next read.
+ */
+void EthHelper::sockEventISR(){
+	xIntUs = time_us_32();
+	//The other core may be in sockEventCheck
+	UBaseType_t saved = taskENTER_CRITICAL_FROM_ISR();
+	xSockPending |= xSockEventMask;
+	xReadStats.events++;
+	taskEXIT_CRITICAL_FROM_ISR(saved);
+	for (uint8_t i=0; i < _WIZCHIP_SOCK_NUM_; i++){
+		if ((xSockEventMask & (1 << i)) && (pSockEventCb[i] != NULL)){
+			pSockEventCb[i](i, pSockEventCtx[i]);
+		}
+	}
+}
 
 /***
- * Set list of servers for SNTP operations
- * @param sntpSvrHosts - array of strings
+ * Set list of servers for SNTP operations. If the service task is
+ * running the RTC is then kept in sync in the background.
+ * @param sntpSvrHosts - array of strings, not copied
  * @param count - number of items in array
  */
 void EthHelper::setSNTPServers(const char **sntpSvrHosts, uint8_t count){
@@ -19,6 +19,7 @@ extern "C" {
 #include "w5x00_spi.h"
 #include "dhcp.h"
 #include "dns.h"
+#include "sntp.h"
 #include "timer.h"
 
 #include <FreeRTOS.h>
@@ -27,19 +28,231 @@ extern "C" {
 #include "socket.h"
 }
 #include <stdint.h>
+#include "DNSCache.h"
+#include "DNSResolver.h"
 
 
 #ifndef DHCP_RETRY_COUNT
 #define DHCP_RETRY_COUNT 5
 #endif
 
+//Ticks between polls while a DHCP exchange is running
+#ifndef DHCP_POLL_DELAY
+#define DHCP_POLL_DELAY 10
+#endif
+
+//Ms between PHY link checks while waiting to start DHCP
+#ifndef DHCP_LINK_POLL_MS
+#define DHCP_LINK_POLL_MS 1000
+#endif
+
+//Ms before DHCP is tried again after it failed
+#ifndef DHCP_RETRY_MS
+#define DHCP_RETRY_MS 10000
+#endif
+
+//Max ms dhcpClient waits for a lease
+#ifndef DHCP_CLIENT_TIMEOUT_MS
+#define DHCP_CLIENT_TIMEOUT_MS 30000
+#endif
+
+//Number of DHCP lease callbacks that may be registered
+#ifndef ETH_DHCP_CB_MAX
+#define ETH_DHCP_CB_MAX 2
+#endif
+
 #ifndef ETHMUTEXTICKS
 #define ETHMUTEXTICKS 10
 #endif
 
+//GPIO connected to the W5x00 INTn line
+#ifndef ETH_INT_PIN
+#define ETH_INT_PIN 21
+#endif
+
+//Max ms an event driven socket goes without a full poll
+#ifndef ETH_INT_FALLBACK_MS
+#define ETH_INT_FALLBACK_MS 1000
+#endif
+
+//Polls of Sn_IR while waiting for SENDOK before sleeping a tick between them
+#ifndef ETH_SEND_SPIN
+#define ETH_SEND_SPIN 32
+#endif
+
+//Number of link state callbacks that may be registered
+#ifndef ETH_LINK_CB_MAX
+#define ETH_LINK_CB_MAX 4
+#endif
+
+//Ticks between polls of a running DNS query
+#ifndef DNS_POLL_DELAY
+#define DNS_POLL_DELAY 5
+#endif
+
+//Ticks between background housekeeping passes
+#ifndef ETH_HOUSEKEEPING_DELAY
+#define ETH_HOUSEKEEPING_DELAY 1000
+#endif
+
+//Depth of each service task request queue
+#ifndef ETH_REQ_QUEUE_LEN
+#define ETH_REQ_QUEUE_LEN 8
+#endif
+
+//Max ms to wait for a reply from one SNTP server
+#ifndef SNTP_SERVER_TIMEOUT_MS
+#define SNTP_SERVER_TIMEOUT_MS 2000
+#endif
+
+//Passes made over the server list before a sync fails
+#ifndef SNTP_ROUNDS
+#define SNTP_ROUNDS 3
+#endif
+
+//Ms between background syncs
+#ifndef SNTP_SYNC_INTERVAL_MS
+#define SNTP_SYNC_INTERVAL_MS 3600000
+#endif
+
+//Ms before a failed background sync is retried
+#ifndef SNTP_RETRY_MS
+#define SNTP_RETRY_MS 60000
+#endif
+
+//Ticks between polls of a running SNTP query
+#ifndef SNTP_POLL_DELAY
+#define SNTP_POLL_DELAY 10
+#endif
+
+//Socket memory on the chip in KB for each of TX and RX
+#ifndef ETH_CHIP_MEM_KB
+#if _WIZCHIP_SOCK_NUM_ == 8
+#define ETH_CHIP_MEM_KB 16
+#else
+#define ETH_CHIP_MEM_KB 8
+#endif
+#endif
+
 /* Buffer */
 #define ETHERNET_BUF_MAX_SIZE (1024 * 2)
 
+/***
+ * Fragment of data for a vectored write
+ */
+typedef struct {
+	const void * pBuffer;
+	size_t length;
+} EthFragment;
+
+/***
+ * Operations that may be passed to the service task
+ */
+enum EthRequestType { EthReqTcpConnect, EthReqTcpClose, EthReqTcpRead,
+	EthReqTcpWritev, EthReqUdpOpen, EthReqUdpSendTo, EthReqUdpRecvFrom,
+	EthReqUdpClose };
+
+/***
+ * Request to the service task, lives on the caller's stack until done
+ */
+typedef struct {
+	EthRequestType type;
+	uint8_t sock;
+	uint8_t *buf;
+	size_t len;
+	const EthFragment *frags;
+	uint8_t count;
+	uint8_t *ip;
+	uint16_t port;
+	uint16_t *pPort;
+	int32_t result;
+	uint32_t queuedUs;
+	SemaphoreHandle_t done;
+} EthRequest;
+
+// State of the SNTP client
+enum EthSntpState { SntpIdle, SntpResolve, SntpWaitDns, SntpQuery };
+
+// State of the DHCP client
+enum EthDhcpState { DhcpOff, DhcpLinkWait, DhcpAcquire, DhcpBound, DhcpRenew };
+
+// Lease events
+enum EthDhcpEvent { DhcpLeased, DhcpRenewing, DhcpRebinding, DhcpRenewed,
+	DhcpChanged, DhcpExpired, DhcpFailed };
+
+/***
+ * Callback on a DHCP lease event, made from the EthHelper service task
+ * @param event - lease event
+ * @param ip - uint8_t[4] current address, 0.0.0.0 if none
+ * @param ctx - context provided on registration
+ */
+typedef void (*EthDhcpCallback)(EthDhcpEvent event, const uint8_t *ip, void *ctx);
+
+// Clients of the shared helper socket
+enum EthHelperUser { EthHelperFree, EthHelperDns, EthHelperSntp, EthHelperDhcp, EthHelperUsers };
+
+/***
+ * Counters for the socket allocator
+ */
+typedef struct {
+	uint32_t allocs;						//Sockets handed out
+	uint32_t allocFails;					//Requests with no socket free
+	uint32_t helperBusy;					//Helper socket claims that had to wait
+	uint32_t helperClaims[EthHelperUsers];	//Helper socket claims by client
+	uint32_t uses[_WIZCHIP_SOCK_NUM_];		//Times each socket was handed out
+	uint32_t heldMs[_WIZCHIP_SOCK_NUM_];	//Total ms each socket was held
+	uint8_t inUse;							//Bit mask of sockets in use
+} EthSockStats;
+
+/***
+ * Counters for the service task queues
+ */
+typedef struct {
+	uint32_t highReqs;		//Requests served from the high priority queue
+	uint32_t lowReqs;		//Requests served from the low priority queue
+	uint32_t directReqs;	//Requests run in the calling task
+	uint32_t maxQueued;		//Most requests seen waiting at once
+	uint32_t waitUs;		//Total time requests waited to be served
+	uint32_t maxWaitUs;		//Longest wait to be served
+} EthServiceStats;
+
+/***
+ * Split of the chip's socket memory. Sizes in KB per socket, each must
+ * be 0, 1, 2, 4, 8 or 16 and each direction must fit in ETH_CHIP_MEM_KB.
+ * A socket with no TX or RX memory is not handed out by sockAlloc.
+ */
+typedef struct {
+	uint8_t tx[_WIZCHIP_SOCK_NUM_];
+	uint8_t rx[_WIZCHIP_SOCK_NUM_];
+} EthMemProfile;
+
+/***
+ * Callback on a socket interrupt, made from interrupt context
+ * @param sock - socket id
+ * @param ctx - context provided on registration
+ */
+typedef void (*EthSockEventCallback)(uint8_t sock, void *ctx);
+
+/***
+ * Callback when the network is joined or lost, made from the
+ * EthHelper background task
+ * @param joined - true if plugged in with an IP address
+ * @param ctx - context provided on registration
+ */
+typedef void (*EthLinkCallback)(bool joined, void *ctx);
+
+/***
+ * Counters for TCP socket reads
+ */
+typedef struct {
+	uint32_t polls;			//Reads requested
+	uint32_t idleSkips;		//Reads answered without touching the chip
+	uint32_t spiOps;		//Chip accesses made by reads
+	uint32_t events;		//Interrupts taken
+	uint32_t latencyUs;		//Total interrupt to data read latency
+	uint32_t latencyCount;	//Reads included in latencyUs
+} EthReadStats;
+
 class EthHelper {
 public:
 	/***
@@ -55,14 +268,83 @@ public:
 	/***
 	 * Initialise and provide a buffer of length ETHERNET_BUF_MAX_SIZE
 	 * @param pBuf
+	 * @param profile - socket memory split, NULL leaves the even split
+	 * set by wizchip_initialize
+	 */
+	void init(uint8_t * pBuf, const EthMemProfile *profile = NULL);
+
+	/***
+	 * Set the split of socket memory, sockets should be closed
+	 * @param profile - sizes for each socket
+	 * @return false if the profile does not fit and was not applied
+	 */
+	bool setMemProfile(const EthMemProfile *profile);
+
+	/***
+	 * TX memory of a socket
+	 * @param sock - socket id
+	 * @return size in bytes
 	 */
-	void init(uint8_t * pBuf);
+	uint16_t getSockTxSize(uint8_t sock);
+
+	/***
+	 * Even split across all sockets
+	 */
+	static const EthMemProfile MEM_BALANCED;
+
+	/***
+	 * Small helper socket 0 for DNS, SNTP and DHCP, socket 1 (the first
+	 * handed out by sockAlloc) gets the most memory for a bulk MQTT
+	 * connection and the rest share what is left
+	 */
+	static const EthMemProfile MEM_BULK;
 
 	/***
 	 * Enable Mutex check for any ethernet operation.
 	 */
 	void enableMutex();
 
+	/***
+	 * Start the service task. Once running the task owns the W5x00 and
+	 * socket operations from other tasks are queued to it, TCP ahead of
+	 * UDP, rather than contending for the mutex. It also runs
+	 * asynchronous DNS lookups and refreshes the DNS cache.
+	 * @param priority - priority to run within FreeRTOS
+	 */
+	void start(UBaseType_t priority = tskIDLE_PRIORITY);
+
+	/***
+	 * Get the service task queue counters
+	 * @param stats - output
+	 */
+	void getServiceStats(EthServiceStats *stats);
+
+	/***
+	 * Allocate a hardware socket. One socket is kept by the helper
+	 * for DNS, SNTP and DHCP which take turns on it.
+	 * @return socket id or -1 if none free
+	 */
+	int8_t sockAlloc();
+
+	/***
+	 * Reserve a specific hardware socket, for callers that pick their own
+	 * @param sock - socket id
+	 * @return true if it was free
+	 */
+	bool sockReserve(uint8_t sock);
+
+	/***
+	 * Return a socket to the allocator
+	 * @param sock - socket id
+	 */
+	void sockFree(uint8_t sock);
+
+	/***
+	 * Get the socket allocation counters
+	 * @param stats - output
+	 */
+	void getSockStats(EthSockStats *stats);
+
 	/***
 	 * Get IP address of unit
 	 * @param ip - output uint8_t[4]
@@ -134,12 +416,21 @@ public:
 	bool syncRTCwithSNTP();
 
 	/***
-	 * Set list of servers for SNTP operations
-	 * @param sntpSvrHosts - array of strings
+	 * Set list of servers for SNTP operations. If the service task is
+	 * running the RTC is then kept in sync in the background every
+	 * SNTP_SYNC_INTERVAL_MS.
+	 * @param sntpSvrHosts - array of strings, not copied
 	 * @param count - number of items in array
 	 */
 	void setSNTPServers(const char **sntpSvrHosts, uint8_t count);
 
+	/***
+	 * Has the RTC been set from SNTP
+	 * @param ageMs - output ms since last good sync, may be NULL
+	 * @return true if synced at least once
+	 */
+	bool isRTCSynced(uint32_t *ageMs = NULL);
+
 	/***
 	 * Is Ethernet plug in and do we have an IP address
 	 * @return
@@ -153,18 +444,84 @@ public:
 	bool isPluggedIn();
 
 	/***
-	 * Run DHCP to update the ip address
-	 * @return
+	 * Register for callback when network is joined or lost.
+	 * Requires the background task to be started.
+	 * @param cb - callback
+	 * @param ctx - context passed to callback
+	 * @return false if no space for callback
+	 */
+	bool addLinkCallback(EthLinkCallback cb, void *ctx = NULL);
+
+	/***
+	 * Run DHCP to update the ip address. Starts DHCP if needed and
+	 * waits up to DHCP_CLIENT_TIMEOUT_MS for a lease.
+	 * @return true if leased
 	 */
 	bool dhcpClient();
 
+	/***
+	 * Start DHCP in the background, does not block. The lease is
+	 * renewed at T1 and T2 by the service task.
+	 */
+	void dhcpStart();
+
+	/***
+	 * Get state of the DHCP client
+	 * @return
+	 */
+	EthDhcpState getDhcpState();
+
+	/***
+	 * Time taken from starting DHCP to having an address
+	 * @return ms, 0 if not yet leased
+	 */
+	uint32_t getDhcpTimeToIp();
+
+	/***
+	 * Register for callback on DHCP lease events
+	 * @param cb - callback
+	 * @param ctx - context passed to callback
+	 * @return false if no space for callback
+	 */
+	bool addDhcpCallback(EthDhcpCallback cb, void *ctx = NULL);
+
 	/***
 	 * Perform a DNS lookup
 	 * @param ip - uint8_t[4] ip address of host
 	 * @param host - string host name to lookup
+	 * @param fresh - true to skip the cache and ask the server, for when
+	 * the cached address has stopped answering
 	 * @return true if successful
 	 */
-	bool dnsClient(uint8_t *ip,  const char * host);
+	bool dnsClient(uint8_t *ip,  const char * host, bool fresh = false);
+
+	/***
+	 * Start an asynchronous DNS lookup. Callback is made from the
+	 * background task, or from dnsPoll if the task is not started.
+	 * @param host - host name, copied
+	 * @param cb - callback on completion
+	 * @param ctx - context passed to callback
+	 * @return true if lookup started or answered from cache
+	 */
+	bool dnsStart(const char * host, DNSResolverCallback cb, void *ctx = NULL);
+
+	/***
+	 * Progress an asynchronous DNS lookup
+	 * @return state of the resolver
+	 */
+	DNSResolverState dnsPoll();
+
+	/***
+	 * Set secondary DNS server, raced against the one from DHCP
+	 * @param ip - uint8_t[4], NULL to disable
+	 */
+	void setSecondaryDNS(const uint8_t *ip);
+
+	/***
+	 * Get the DNS cache counters
+	 * @param stats - output
+	 */
+	void getDNSStats(DNSCacheStats *stats);
 
 	/***
 	 * Connect a TCP Socket
@@ -201,6 +558,85 @@ public:
 	 */
 	uint32_t tcpSockWrite(uint8_t sock, uint8_t *buf, size_t bytesToSend);
 
+	/***
+	 * Write several fragments to TCP socket. Fragments are copied to
+	 * consecutive offsets in the socket TX memory and sent with one SEND,
+	 * unless they do not fit in the free TX memory.
+	 * @param sock - socket id
+	 * @param frags - array of fragments
+	 * @param count - number of fragments
+	 * @return number of bytes written, negative on error
+	 */
+	int32_t tcpSockWritev(uint8_t sock, const EthFragment *frags, uint8_t count);
+
+	/***
+	 * Switch socket to event driven mode. The W5x00 INTn line is used to
+	 * flag RECV, DISCON and TIMEOUT so tcpSockRead does not touch the chip
+	 * while the socket is idle.
+	 * @param sock - socket id
+	 * @param cb - callback made from interrupt context, may be NULL
+	 * @param ctx - context passed to callback
+	 * @return true if successful
+	 */
+	bool enableSockEvents(uint8_t sock, EthSockEventCallback cb, void *ctx = NULL);
+
+	/***
+	 * Return socket to polled mode
+	 * @param sock - socket id
+	 */
+	void disableSockEvents(uint8_t sock);
+
+	/***
+	 * Is there possibly data to read on the socket.
+	 * Always true for a polled socket.
+	 * @param sock - socket id
+	 * @return
+	 */
+	bool tcpSockReady(uint8_t sock);
+
+	/***
+	 * Get the TCP read counters
+	 * @param stats - output
+	 */
+	void getReadStats(EthReadStats *stats);
+
+	/***
+	 * Open a UDP socket
+	 * @param sock - socket id
+	 * @param localPort - local port, 0 for any
+	 * @return true if successful
+	 */
+	bool udpSockOpen(uint8_t sock, uint16_t localPort);
+
+	/***
+	 * Send a datagram from UDP socket
+	 * @param sock - socket id
+	 * @param buf - buffer to send from
+	 * @param len - length of datagram
+	 * @param ip - uint8_t[4] destination
+	 * @param port - destination port
+	 * @return bytes sent, negative on error
+	 */
+	int32_t udpSockSendTo(uint8_t sock, uint8_t *buf, size_t len, const uint8_t *ip, uint16_t port);
+
+	/***
+	 * Receive a datagram on UDP socket if one is waiting
+	 * @param sock - socket id
+	 * @param buf - buffer to read into
+	 * @param len - length of buffer
+	 * @param ip - output uint8_t[4] source
+	 * @param port - output source port
+	 * @return bytes read, 0 if none, negative on error
+	 */
+	int32_t udpSockRecvFrom(uint8_t sock, uint8_t *buf, size_t len, uint8_t *ip, uint16_t *port);
+
+	/***
+	 * Close a UDP socket
+	 * @param sock - socket id
+	 * @return true if successful
+	 */
+	bool udpSockClose(uint8_t sock);
+
 
 protected:
 	/***
@@ -226,10 +662,199 @@ private:
 	uint32_t tcpSockReadLocal(uint8_t sock, uint8_t *buf, size_t bytesToRecv);
 
 	/***
-	 * DHCP renewal without mutex
+	 * Write fragments without mutex
+	 * @param sock - socket id
+	 * @param frags - array of fragments
+	 * @param count - number of fragments
+	 * @return number of bytes written, short if an error follows some data,
+	 * negative on error
+	 */
+	int32_t tcpSockWritevLocal(uint8_t sock, const EthFragment *frags, uint8_t count);
+
+	/***
+	 * Issue SEND for data already in the TX memory and wait for it to go
+	 * @param sock - socket id
+	 * @return true if sent
+	 */
+	bool tcpSendCmd(uint8_t sock);
+
+	/***
+	 * Check event state for socket before a read, clears Sn_IR if
+	 * an interrupt is pending, and that of any other event driven socket
+	 * so INTn can fall again
+	 * @param sock - socket id
+	 * @return true if read should go to the chip
+	 */
+	bool sockEventCheck(uint8_t sock);
+
+	/***
+	 * Raw interrupt handler for the INTn GPIO, shares the bank with any
+	 * application GPIO callback
+	 */
+	static void cbGpioIrq();
+
+	/***
+	 * Handle the socket interrupt
+	 */
+	void sockEventISR();
+
+	/***
+	 * Take the Ethernet mutex if enabled
+	 * @param ticks - max time to wait
+	 * @return true if caller may access the chip
+	 */
+	bool lock(TickType_t ticks = ETHMUTEXTICKS);
+
+	/***
+	 * Release the Ethernet mutex
+	 */
+	void unlock();
+
+	/***
+	 * Claim the resolver
+	 * @param ticks - time to wait
+	 * @return true if claimed
+	 */
+	bool dnsAcquire(TickType_t ticks);
+
+	/***
+	 * Release the resolver
+	 */
+	void dnsRelease();
+
+	/***
+	 * Complete an asynchronous lookup, update cache and make callback
+	 */
+	void dnsComplete();
+
+	/***
+	 * Start a refresh of any DNS cache entry close to expiry
+	 */
+	void dnsRefresh();
+
+	/***
+	 * Check for change in joined state and make link callbacks
+	 */
+	void linkCheck();
+
+	/***
+	 * Run a socket operation. Queued to the service task if it is
+	 * running, otherwise run in the calling task under the mutex. Before
+	 * start() a TCP read or write returns 0 if the mutex stays busy.
+	 * @param req - request, result is filled in
+	 * @param high - true to serve ahead of low priority requests
+	 * @return result of the operation
+	 */
+	int32_t request(EthRequest *req, bool high);
+
+	/***
+	 * Serve all waiting requests, high priority queue first
+	 */
+	void serviceRequests();
+
+	/***
+	 * Run an SNTP sync and wait for the result. The work is done by the
+	 * service task if running, only holding the mutex per packet.
+	 * @param hosts - servers to try, NULL if ip given
+	 * @param count - number of hosts
+	 * @param ip - uint8_t[4] server, NULL if hosts given
+	 * @return true if the RTC was set
+	 */
+	bool sntpSync(const char **hosts, uint8_t count, const uint8_t *ip);
+
+	/***
+	 * Start an SNTP cycle if none is running
+	 * @param hosts - servers to try, NULL if ip given
+	 * @param count - number of hosts
+	 * @param ip - uint8_t[4] server, NULL if hosts given
+	 * @param notify - give xSntpDone when finished
+	 * @return true if started
+	 */
+	bool sntpBegin(const char **hosts, uint8_t count, const uint8_t *ip, bool notify);
+
+	/***
+	 * Progress the SNTP cycle, does not block
+	 * @return true while the cycle is running
+	 */
+	bool sntpPoll();
+
+	/***
+	 * End the SNTP cycle
+	 * @param ok - true if RTC was set
+	 */
+	void sntpFinish(bool ok);
+
+	/***
+	 * Start a background sync if one is due
+	 */
+	void sntpSchedule();
+
+	/***
+	 * DNS answer for an SNTP server
+	 * @param host - host queried
+	 * @param ip - address or NULL on failure
+	 * @param ctx - this object
+	 */
+	static void sntpDnsCb(const char *host, const uint8_t *ip, void *ctx);
+
+	/***
+	 * Set the RTC from SNTP time
+	 * @param d - time from server
+	 * @return true if time was good
+	 */
+	bool rtcSet(datetime *d);
+
+	/***
+	 * Perform the operation, caller holds the mutex
+	 * @param req - request, result is filled in
+	 */
+	void execute(EthRequest *req);
+
+	/***
+	 * Task function for background housekeeping
+	 * @param pvParameters - EthHelper object
+	 */
+	static void vTask( void * pvParameters );
+
+	/***
+	 * Run loop for the background task
+	 */
+	void run();
+
+	/***
+	 * Current time in ms
 	 * @return
 	 */
-	bool dhcpClientLocal();
+	static uint32_t nowMs();
+
+	/***
+	 * Progress the DHCP client, does not block
+	 */
+	void dhcpPoll();
+
+	/***
+	 * Claim the shared helper socket used in turn by DNS, SNTP and DHCP
+	 * @param user - client claiming
+	 * @return true if claimed or already held by user
+	 */
+	bool helperClaim(EthHelperUser user);
+
+	/***
+	 * Release the shared helper socket if held by user
+	 * @param user - client releasing
+	 */
+	void helperRelease(EthHelperUser user);
+
+	/***
+	 * Lease gained, renewed or changed
+	 */
+	void dhcpBound();
+
+	/***
+	 * Make DHCP lease callbacks
+	 * @param event
+	 */
+	void dhcpEvent(EthDhcpEvent event);
 
 	/***
 	 * Callback if mac address conflict
@@ -267,7 +892,7 @@ private:
 	/***
 	 * Mutex
 	 */
-	SemaphoreHandle_t xSemaphore;
+	SemaphoreHandle_t xSemaphore = NULL;
 
 	/***
 	 * SNTP Servers
@@ -279,6 +904,102 @@ private:
 	 */
 	uint8_t xSntpCount = 0;
 
+	/***
+	 * Socket allocator and the shared helper socket
+	 */
+	volatile uint8_t xSockInUse = 0;
+	uint8_t xSockTxKB[_WIZCHIP_SOCK_NUM_];
+	uint8_t xSockRxKB[_WIZCHIP_SOCK_NUM_];
+	uint32_t xSockAllocMs[_WIZCHIP_SOCK_NUM_];
+	EthSockStats xSockStats;
+	uint8_t xHelperSock = 0;
+	volatile EthHelperUser xHelperUser = EthHelperFree;
+
+	/***
+	 * DHCP client state
+	 */
+	volatile EthDhcpState xDhcpState = DhcpOff;
+	uint32_t xDhcpStartMs = 0;
+	uint32_t xDhcpNextMs = 0;
+	uint32_t xDhcpLeaseMs = 0;
+	uint32_t xDhcpLease = 0;
+	uint32_t xDhcpTimeToIp = 0;
+	uint8_t xDhcpRetry = 0;
+	uint8_t xDhcpOldIp[4];
+	bool xDhcpRenewing = false;
+	bool xDhcpRebind = false;
+	SemaphoreHandle_t xDhcpDone = NULL;
+	StaticSemaphore_t xDhcpDoneBuffer;
+	EthDhcpCallback pDhcpCb[ETH_DHCP_CB_MAX];
+	void *pDhcpCtx[ETH_DHCP_CB_MAX];
+
+	/***
+	 * SNTP client state
+	 */
+	volatile EthSntpState xSntpState = SntpIdle;
+	const char **pSntpCycleHosts = NULL;
+	uint8_t xSntpCycleCount = 0;
+	uint8_t xSntpIndex = 0;
+	uint8_t xSntpIp[4];
+	uint32_t xSntpStartMs = 0;
+	uint32_t xSntpNextMs = 0;
+	uint32_t xSntpSyncMs = 0;
+	bool xSntpSynced = false;
+	bool xSntpOk = false;
+	bool xSntpNotify = false;
+	SemaphoreHandle_t xSntpMutex = NULL;
+	SemaphoreHandle_t xSntpDone = NULL;
+	StaticSemaphore_t xSntpMutexBuffer;
+	StaticSemaphore_t xSntpDoneBuffer;
+
+	/***
+	 * DNS answers
+	 */
+	DNSCache xDNSCache;
+
+	/***
+	 * Resolver and state of any asynchronous lookup
+	 */
+	DNSResolver xDNSResolver;
+	SemaphoreHandle_t xDnsSemaphore = NULL;
+	volatile bool xDnsAsync = false;
+	bool xDnsRefresh = false;
+	DNSResolverCallback pDnsCb = NULL;
+	void *pDnsCtx = NULL;
+
+	/***
+	 * Event driven sockets
+	 */
+	EthSockEventCallback pSockEventCb[_WIZCHIP_SOCK_NUM_];
+	void *pSockEventCtx[_WIZCHIP_SOCK_NUM_];
+	uint32_t xSockLastPoll[_WIZCHIP_SOCK_NUM_];
+	volatile uint8_t xSockEventMask = 0;
+	volatile uint8_t xSockPending = 0;
+	uint8_t xSockRxMore = 0;
+	uint8_t xSockFromInt = 0;
+	volatile uint32_t xIntUs = 0;
+	bool xIntConfigured = false;
+	EthReadStats xReadStats;
+
+	/***
+	 * Link state callbacks
+	 */
+	EthLinkCallback pLinkCb[ETH_LINK_CB_MAX];
+	void *pLinkCtx[ETH_LINK_CB_MAX];
+	bool xLinkJoined = false;
+
+	/***
+	 * Service task and its request queues
+	 */
+	TaskHandle_t xHandle = NULL;
+	QueueHandle_t xReqHigh = NULL;
+	QueueHandle_t xReqLow = NULL;
+	StaticQueue_t xReqHighStruct;
+	StaticQueue_t xReqLowStruct;
+	uint8_t xReqHighStorage[ETH_REQ_QUEUE_LEN * sizeof(EthRequest *)];
+	uint8_t xReqLowStorage[ETH_REQ_QUEUE_LEN * sizeof(EthRequest *)];
+	EthServiceStats xServiceStats;
+
 	/***
 	 * Counter
 	 */
@@ -0,0 +1,909 @@
+/*
+ * MQTT5Codec.cpp
+ *
+ * Translates between the MQTT 3.1.1 packets produced and consumed by
+ * coreMQTT and MQTT 5 on the wire.
+ */
+
+#include "MQTT5Codec.h"
+#include "MQTTConfig.h"
+#include <string.h>
+
+extern "C" {
+#include <FreeRTOS.h>
+#include <task.h>
+}
+
+//Packet types, high nibble of first byte
+#define MQTT5_CONNECT		0x10
+#define MQTT5_CONNACK		0x20
+#define MQTT5_PUBLISH		0x30
+#define MQTT5_PUBACK		0x40
+#define MQTT5_PUBREC		0x50
+#define MQTT5_PUBREL		0x60
+#define MQTT5_PUBCOMP		0x70
+#define MQTT5_SUBSCRIBE		0x80
+#define MQTT5_SUBACK		0x90
+#define MQTT5_UNSUBSCRIBE	0xA0
+#define MQTT5_UNSUBACK		0xB0
+#define MQTT5_DISCONNECT	0xE0
+
+//Property identifiers
+#define MQTT5_PROP_SESSION_EXPIRY	0x11
+#define MQTT5_PROP_RECV_MAX			0x21
+#define MQTT5_PROP_ALIAS_MAX		0x22
+#define MQTT5_PROP_ALIAS			0x23
+#define MQTT5_PROP_MAX_PACKET		0x27
+
+//3.1.1 CONNECT variable header is protocol name, level, flags, keep alive
+#define MQTT311_CONNECT_VAR 10
+
+//CONNECT flags
+#define MQTT_FLAG_CLEAN 0x02
+#define MQTT_FLAG_WILL	0x04
+
+//CONNACK codes
+#define MQTT5_RC_BAD_PROTOCOL	0x84
+#define MQTT311_RC_BAD_PROTOCOL	0x01
+
+/***
+ * Constructor
+ */
+MQTT5Codec::MQTT5Codec() {
+	memset(&xStats, 0, sizeof(xStats));
+}
+
+/***
+ * Destructor
+ */
+MQTT5Codec::~MQTT5Codec() {
+	// NOP
+}
+
+/***
+ * Set limits advertised in CONNECT
+ * @param recvMax - Receive Maximum, inbound QoS1/2 publishes in flight
+ * @param maxPacket - Maximum Packet Size we can receive
+ * @param sessionExpiry - seconds session is kept when not clean start
+ */
+void MQTT5Codec::configure(uint16_t recvMax, uint32_t maxPacket, uint32_t sessionExpiry){
+	xRecvMax = recvMax;
+	xMaxPacket = maxPacket;
+	xSessionExpiry = sessionExpiry;
+}
+
+/***
+ * Set the raw connection functions
+ * @param wr - write function
+ * @param rd - read function
+ * @param ctx - context passed to both
+ */
+void MQTT5Codec::setIO(MQTT5Write wr, MQTT5Read rd, void *ctx){
+	pWrite = wr;
+	pRead = rd;
+	pCtx = ctx;
+}
+
+/***
+ * Start of a new connection, forgets aliases and broker limits
+ */
+void MQTT5Codec::reset(){
+	xServerRecvMax = 65535;
+	xServerMaxPacket = 0;
+	xServerAliasMax = 0;
+	xRefused = false;
+
+	xOutState = OutFixed;
+	xOutHdrLen = 0;
+	xAliasCount = 0;
+	xAliasNext = 0;
+
+	xInState = InFixed;
+	xInHdrLen = 0;
+	xInOutLen = 0;
+	xInOutPos = 0;
+}
+
+/***
+ * Are translated bytes waiting to be read
+ * @return
+ */
+bool MQTT5Codec::isPending(){
+	return xInOutPos < xInOutLen;
+}
+
+/***
+ * Did the broker refuse protocol version 5 on the last CONNECT
+ * @return
+ */
+bool MQTT5Codec::isRefused(){
+	return xRefused;
+}
+
+/***
+ * Broker's Receive Maximum from CONNACK
+ * @return
+ */
+uint16_t MQTT5Codec::getServerRecvMax(){
+	return xServerRecvMax;
+}
+
+/***
+ * Broker's Maximum Packet Size from CONNACK
+ * @return size, 0 if no limit
+ */
+uint32_t MQTT5Codec::getServerMaxPacket(){
+	return xServerMaxPacket;
+}
+
+/***
+ * Copy of the counters
+ * @param stats - output
+ */
+void MQTT5Codec::getStats(MQTT5Stats *stats){
+	taskENTER_CRITICAL();
+	memcpy(stats, &xStats, sizeof(MQTT5Stats));
+	taskEXIT_CRITICAL();
+}
+
+/***
+ * Encode a variable byte integer
+ * @param buf - output, up to 4 bytes
+ * @param value
+ * @return bytes used
+ */
+uint8_t MQTT5Codec::putVarint(uint8_t *buf, uint32_t value){
+	uint8_t n = 0;
+	do {
+		uint8_t b = value & 0x7F;
+		value = value >> 7;
+		if (value > 0){
+			b |= 0x80;
+		}
+		buf[n++] = b;
+	} while ((value > 0) && (n < 4));
+	return n;
+}
+
+/***
+ * Decode a variable byte integer
+ * @param buf
+ * @param len - bytes available
+ * @param value - output
+ * @return bytes used, 0 if incomplete
+ */
+uint8_t MQTT5Codec::getVarint(const uint8_t *buf, uint32_t len, uint32_t *value){
+	uint32_t v = 0;
+	uint32_t mul = 1;
+	for (uint8_t n = 0; (n < len) && (n < 4); n++){
+		v += (buf[n] & 0x7F) * mul;
+		mul = mul * 128;
+		if ((buf[n] & 0x80) == 0){
+			*value = v;
+			return n + 1;
+		}
+	}
+	return 0;
+}
+
+/***
+ * Write to the connection, counting bytes
+ * @param buf
+ * @param len
+ * @return false on error
+ */
+bool MQTT5Codec::write(const void *buf, size_t len){
+	const uint8_t *p = (const uint8_t *)buf;
+	while (len > 0){
+		int32_t res = pWrite(pCtx, p, len);
+		if (res < 0){
+			return false;
+		}
+		p += res;
+		len -= res;
+		xStats.bytesOut += res;
+	}
+	return true;
+}
+
+/***
+ * Translate 3.1.1 bytes to MQTT 5 and write them. Packets may be
+ * split across calls.
+ * @param buf - 3.1.1 data
+ * @param len - length of data
+ * @return len, or negative on error
+ */
+int32_t MQTT5Codec::encode(const void *buf, size_t len){
+	const uint8_t *p = (const uint8_t *)buf;
+	size_t i = 0;
+	bool ok = true;
+
+	xStats.bytesIn += len;
+	while (ok && (i < len)){
+		switch(xOutState){
+		case OutFixed: {
+			xOutHdr[xOutHdrLen++] = p[i++];
+			if (xOutHdrLen == 1){
+				break;
+			}
+			if (getVarint(&xOutHdr[1], xOutHdrLen - 1, &xOutRl) > 0){
+				ok = outStart();
+			} else if (xOutHdrLen >= sizeof(xOutHdr)){
+				LogError(("MQTT5 bad remaining length"));
+				ok = false;
+			}
+			break;
+		}
+		case OutCollect: {
+			size_t n = xOutNeed - xOutHave;
+			if (n > (len - i)){
+				n = len - i;
+			}
+			memcpy(&xOutBuf[xOutHave], &p[i], n);
+			xOutHave += n;
+			i += n;
+			if (xOutHave == xOutNeed){
+				ok = outCollected();
+			}
+			break;
+		}
+		case OutPass: {
+			size_t n = xOutRemain;
+			if (xOutInsert && (xOutInsertAt < n)){
+				n = xOutInsertAt;
+			}
+			if (n > (len - i)){
+				n = len - i;
+			}
+			if (n > 0){
+				ok = write(&p[i], n);
+				i += n;
+				xOutRemain -= n;
+				xOutInsertAt -= n;
+			}
+			if (ok && xOutInsert && (xOutInsertAt == 0)){
+				uint8_t zero = 0;
+				ok = write(&zero, 1);
+				xOutInsert = false;
+			}
+			if (xOutRemain == 0){
+				xOutState = OutFixed;
+				xOutHdrLen = 0;
+			}
+			break;
+		}
+		}
+	}
+
+	if (!ok){
+		xOutState = OutFixed;
+		xOutHdrLen = 0;
+		return -1;
+	}
+	return len;
+}
+
+/***
+ * Fixed header of an outbound packet is complete
+ * @return false on error
+ */
+bool MQTT5Codec::outStart(){
+	uint8_t type = xOutHdr[0] & 0xF0;
+	xOutHave = 0;
+
+	switch(type){
+	case MQTT5_CONNECT:
+		if (xOutRl > MQTT5_CONNECT_MAX){
+			LogError(("MQTT5 CONNECT too large %d", xOutRl));
+			return false;
+		}
+		reset();
+		xOutNeed = xOutRl;
+		xOutState = OutCollect;
+		return true;
+	case MQTT5_PUBLISH:
+		xStats.publishes++;
+		xOutNeed = 2;
+		xOutState = OutCollect;
+		return true;
+	case MQTT5_SUBSCRIBE:
+	case MQTT5_UNSUBSCRIBE:
+		//Empty properties after packet id, QoS byte is valid subscription options
+		return outInsert(2);
+	default:
+		//PUBACK, PUBREC, PUBREL, PUBCOMP, PINGREQ and DISCONNECT are unchanged
+		if (!write(xOutHdr, xOutHdrLen)){
+			return false;
+		}
+		xOutInsert = false;
+		xOutRemain = xOutRl;
+		xOutState = (xOutRemain > 0) ? OutPass : OutFixed;
+		xOutHdrLen = 0;
+		return true;
+	}
+}
+
+/***
+ * Write header and pass rest of packet, inserting an empty
+ * property length after insertAt bytes
+ * @param insertAt - bytes of variable header before the properties
+ * @return false on error
+ */
+bool MQTT5Codec::outInsert(uint32_t insertAt){
+	uint8_t hdr[5];
+	uint8_t n;
+
+	hdr[0] = xOutHdr[0];
+	n = putVarint(&hdr[1], xOutRl + 1) + 1;
+	if (!write(hdr, n)){
+		return false;
+	}
+	xOutRemain = xOutRl;
+	xOutInsertAt = insertAt;
+	xOutInsert = true;
+	xOutState = OutPass;
+	return true;
+}
+
+/***
+ * Collected part of an outbound packet is complete
+ * @return false on error
+ */
+bool MQTT5Codec::outCollected(){
+	uint8_t type = xOutHdr[0] & 0xF0;
+
+	if (type == MQTT5_CONNECT){
+		bool ok = outConnect();
+		xOutState = OutFixed;
+		xOutHdrLen = 0;
+		return ok;
+	}
+
+	//PUBLISH
+	uint16_t topicLen = (xOutBuf[0] << 8) | xOutBuf[1];
+	uint32_t varLen = 2 + topicLen + (((xOutHdr[0] & 0x06) != 0) ? 2 : 0);
+	if (xOutNeed == 2){
+		if ((xServerAliasMax == 0) || (topicLen > MQTT5_ALIAS_TOPIC_MAX)){
+			//No alias, empty properties after topic and packet id
+			if (!outInsert(varLen - 2)){
+				return false;
+			}
+			xOutRemain -= 2;
+			return write(xOutBuf, 2);
+		}
+		xOutNeed = varLen;
+		return true;
+	}
+	return outPublishAlias();
+}
+
+/***
+ * Write a PUBLISH header using a topic alias
+ * @return false on error
+ */
+bool MQTT5Codec::outPublishAlias(){
+	uint8_t hdr[16 + MQTT5_ALIAS_TOPIC_MAX];
+	uint16_t topicLen = (xOutBuf[0] << 8) | xOutBuf[1];
+	uint32_t pidLen = xOutNeed - 2 - topicLen;
+	bool known = false;
+	uint16_t alias = aliasFor(&xOutBuf[2], topicLen, &known);
+	uint32_t sentTopic = known ? 0 : topicLen;
+	uint32_t rl = xOutRl - topicLen + sentTopic + 4;
+	size_t n = 0;
+
+	hdr[n++] = xOutHdr[0];
+	n += putVarint(&hdr[n], rl);
+	hdr[n++] = sentTopic >> 8;
+	hdr[n++] = sentTopic & 0xFF;
+	memcpy(&hdr[n], &xOutBuf[2], sentTopic);
+	n += sentTopic;
+	memcpy(&hdr[n], &xOutBuf[2 + topicLen], pidLen);
+	n += pidLen;
+	hdr[n++] = 3;
+	hdr[n++] = MQTT5_PROP_ALIAS;
+	hdr[n++] = alias >> 8;
+	hdr[n++] = alias & 0xFF;
+
+	if (known){
+		xStats.aliasHits++;
+	} else {
+		xStats.aliasSet++;
+	}
+
+	if (!write(hdr, n)){
+		return false;
+	}
+	xOutInsert = false;
+	xOutRemain = xOutRl - xOutNeed;
+	xOutState = (xOutRemain > 0) ? OutPass : OutFixed;
+	xOutHdrLen = 0;
+	return true;
+}
+
+/***
+ * Find or assign the alias for a topic
+ * @param topic
+ * @param len
+ * @param known - output, true if the broker already has this alias
+ * @return alias, 0 if none
+ */
+uint16_t MQTT5Codec::aliasFor(const uint8_t *topic, uint16_t len, bool *known){
+	uint8_t max = MQTT5_ALIAS_MAX;
+	if (xServerAliasMax < max){
+		max = xServerAliasMax;
+	}
+
+	for (uint8_t i=0; i < xAliasCount; i++){
+		if ((xAliasLen[i] == len) && (memcmp(xAliasTopic[i], topic, len) == 0)){
+			*known = true;
+			return i + 1;
+		}
+	}
+
+	//Reuse aliases in turn once all are taken, broker takes the new topic
+	uint8_t i = xAliasNext;
+	if (xAliasCount < max){
+		xAliasCount++;
+	}
+	xAliasNext = (xAliasNext + 1) % max;
+	memcpy(xAliasTopic[i], topic, len);
+	xAliasLen[i] = len;
+	*known = false;
+	return i + 1;
+}
+
+/***
+ * Write a translated CONNECT from the collected 3.1.1 packet
+ * @return false on error
+ */
+bool MQTT5Codec::outConnect(){
+	uint8_t hdr[MQTT311_CONNECT_VAR + 24];
+	uint8_t props[16];
+	uint8_t flags;
+	size_t n = 0;
+	size_t p = 0;
+
+	if (xOutRl < (MQTT311_CONNECT_VAR + 2)){
+		LogError(("MQTT5 CONNECT malformed"));
+		return false;
+	}
+	flags = xOutBuf[7];
+
+	props[p++] = MQTT5_PROP_RECV_MAX;
+	props[p++] = xRecvMax >> 8;
+	props[p++] = xRecvMax & 0xFF;
+	if (xMaxPacket > 0){
+		props[p++] = MQTT5_PROP_MAX_PACKET;
+		props[p++] = xMaxPacket >> 24;
+		props[p++] = (xMaxPacket >> 16) & 0xFF;
+		props[p++] = (xMaxPacket >> 8) & 0xFF;
+		props[p++] = xMaxPacket & 0xFF;
+	}
+	if ((flags & MQTT_FLAG_CLEAN) == 0){
+		//Version 5 ends the session at disconnect unless told otherwise
+		props[p++] = MQTT5_PROP_SESSION_EXPIRY;
+		props[p++] = xSessionExpiry >> 24;
+		props[p++] = (xSessionExpiry >> 16) & 0xFF;
+		props[p++] = (xSessionExpiry >> 8) & 0xFF;
+		props[p++] = xSessionExpiry & 0xFF;
+	}
+
+	uint16_t idLen = (xOutBuf[MQTT311_CONNECT_VAR] << 8) | xOutBuf[MQTT311_CONNECT_VAR + 1];
+	size_t idEnd = MQTT311_CONNECT_VAR + 2 + idLen;
+	bool will = (flags & MQTT_FLAG_WILL) != 0;
+	if (idEnd > xOutRl){
+		LogError(("MQTT5 CONNECT malformed"));
+		return false;
+	}
+
+	hdr[n++] = xOutHdr[0];
+	n += putVarint(&hdr[n], xOutRl + 1 + p + (will ? 1 : 0));
+	memcpy(&hdr[n], xOutBuf, MQTT311_CONNECT_VAR);
+	hdr[n + 6] = 5;
+	n += MQTT311_CONNECT_VAR;
+	hdr[n++] = p;
+	memcpy(&hdr[n], props, p);
+	n += p;
+
+	if (!write(hdr, n)){
+		return false;
+	}
+	if (!write(&xOutBuf[MQTT311_CONNECT_VAR], idEnd - MQTT311_CONNECT_VAR)){
+		return false;
+	}
+	if (will){
+		uint8_t zero = 0;
+		if (!write(&zero, 1)){
+			return false;
+		}
+	}
+	return write(&xOutBuf[idEnd], xOutRl - idEnd);
+}
+
+/***
+ * Read MQTT 5 bytes and translate to 3.1.1
+ * @param buf - buffer for 3.1.1 data
+ * @param len - max bytes wanted
+ * @return bytes returned, 0 if none waiting, negative on error
+ */
+int32_t MQTT5Codec::decode(void *buf, size_t len){
+	uint8_t *out = (uint8_t *)buf;
+	size_t n = 0;
+
+	while (n < len){
+		if (xInOutPos < xInOutLen){
+			size_t c = xInOutLen - xInOutPos;
+			if (c > (len - n)){
+				c = len - n;
+			}
+			memcpy(&out[n], &xInOut[xInOutPos], c);
+			xInOutPos += c;
+			n += c;
+			continue;
+		}
+
+		int32_t r = 0;
+		switch(xInState){
+		case InFixed: {
+			r = pRead(pCtx, &xInHdr[xInHdrLen], 1);
+			if (r <= 0){
+				break;
+			}
+			xInHdrLen++;
+			if (xInHdrLen == 1){
+				break;
+			}
+			if (getVarint(&xInHdr[1], xInHdrLen - 1, &xInRl) > 0){
+				if (!inStart()){
+					r = -1;
+				}
+			} else if (xInHdrLen >= sizeof(xInHdr)){
+				LogError(("MQTT5 bad remaining length"));
+				r = -1;
+			}
+			break;
+		}
+		case InCollect: {
+			r = pRead(pCtx, &xInBuf[xInHave], xInNeed - xInHave);
+			if (r <= 0){
+				break;
+			}
+			xInHave += r;
+			if ((xInHave == xInNeed) && !inCollected()){
+				r = -1;
+			}
+			break;
+		}
+		case InSkip: {
+			uint8_t scratch[32];
+			size_t c = xInSkip;
+			if (c > sizeof(scratch)){
+				c = sizeof(scratch);
+			}
+			r = pRead(pCtx, scratch, c);
+			if (r <= 0){
+				break;
+			}
+			xInSkip -= r;
+			if (xInSkip == 0){
+				xInState = (xInRemain > 0) ? InPass : InFixed;
+				xInHdrLen = 0;
+			}
+			break;
+		}
+		case InPass: {
+			size_t c = xInRemain;
+			if (c > (len - n)){
+				c = len - n;
+			}
+			r = pRead(pCtx, &out[n], c);
+			if (r <= 0){
+				break;
+			}
+			if (xInMapCodes){
+				//SUBACK reason codes, any failure is 0x80 in 3.1.1
+				for (int32_t j=0; j < r; j++){
+					if (out[n + j] >= 0x80){
+						out[n + j] = 0x80;
+					}
+				}
+			}
+			n += r;
+			xInRemain -= r;
+			if (xInRemain == 0){
+				xInState = InFixed;
+				xInHdrLen = 0;
+			}
+			break;
+		}
+		}
+
+		if (r < 0){
+			xInState = InFixed;
+			xInHdrLen = 0;
+			return -1;
+		}
+		if (r == 0){
+			break;
+		}
+	}
+	return n;
+}
+
+/***
+ * Fixed header of an inbound packet is complete
+ * @return false on error
+ */
+bool MQTT5Codec::inStart(){
+	uint8_t type = xInHdr[0] & 0xF0;
+	xInHave = 0;
+	xInSkip = 0;
+	xInRemain = 0;
+	xInMapCodes = false;
+	xInOutLen = 0;
+	xInOutPos = 0;
+
+	switch(type){
+	case MQTT5_CONNACK:
+		xInNeed = (xInRl > MQTT5_IN_HDR_MAX) ? MQTT5_IN_HDR_MAX : xInRl;
+		break;
+	case MQTT5_PUBLISH:
+	case MQTT5_SUBACK:
+		xInNeed = 2;
+		break;
+	case MQTT5_PUBACK:
+	case MQTT5_PUBREC:
+	case MQTT5_PUBREL:
+	case MQTT5_PUBCOMP:
+		xInNeed = (xInRl > 3) ? 3 : xInRl;
+		break;
+	case MQTT5_UNSUBACK:
+		xInNeed = 2;
+		break;
+	case MQTT5_DISCONNECT:
+		LogError(("MQTT5 broker sent DISCONNECT"));
+		return false;
+	default:
+		//PINGRESP is unchanged
+		memcpy(xInOut, xInHdr, xInHdrLen);
+		xInOutLen = xInHdrLen;
+		xInRemain = xInRl;
+		xInState = (xInRemain > 0) ? InPass : InFixed;
+		xInHdrLen = 0;
+		return true;
+	}
+
+	if ((xInNeed == 0) || (xInNeed > xInRl)){
+		LogError(("MQTT5 packet malformed %x", xInHdr[0]));
+		return false;
+	}
+	xInState = InCollect;
+	return true;
+}
+
+/***
+ * Collected part of an inbound packet is complete
+ * @return false on error
+ */
+bool MQTT5Codec::inCollected(){
+	uint8_t type = xInHdr[0] & 0xF0;
+	uint32_t propLen = 0;
+	uint8_t vl;
+	size_t n = 0;
+
+	switch(type){
+	case MQTT5_CONNACK: {
+		uint8_t rc = (xInNeed > 1) ? xInBuf[1] : 0;
+		if (xInRl == 2){
+			//Broker only speaks 3.1.1 and answered in kind
+			if (rc == MQTT311_RC_BAD_PROTOCOL){
+				xRefused = true;
+			}
+		} else {
+			vl = getVarint(&xInBuf[2], xInNeed - 2, &propLen);
+			if ((vl > 0) && ((2 + vl + propLen) <= xInNeed)){
+				inConnackProps(&xInBuf[2 + vl], propLen);
+			}
+			switch(rc){
+			case 0x00:
+				break;
+			case MQTT5_RC_BAD_PROTOCOL:
+				xRefused = true;
+				rc = MQTT311_RC_BAD_PROTOCOL;
+				break;
+			case 0x85:
+				rc = 0x02;	//Identifier rejected
+				break;
+			case 0x86:
+				rc = 0x04;	//Bad user name or password
+				break;
+			case 0x87:
+				rc = 0x05;	//Not authorised
+				break;
+			default:
+				rc = 0x03;	//Server unavailable
+				break;
+			}
+		}
+		if (xRefused){
+			taskENTER_CRITICAL();
+			xStats.refusals++;
+			taskEXIT_CRITICAL();
+		}
+		xInOut[n++] = xInHdr[0];
+		xInOut[n++] = 2;
+		xInOut[n++] = xInBuf[0];
+		xInOut[n++] = rc;
+		xInSkip = xInRl - xInNeed;
+		break;
+	}
+	case MQTT5_PUBLISH: {
+		uint32_t pidLen = ((xInHdr[0] & 0x06) != 0) ? 2 : 0;
+		uint16_t topicLen = (xInBuf[0] << 8) | xInBuf[1];
+		uint32_t fixed = 2 + topicLen + pidLen;
+
+		if (xInNeed == 2){
+			if ((fixed + 1) > MQTT5_IN_HDR_MAX){
+				LogError(("MQTT5 inbound topic too long %d", topicLen));
+				return false;
+			}
+			if ((fixed + 1) > xInRl){
+				LogError(("MQTT5 PUBLISH malformed"));
+				return false;
+			}
+			xInNeed = fixed + 1;
+			return true;
+		}
+		vl = getVarint(&xInBuf[fixed], xInNeed - fixed, &propLen);
+		if (vl == 0){
+			//Property length continues
+			if ((xInNeed >= MQTT5_IN_HDR_MAX) || ((xInNeed - fixed) >= 4) || (xInNeed >= xInRl)){
+				LogError(("MQTT5 PUBLISH malformed"));
+				return false;
+			}
+			xInNeed++;
+			return true;
+		}
+		if ((fixed + vl + propLen) > xInRl){
+			LogError(("MQTT5 PUBLISH malformed"));
+			return false;
+		}
+		xInOut[n++] = xInHdr[0];
+		n += putVarint(&xInOut[n], xInRl - vl - propLen);
+		memcpy(&xInOut[n], xInBuf, fixed);
+		n += fixed;
+		xInSkip = propLen;
+		xInRemain = xInRl - fixed - vl - propLen;
+		break;
+	}
+	case MQTT5_SUBACK: {
+		if (xInNeed == 2){
+			if (xInRl < 3){
+				LogError(("MQTT5 SUBACK malformed"));
+				return false;
+			}
+			xInNeed = 3;
+			return true;
+		}
+		vl = getVarint(&xInBuf[2], xInNeed - 2, &propLen);
+		if (vl == 0){
+			if (((xInNeed - 2) >= 4) || (xInNeed >= xInRl)){
+				LogError(("MQTT5 SUBACK malformed"));
+				return false;
+			}
+			xInNeed++;
+			return true;
+		}
+		if ((2 + vl + propLen) > xInRl){
+			LogError(("MQTT5 SUBACK malformed"));
+			return false;
+		}
+		xInOut[n++] = xInHdr[0];
+		n += putVarint(&xInOut[n], xInRl - vl - propLen);
+		xInOut[n++] = xInBuf[0];
+		xInOut[n++] = xInBuf[1];
+		xInSkip = propLen;
+		xInRemain = xInRl - 2 - vl - propLen;
+		xInMapCodes = true;
+		break;
+	}
+	default:
+		//Acks, drop reason code and properties
+		if (xInNeed < 2){
+			LogError(("MQTT5 ack malformed %x", xInHdr[0]));
+			return false;
+		}
+		if ((xInNeed > 2) && (xInBuf[2] >= 0x80)){
+			LogError(("MQTT5 ack %x reason %x", xInHdr[0], xInBuf[2]));
+		}
+		xInOut[n++] = xInHdr[0];
+		xInOut[n++] = 2;
+		xInOut[n++] = xInBuf[0];
+		xInOut[n++] = xInBuf[1];
+		xInSkip = xInRl - xInNeed;
+		break;
+	}
+
+	xInOutLen = n;
+	xInOutPos = 0;
+	if (xInSkip > 0){
+		xInState = InSkip;
+	} else {
+		xInState = (xInRemain > 0) ? InPass : InFixed;
+		xInHdrLen = 0;
+	}
+	return true;
+}
+
+/***
+ * Parse the properties of a CONNACK
+ * @param buf - first byte of properties
+ * @param len - length of properties
+ */
+void MQTT5Codec::inConnackProps(const uint8_t *buf, uint32_t len){
+	uint32_t i = 0;
+	while (i < len){
+		uint8_t id = buf[i++];
+		uint32_t skip;
+		switch(id){
+		case MQTT5_PROP_RECV_MAX:
+			if ((i + 2) <= len){
+				xServerRecvMax = (buf[i] << 8) | buf[i+1];
+			}
+			skip = 2;
+			break;
+		case MQTT5_PROP_ALIAS_MAX:
+			if ((i + 2) <= len){
+				xServerAliasMax = (buf[i] << 8) | buf[i+1];
+			}
+			skip = 2;
+			break;
+		case MQTT5_PROP_MAX_PACKET:
+			if ((i + 4) <= len){
+				xServerMaxPacket = ((uint32_t)buf[i] << 24) | ((uint32_t)buf[i+1] << 16) |
+						((uint32_t)buf[i+2] << 8) | buf[i+3];
+			}
+			skip = 4;
+			break;
+		case 0x24:	//Maximum QoS
+		case 0x25:	//Retain available
+		case 0x28:	//Wildcard subscription available
+		case 0x29:	//Subscription identifiers available
+		case 0x2A:	//Shared subscription available
+			skip = 1;
+			break;
+		case 0x13:	//Server keep alive
+			skip = 2;
+			break;
+		case MQTT5_PROP_SESSION_EXPIRY:
+			skip = 4;
+			break;
+		case 0x12:	//Assigned client identifier
+		case 0x15:	//Authentication method
+		case 0x16:	//Authentication data
+		case 0x1A:	//Response information
+		case 0x1C:	//Server reference
+		case 0x1F:	//Reason string
+			if ((i + 2) > len){
+				return;
+			}
+			skip = 2 + ((buf[i] << 8) | buf[i+1]);
+			break;
+		case 0x26: {	//User property, two strings
+			if ((i + 2) > len){
+				return;
+			}
+			uint32_t k = 2 + ((buf[i] << 8) | buf[i+1]);
+			if ((i + k + 2) > len){
+				return;
+			}
+			skip = k + 2 + ((buf[i+k] << 8) | buf[i+k+1]);
+			break;
+		}
+		default:
+			LogDebug(("MQTT5 unknown CONNACK property %x", id));
+			return;
+		}
+		i += skip;
+	}
+}
@@ -0,0 +1,287 @@
+/*
+ * MQTT5Codec.h
+ *
+ * Translates between the MQTT 3.1.1 packets produced and consumed by
+ * coreMQTT and MQTT 5 on the wire. Sits in the TCP transport so the rest
+ * of the agent is unchanged. Outbound PUBLISH packets use topic aliases
+ * when the broker allows them, CONNECT advertises Receive Maximum and
+ * Maximum Packet Size and the broker's limits are taken from CONNACK.
+ */
+
+#ifndef SRC_MQTT5CODEC_H_
+#define SRC_MQTT5CODEC_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+//Outbound topic aliases held per connection
+#ifndef MQTT5_ALIAS_MAX
+#define MQTT5_ALIAS_MAX 8
+#endif
+
+//Longest topic given an alias
+#ifndef MQTT5_ALIAS_TOPIC_MAX
+#define MQTT5_ALIAS_TOPIC_MAX 64
+#endif
+
+//Largest CONNECT that can be translated
+#ifndef MQTT5_CONNECT_MAX
+#define MQTT5_CONNECT_MAX 256
+#endif
+
+//Largest inbound header, topic included, that can be translated
+#ifndef MQTT5_IN_HDR_MAX
+#define MQTT5_IN_HDR_MAX 256
+#endif
+
+/***
+ * Raw write to the connection
+ * @param ctx - context given to the codec
+ * @param buf - data
+ * @param len - length of data
+ * @return bytes written, negative on error
+ */
+typedef int32_t (*MQTT5Write)(void *ctx, const void *buf, size_t len);
+
+/***
+ * Raw read from the connection
+ * @param ctx - context given to the codec
+ * @param buf - buffer to read into
+ * @param len - max bytes to read
+ * @return bytes read, 0 if none waiting, negative on error
+ */
+typedef int32_t (*MQTT5Read)(void *ctx, void *buf, size_t len);
+
+/***
+ * Counters, bytesIn less bytesOut is the saving from topic aliases
+ */
+typedef struct {
+	uint32_t publishes;		//Outbound PUBLISH packets
+	uint32_t aliasSet;		//PUBLISH packets that set an alias
+	uint32_t aliasHits;		//PUBLISH packets sent with alias only
+	uint32_t bytesIn;		//Bytes of 3.1.1 given to encode
+	uint32_t bytesOut;		//Bytes of 5 written to the connection
+	uint32_t refusals;		//CONNACKs refusing protocol version 5
+} MQTT5Stats;
+
+class MQTT5Codec {
+public:
+	/***
+	 * Constructor
+	 */
+	MQTT5Codec();
+
+	/***
+	 * Destructor
+	 */
+	virtual ~MQTT5Codec();
+
+	/***
+	 * Set limits advertised in CONNECT
+	 * @param recvMax - Receive Maximum, inbound QoS1/2 publishes in flight
+	 * @param maxPacket - Maximum Packet Size we can receive
+	 * @param sessionExpiry - seconds session is kept when not clean start
+	 */
+	void configure(uint16_t recvMax, uint32_t maxPacket, uint32_t sessionExpiry);
+
+	/***
+	 * Set the raw connection functions
+	 * @param wr - write function
+	 * @param rd - read function
+	 * @param ctx - context passed to both
+	 */
+	void setIO(MQTT5Write wr, MQTT5Read rd, void *ctx);
+
+	/***
+	 * Start of a new connection, forgets aliases and broker limits
+	 */
+	void reset();
+
+	/***
+	 * Translate 3.1.1 bytes to MQTT 5 and write them. Packets may be
+	 * split across calls.
+	 * @param buf - 3.1.1 data
+	 * @param len - length of data
+	 * @return len, or negative on error
+	 */
+	int32_t encode(const void *buf, size_t len);
+
+	/***
+	 * Read MQTT 5 bytes and translate to 3.1.1
+	 * @param buf - buffer for 3.1.1 data
+	 * @param len - max bytes wanted
+	 * @return bytes returned, 0 if none waiting, negative on error
+	 */
+	int32_t decode(void *buf, size_t len);
+
+	/***
+	 * Are translated bytes waiting to be read
+	 * @return
+	 */
+	bool isPending();
+
+	/***
+	 * Did the broker refuse protocol version 5 on the last CONNECT
+	 * @return
+	 */
+	bool isRefused();
+
+	/***
+	 * Broker's Receive Maximum from CONNACK
+	 * @return
+	 */
+	uint16_t getServerRecvMax();
+
+	/***
+	 * Broker's Maximum Packet Size from CONNACK
+	 * @return size, 0 if no limit
+	 */
+	uint32_t getServerMaxPacket();
+
+	/***
+	 * Copy of the counters
+	 * @param stats - output
+	 */
+	void getStats(MQTT5Stats *stats);
+
+	/***
+	 * Encode a variable byte integer
+	 * @param buf - output, up to 4 bytes
+	 * @param value
+	 * @return bytes used
+	 */
+	static uint8_t putVarint(uint8_t *buf, uint32_t value);
+
+private:
+	enum OutState { OutFixed, OutCollect, OutPass };
+	enum InState { InFixed, InCollect, InSkip, InPass };
+
+	/***
+	 * Write to the connection, counting bytes
+	 * @param buf
+	 * @param len
+	 * @return false on error
+	 */
+	bool write(const void *buf, size_t len);
+
+	/***
+	 * Fixed header of an outbound packet is complete
+	 * @return false on error
+	 */
+	bool outStart();
+
+	/***
+	 * Collected part of an outbound packet is complete
+	 * @return false on error
+	 */
+	bool outCollected();
+
+	/***
+	 * Write header and pass rest of packet, inserting an empty
+	 * property length after insertAt bytes
+	 * @param insertAt - bytes of variable header before the properties
+	 * @return false on error
+	 */
+	bool outInsert(uint32_t insertAt);
+
+	/***
+	 * Write a translated CONNECT from the collected 3.1.1 packet
+	 * @return false on error
+	 */
+	bool outConnect();
+
+	/***
+	 * Write a PUBLISH header using a topic alias
+	 * @return false on error
+	 */
+	bool outPublishAlias();
+
+	/***
+	 * Find or assign the alias for a topic
+	 * @param topic
+	 * @param len
+	 * @param known - output, true if the broker already has this alias
+	 * @return alias, 0 if none
+	 */
+	uint16_t aliasFor(const uint8_t *topic, uint16_t len, bool *known);
+
+	/***
+	 * Fixed header of an inbound packet is complete
+	 * @return false on error
+	 */
+	bool inStart();
+
+	/***
+	 * Collected part of an inbound packet is complete
+	 * @return false on error
+	 */
+	bool inCollected();
+
+	/***
+	 * Parse the properties of a CONNACK
+	 * @param buf - first byte of properties
+	 * @param len - length of properties
+	 */
+	void inConnackProps(const uint8_t *buf, uint32_t len);
+
+	/***
+	 * Decode a variable byte integer
+	 * @param buf
+	 * @param len - bytes available
+	 * @param value - output
+	 * @return bytes used, 0 if incomplete
+	 */
+	static uint8_t getVarint(const uint8_t *buf, uint32_t len, uint32_t *value);
+
+	MQTT5Write pWrite = NULL;
+	MQTT5Read pRead = NULL;
+	void *pCtx = NULL;
+
+	//Our limits
+	uint16_t xRecvMax = 10;
+	uint32_t xMaxPacket = 0;
+	uint32_t xSessionExpiry = 0;
+
+	//Broker limits
+	uint16_t xServerRecvMax = 65535;
+	uint32_t xServerMaxPacket = 0;
+	uint16_t xServerAliasMax = 0;
+	bool xRefused = false;
+
+	//Outbound
+	OutState xOutState = OutFixed;
+	uint8_t xOutHdr[5];
+	uint8_t xOutHdrLen = 0;
+	uint32_t xOutRl = 0;
+	uint32_t xOutNeed = 0;
+	uint32_t xOutHave = 0;
+	uint32_t xOutRemain = 0;
+	uint32_t xOutInsertAt = 0;
+	bool xOutInsert = false;
+	uint8_t xOutBuf[MQTT5_CONNECT_MAX];
+
+	//Outbound aliases
+	uint8_t xAliasTopic[MQTT5_ALIAS_MAX][MQTT5_ALIAS_TOPIC_MAX];
+	uint16_t xAliasLen[MQTT5_ALIAS_MAX];
+	uint8_t xAliasCount = 0;
+	uint8_t xAliasNext = 0;
+
+	//Inbound
+	InState xInState = InFixed;
+	uint8_t xInHdr[5];
+	uint8_t xInHdrLen = 0;
+	uint32_t xInRl = 0;
+	uint32_t xInNeed = 0;
+	uint32_t xInHave = 0;
+	uint32_t xInSkip = 0;
+	uint32_t xInRemain = 0;
+	bool xInMapCodes = false;
+	uint8_t xInBuf[MQTT5_IN_HDR_MAX];
+	uint8_t xInOut[MQTT5_IN_HDR_MAX + 8];
+	uint16_t xInOutLen = 0;
+	uint16_t xInOutPos = 0;
+
+	MQTT5Stats xStats;
+};
+
+#endif /* SRC_MQTT5CODEC_H_ */
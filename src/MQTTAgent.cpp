@@ -9,32 +9,92 @@
 
 #include "MQTTAgent.h"
 #include <stdlib.h>
+#include "pico/unique_id.h"
 
 /* MQTT Agent ports. */
 #include "freertos_agent_message.h"
 #include "freertos_command_pool.h"
 
+#if MQTT_PUB_WINDOW > MQTT_PUB_SLOTS
+#error "MQTT_PUB_WINDOW must not exceed MQTT_PUB_SLOTS"
+#endif
+
+#if MQTT_PUB_WINDOW > MQTT_AGENT_MAX_OUTSTANDING_ACKS
+#error "MQTT_PUB_WINDOW must not exceed MQTT_AGENT_MAX_OUTSTANDING_ACKS"
+#endif
+
 const char * MQTTAgent::WILLTOPICFORMAT = "TNG/%s/LC";
 const char * MQTTAgent::WILLPAYLOAD = "{'online':0}";
 const char * MQTTAgent::ONLINEPAYLOAD = "{'online':1}";
+const char * MQTTAgent::ONLINECBORPAYLOAD = "{'online':1,'content':'cbor'}";
 
 
 
 /***
  * Constructor
- * @param sockNum - Socket Number to use
+ * @param sockNum - Socket Number to use, if already in use another is
+ * taken from the EthHelper allocator
  * @param eth - Ethernet helper for communicating to hardware
  */
 MQTTAgent::MQTTAgent(uint8_t sockNum, EthHelper *eth) {
 	pEth = eth;
-	xTcpTrans.init(sockNum,eth);
+	if (eth->sockReserve(sockNum)){
+		xSock = sockNum;
+	} else {
+		//Do not share a socket another user holds
+		xSock = eth->sockAlloc();
+		if (xSock < 0){
+			LogError(("MQTTAgent socket %d in use and none free", sockNum));
+		} else {
+			LogError(("MQTTAgent socket %d in use, using %d", sockNum, xSock));
+		}
+	}
+	setup();
+}
+
+/***
+ * Constructor, socket is taken from the EthHelper allocator
+ * @param eth - Ethernet helper for communicating to hardware
+ */
+MQTTAgent::MQTTAgent(EthHelper *eth) {
+	pEth = eth;
+	xSock = eth->sockAlloc();
+	if (xSock < 0){
+		LogError(("MQTTAgent has no socket"));
+	}
+	setup();
+}
 
+/***
+ * Set up everything shared by the constructors, once xSock is chosen
+ */
+void MQTTAgent::setup(){
+	xTcpTrans.init((xSock < 0) ? 0 : xSock, pEth);
+	xEvents = xEventGroupCreateStatic(&xEventGroupBuffer);
+	xVecMutex = xSemaphoreCreateMutexStatic(&xVecMutexBuffer);
+	xVecDone = xSemaphoreCreateBinaryStatic(&xVecDoneBuffer);
+	xPubFree = xSemaphoreCreateCountingStatic(MQTT_PUB_SLOTS, MQTT_PUB_SLOTS, &xPubFreeBuffer);
+	xPubWindow = xSemaphoreCreateCountingStatic(MQTT_PUB_WINDOW, MQTT_PUB_WINDOW, &xPubWindowBuffer);
+	memset(xPubSlots, 0, sizeof(xPubSlots));
+	memset(&xPubStats, 0, sizeof(xPubStats));
+	xSubMutex = xSemaphoreCreateMutexStatic(&xSubMutexBuffer);
+	memset(&xSubStats, 0, sizeof(xSubStats));
+	memset(&xReconStats, 0, sizeof(xReconStats));
+	memset(&xConnStats, 0, sizeof(xConnStats));
+	xTcpTrans.setReuseHost(MQTT_FAST_RECONNECT);
+	xTcpTrans.setMqtt5(MQTT_PROTOCOL_V5);
+	xTcpTrans.getCodec()->configure(MQTT_RECEIVE_MAX, MQTT_AGENT_NETWORK_BUFFER_SIZE,
+			MQTT_SESSION_EXPIRY_S);
 }
 
 /***
  * Destructor
  */
 MQTTAgent::~MQTTAgent() {
+	if (xSock >= 0){
+		pEth->sockFree(xSock);
+	}
+
 	if (pWillTopic != NULL){
 		vPortFree(pWillTopic);
 		pWillTopic = NULL;
@@ -49,6 +109,11 @@ MQTTAgent::~MQTTAgent() {
 		vPortFree(pKeepAliveTopic);
 		pKeepAliveTopic = NULL;
 	}
+
+	if (pSubTable != NULL){
+		vPortFree(pSubTable);
+		pSubTable = NULL;
+	}
 }
 
 /***
@@ -65,21 +130,22 @@ MQTTStatus_t MQTTAgent::init(){
 	{
 		.pMsgCtx        = NULL,
 		.send           = Agent_MessageSend,
-		.recv           = Agent_MessageReceive,
+		.recv           = MQTTAgent::commandRecv,
 		.getCommand     = Agent_GetCommand,
 		.releaseCommand = Agent_ReleaseCommand
 	};
 
 	LogDebug( ( "Creating command queue." ) );
-	xCommandQueue.queue = xQueueCreateStatic( MQTT_AGENT_COMMAND_QUEUE_LENGTH,
+	xCommandQueue.pAgent = this;
+	xCommandQueue.xMsgCtx.queue = xQueueCreateStatic( MQTT_AGENT_COMMAND_QUEUE_LENGTH,
 											  sizeof( MQTTAgentCommand_t * ),
 											  xStaticQueueStorageArea,
 											  &xStaticQueueStructure );
-	if (xCommandQueue.queue == NULL) {
+	if (xCommandQueue.xMsgCtx.queue == NULL) {
 		LogDebug(("MQTTAgent::mqttInit ERROR Queue not initialised"));
 		return MQTTIllegalState;
 	}
-	messageInterface.pMsgCtx = &xCommandQueue;
+	messageInterface.pMsgCtx = &xCommandQueue.xMsgCtx;
 
 	/* Initialize the task pool. */
 	Agent_InitializePool();
@@ -106,6 +172,221 @@ MQTTStatus_t MQTTAgent::init(){
 
 }
 
+/***
+ * Receive next command for the agent, used in place of
+ * Agent_MessageReceive. In event driven mode waits until a command
+ * arrives or the socket interrupt posts a NULL command to run the
+ * process loop.
+ * @param pMsgCtx - queue context
+ * @param ppCommand - output command, NULL to run the process loop
+ * @param blockTimeMs - time to wait in polled mode
+ * @return true if something was received
+ */
+bool MQTTAgent::commandRecv( MQTTAgentMessageContext_t * pMsgCtx,
+		MQTTAgentCommand_t ** ppCommand,
+		uint32_t blockTimeMs ){
+	MQTTAgent *a = ((MQTTAgentQueueContext_t *)pMsgCtx)->pAgent;
+	bool res;
+
+	a->vecService(true);
+	a->offlineService();
+
+	//End of a pass, write out anything collected
+	if (uxQueueMessagesWaiting(pMsgCtx->queue) == 0){
+		a->xTcpTrans.transFlush();
+	}
+
+	if (!a->xEventDriven){
+		return Agent_MessageReceive(pMsgCtx, ppCommand, blockTimeMs);
+	}
+
+	if (a->xTcpTrans.isReady()){
+		blockTimeMs = 0;
+	} else {
+		blockTimeMs = MQTT_AGENT_EVENT_WAIT_MS;
+	}
+	res = Agent_MessageReceive(pMsgCtx, ppCommand, blockTimeMs);
+	if (res && (*ppCommand == NULL)){
+		a->xEventPosted = false;
+	}
+	return res;
+}
+
+/***
+ * Send any vectored publish waiting for the agent task
+ * @param online - false to fail the request
+ */
+void MQTTAgent::vecService(bool online){
+	bool run = false;
+
+	taskENTER_CRITICAL();
+	if (xVecState == VecQueued){
+		xVecState = VecBusy;
+		run = true;
+	}
+	taskEXIT_CRITICAL();
+
+	if (run){
+		xVecOk = online && sendPublishV(pVecTopic, pVecFrags, xVecCount);
+		xVecState = VecDone;
+		xSemaphoreGive(xVecDone);
+	}
+}
+
+/***
+ * Socket interrupt, called from interrupt context.
+ * Posts a NULL command to wake the agent.
+ * @param sock - socket id
+ * @param ctx - this agent
+ */
+void MQTTAgent::sockEventCb(uint8_t sock, void *ctx){
+	MQTTAgent *a = (MQTTAgent *)ctx;
+	MQTTAgentCommand_t *cmd = NULL;
+	BaseType_t woken = pdFALSE;
+
+	if (!a->xEventPosted){
+		if (xQueueSendFromISR(a->xCommandQueue.xMsgCtx.queue, &cmd, &woken) == pdTRUE){
+			a->xEventPosted = true;
+		}
+		portYIELD_FROM_ISR(woken);
+	}
+}
+
+/***
+ * Collect packets sent during one pass of the command loop and
+ * write them as one SEND. Sizes and delay are set by TCP_TX_BUF_SIZE
+ * and TCP_TX_MAX_DELAY_MS.
+ * @param enable
+ */
+void MQTTAgent::setWriteCombining(bool enable){
+	xWriteCombine = enable;
+}
+
+/***
+ * Connect without clean session so the broker keeps subscriptions and
+ * queued QoS1/2 messages across reconnects. When the broker reports
+ * the session is present the resubscribe is skipped. Must be set
+ * before connect.
+ * @param enable
+ */
+void MQTTAgent::setPersistentSession(bool enable){
+	xPersistent = enable;
+}
+
+/***
+ * Did the last connect resume a session held by the broker
+ * @return
+ */
+bool MQTTAgent::isSessionPresent(){
+	return xSessionPresent;
+}
+
+/***
+ * Reconnect to the last good broker address without resolving it
+ * again, falling back to a lookup if that fails
+ * @param enable
+ */
+void MQTTAgent::setFastReconnect(bool enable){
+	xTcpTrans.setReuseHost(enable);
+}
+
+/***
+ * Get the time to online counters
+ * @param stats - output
+ */
+void MQTTAgent::getConnStats(MQTTAgentConnStats *stats){
+	taskENTER_CRITICAL();
+	memcpy(stats, &xConnStats, sizeof(MQTTAgentConnStats));
+	taskEXIT_CRITICAL();
+}
+
+/***
+ * Speak MQTT 5 on the wire. Outbound publishes use topic aliases when
+ * the broker allows them. If the broker refuses version 5 the agent
+ * falls back to 3.1.1 for later connects. Must be set before connect.
+ * @param enable
+ */
+void MQTTAgent::setMqtt5(bool enable){
+	xTcpTrans.setMqtt5(enable);
+}
+
+/***
+ * Is the agent using MQTT 5
+ * @return
+ */
+bool MQTTAgent::isMqtt5(){
+	return xTcpTrans.isMqtt5();
+}
+
+/***
+ * Get the MQTT 5 counters, including bytes saved by topic aliases
+ * @param stats - output
+ */
+void MQTTAgent::getMqtt5Stats(MQTT5Stats *stats){
+	xTcpTrans.getCodec()->getStats(stats);
+}
+
+/***
+ * Compress publish payloads of MQTT_COMPRESS_MIN bytes or more. Payloads
+ * up to MQTT_COMPRESS_MAX_IN may then be published as long as they
+ * compress to fit MQTT_PUB_PAYLOAD_MAX. Compressed inbound payloads are
+ * always decompressed before routing, one that fails to decompress is
+ * routed as received.
+ * @param enable
+ */
+void MQTTAgent::setCompression(bool enable){
+	xCompressOn = enable;
+}
+
+/***
+ * Get the compression counters, ratio and time per byte
+ * @param stats - output
+ */
+void MQTTAgent::getCompressStats(MQTTCompressStats *stats){
+	xCompress.getStats(stats);
+}
+
+/***
+ * Set callback made as the agent goes Online. Lets twin state decide
+ * on reconnect whether it must resend anything. Runs in the agent task,
+ * see MQTTOnlineCallback for publishing from it.
+ * @param cb - callback or NULL
+ * @param ctx - context passed to callback
+ */
+void MQTTAgent::setOnlineCallback(MQTTOnlineCallback cb, void *ctx){
+	pOnlineCtx = ctx;
+	pOnlineCb = cb;
+}
+
+/***
+ * Set the encoding used for state payloads on this connection. It is
+ * advertised on the online lifecycle topic so the other end can
+ * decode state and send deltas to match. Must be set before connect.
+ * @param type - ContentJSON or ContentCBOR
+ */
+void MQTTAgent::setContentType(MQTTContentType type){
+	xContentType = type;
+}
+
+/***
+ * Encoding used for state payloads, CBOR uses CBOREncoder and
+ * CBORDecoder in place of json_maker and tiny_json
+ * @return
+ */
+MQTTContentType MQTTAgent::getContentType(){
+	return xContentType;
+}
+
+/***
+ * Use the W5x00 socket interrupt rather than polling the socket.
+ * The agent then sleeps until a command or socket event arrives.
+ * Must be set before connect.
+ * @param enable
+ */
+void MQTTAgent::setEventDriven(bool enable){
+	xEventDriven = enable;
+}
+
 /***
  * Callback on when new data is received
  * @param pMqttAgentContext
@@ -126,6 +407,20 @@ void MQTTAgent::incomingPublishCallback( MQTTAgentContext_t * pMqttAgentContext,
 			));
 
 	MQTTAgent *a = (MQTTAgent *)pMqttAgentContext->pIncomingCallbackContext;
+	a->xRxPublishes++;
+	if (MQTTCompress::isCompressed(pxPublishInfo->pPayload, pxPublishInfo->payloadLength)){
+		size_t len = a->xCompress.decompress(pxPublishInfo->pPayload,
+				pxPublishInfo->payloadLength, a->xInflate, MQTT_COMPRESS_MAX_IN);
+		if (len > 0){
+			a->route(pxPublishInfo->pTopicName,
+					pxPublishInfo->topicNameLength,
+					a->xInflate,
+					len);
+			return;
+		}
+		//Counted in inflateFails, pass it on as sent in case it was never
+		//compressed and only starts with the header bytes
+	}
 	a->route(pxPublishInfo->pTopicName,
 			pxPublishInfo->topicNameLength,
 			pxPublishInfo->pPayload,
@@ -163,6 +458,7 @@ void MQTTAgent::credentials(const char * user, const char * passwd, const char *
 		this->pId = this->pUser;
 	}
 	LogInfo(("MQTT Credentials Id=%s, usr=%s\n", this->pId, this->pUser));
+	xConnectInfoReady = false;
 
 	if (pWillTopic == NULL){
 		pWillTopic = (char *)pvPortMalloc( MQTTTopicHelper::lenLifeCycleTopic(this->pId, MQTT_TOPIC_LIFECYCLE_OFFLINE));
@@ -205,6 +501,7 @@ bool MQTTAgent::connect(const char * target, uint16_t  port, bool recon, bool ss
 	this->xSsl = ssl;
 	this->xRecon = recon;
 	setConnState(TCPReq);
+	xEventGroupSetBits(xEvents, MQTT_EVT_CONNECT);
 	LogDebug(("TCP Requested\n"));
 	return true;
 }
@@ -216,7 +513,12 @@ bool MQTTAgent::connect(const char * target, uint16_t  port, bool recon, bool ss
 *
 *  */
 void MQTTAgent::start(UBaseType_t priority){
+	if (xSock < 0){
+		LogError(("MQTTAgent not started, it has no socket"));
+		return;
+	}
 	if (init() == MQTTSuccess){
+		pEth->addLinkCallback(MQTTAgent::linkCb, this);
 		xTaskCreate(
 			MQTTAgent::vTask,
 			"MQTTAgent",
@@ -250,6 +552,8 @@ void MQTTAgent::start(UBaseType_t priority){
 
 		 switch(xConnState){
 		 case Offline: {
+			 // Nothing to do until connect is called
+			 waitEvents(MQTT_EVT_CONNECT, portMAX_DELAY);
 			 break;
 		 }
 		 case TCPReq: {
@@ -257,17 +561,29 @@ void MQTTAgent::start(UBaseType_t priority){
 				 TCPconn();
 			 } else {
 				 LogInfo(("Network offline, awaiting reconnect"));
-				 vTaskDelay(MQTT_RECON_DELAY);
+				 waitEvents(MQTT_EVT_LINK | MQTT_EVT_CLOSE, MQTT_LINK_WAIT_DELAY);
 			 }
 			 break;
 		 }
 		 case TCPConned: {
 			 LogDebug(("Attempting MQTT conn\n"));
 			 status = MQTTconn();
-			 if (status == MQTTSuccess){
+			 if ((status == MQTTSuccess) && xSessionPresent && (xSubRound > 0)){
+				 //Broker kept our subscriptions, only send any added since
+				 LogDebug(("MQTTconn ok, session resumed\n"));
+				 taskENTER_CRITICAL();
+				 xSubStats.resumes++;
+				 taskEXIT_CRITICAL();
+				 subFlush();
+				 setConnState(MQTTConned);
+			 } else if (status == MQTTSuccess){
 				 setConnState(MQTTReq);
 				 LogDebug(("MQTTconn ok\n"));
 			 } else {
+				 if (xTcpTrans.isMqtt5() && xTcpTrans.getCodec()->isRefused()){
+					 LogInfo(("Broker refused MQTT 5, using 3.1.1\n"));
+					 xTcpTrans.setMqtt5(false);
+				 }
 				 setConnState(Offline);
 				 LogDebug(("MQTTConn failed\n"));
 			 }
@@ -279,14 +595,52 @@ void MQTTAgent::start(UBaseType_t priority){
 			 break;
 		 }
 		 case MQTTConned: {
+			 xWindowDeficit = 0;
+			 if (xTcpTrans.isMqtt5()){
+				 //Hold back window tokens the broker's Receive Maximum does not
+				 //allow, those held by unacked publishes are deferred by pubResume
+				 uint16_t recvMax = xTcpTrans.getCodec()->getServerRecvMax();
+				 if (recvMax < MQTT_PUB_WINDOW){
+					 xWindowDeficit = MQTT_PUB_WINDOW - recvMax;
+				 }
+				 while ((xWindowHeld < xWindowDeficit) &&
+						 (xSemaphoreTake(xPubWindow, 0) == pdTRUE)){
+					 xWindowHeld++;
+				 }
+			 }
+			 pubResume();
+			 //Announce ahead of anything stored while offline, sent by
+			 //offlineService once a slot and window are free
+			 xAnnouncePending = true;
 			 setConnState(Online);
-			 pubToTopic(pOnlineTopic, ONLINEPAYLOAD, strlen(ONLINEPAYLOAD), 1);
 			 break;
 		 }
 		 case Online:{
 			 LogDebug(("Starting CMD loop\n"));
 
+			 xTcpTrans.setWriteCombining(xWriteCombine);
 			 status = MQTTAgent_CommandLoop( &xGlobalMqttAgentContext );
+			 xTcpTrans.setWriteCombining(false);
+			 vecService(false);
+			 xWindowDeficit = 0;
+			 xResendDeferred = 0;
+			 while (xWindowHeld > 0){
+				 xSemaphoreGive(xPubWindow);
+				 xWindowHeld--;
+			 }
+			 //Unless reconnecting complete anything still queued or awaiting
+			 //ack so the publish slots are returned to the pool. On reconnect
+			 //they are kept for pubResume to retransmit.
+			 if (!xRecon){
+				 MQTTAgent_CancelAll( &xGlobalMqttAgentContext );
+				 for (uint8_t i=0; i < MQTT_PUB_SLOTS; i++){
+					 //Deferred resends were never handed to the agent
+					 if (xPubSlots[i].xInUse && xPubSlots[i].xResend){
+						 xPubSlots[i].xResend = false;
+						 pubComplete(&xPubSlots[i], MQTTSendFailed);
+					 }
+				 }
+			 }
 
 			 // The function returns on either receiving a terminate command,
 			 // undergoing network disconnection OR encountering an error.
@@ -323,8 +677,10 @@ void MQTTAgent::start(UBaseType_t priority){
 			 if (pEth->isJoined()){
 				 xTcpTrans.transClose();
 			 }
-			 vTaskDelay(MQTT_RECON_DELAY);
-			 setConnState(TCPReq);
+			 waitEvents(MQTT_EVT_CLOSE, pdMS_TO_TICKS(backoffNext()));
+			 if (xConnState == MQTTRecon){
+				 setConnState(TCPReq);
+			 }
 			 break;
 		 }
 		 default:{
@@ -332,9 +688,6 @@ void MQTTAgent::start(UBaseType_t priority){
 		 }
 
 		 };
-
-		 taskYIELD();
-		 //vTaskDelay(1);
 	 }
 
 
@@ -355,148 +708,802 @@ const char * MQTTAgent::getId(){
 }
 
 /***
-* Publish message to topic
+* Publish message to topic. Topic and payload are copied into a slot
+* from a pool of MQTT_PUB_SLOTS so several tasks may publish at once.
 * @param topic - zero terminated string. Copied by function
-* @param payload - payload as pointer to memory block
-* @param payloadLen - length of memory block
+* @param payload - payload as pointer to memory block. Copied by function
+* @param payloadLen - length of memory block, up to MQTT_PUB_PAYLOAD_MAX
 */
 bool MQTTAgent::pubToTopic(const char * topic, const void * payload,
 	size_t payloadLen, const uint8_t QoS){
+	return publish(topic, payload, payloadLen, QoS, NULL);
+}
 
-	MQTTStatus_t status;
+/***
+ * Publish message to topic and report completion through a handle.
+ * Completion is when sent for QoS0, on PUBACK for QoS1 and on PUBCOMP for QoS2.
+ * @param topic - zero terminated string. Copied by function
+ * @param payload - payload as pointer to memory block. Copied by function
+ * @param payloadLen - length of memory block, up to MQTT_PUB_PAYLOAD_MAX
+ * While not online, while earlier offline publishes are still being
+ * sent, or when made from the agent task, a publish without a handle is
+ * stored in the offline queue.
+ * @param QoS - 0, 1 or 2
+ * @param handle - completion handle or NULL
+ * @param expiryMs - ms an offline publish is kept, 0 for never
+ * @return true if queued to the agent or the offline queue
+ */
+bool MQTTAgent::publish(const char * topic, const void * payload,
+	size_t payloadLen, const uint8_t QoS, MQTTPubHandle *handle,
+	uint32_t expiryMs){
 
-	xCommandInfo.cmdCompleteCallback = MQTTAgent::publishCmdCompleteCb;
-	xCommandInfo.blockTimeMs = 500;
+	size_t topicLen = strlen(topic);
 
-	// Fill the information for publish operation.
-	xPublishInfo.qos = MQTTQoS1;
-	xPublishInfo.pTopicName = topic;
-	xPublishInfo.topicNameLength = strlen( xPublishInfo.pTopicName );
-	xPublishInfo.pPayload = payload;
-	xPublishInfo.payloadLength = payloadLen;
+	if ((topicLen >= MQTT_PUB_TOPIC_MAX) || (payloadLen > pubPayloadMax())){
+		LogError(("publish too large %d:%d", topicLen, payloadLen));
+		return false;
+	}
+	if (QoS > 2){
+		LogError(("publish bad QoS %d", QoS));
+		return false;
+	}
 
-	LogDebug(("Publishing(%d, %d) %.*s:%.*s\n",
-			xPublishInfo.topicNameLength,
-			xPublishInfo.payloadLength,
-			xPublishInfo.topicNameLength,
-			xPublishInfo.pTopicName,
-			xPublishInfo.payloadLength,
-			xPublishInfo.pPayload
-			));
+	//Keep order behind anything stored while offline. The agent task,
+	//such as the online callback, queues as it must not wait on a slot.
+	if ((handle == NULL) && ((xConnState != Online) || xAnnouncePending ||
+			!xOffline.isEmpty() || (xTaskGetCurrentTaskHandle() == xHandle))){
+		return xOffline.push(topic, topicLen, payload, payloadLen, QoS, expiryMs,
+				to_ms_since_boot(get_absolute_time ()));
+	}
 
-	status = MQTTAgent_Publish( &xGlobalMqttAgentContext, &xPublishInfo, &xCommandInfo );
-	if (status != MQTTSuccess ){
-		LogError(("publish error %d", status));
+	return pubNow(topic, topicLen, payload, payloadLen, QoS, handle);
+}
+
+/***
+ * Publish through a slot straight away, bypassing the offline queue
+ * @param topic - zero terminated string
+ * @param topicLen
+ * @param payload
+ * @param payloadLen
+ * @param QoS
+ * @param handle - completion handle or NULL
+ * @return true if queued to the agent
+ */
+bool MQTTAgent::pubNow(const char * topic, size_t topicLen, const void * payload,
+		size_t payloadLen, uint8_t QoS, MQTTPubHandle *handle){
+
+	if (handle != NULL){
+		handle->state = PubPending;
+		handle->status = MQTTSuccess;
+		handle->latencyUs = 0;
+		handle->xDone = xSemaphoreCreateBinaryStatic(&handle->xDoneBuffer);
+	}
+
+	if ((topicLen >= MQTT_PUB_TOPIC_MAX) || (payloadLen > pubPayloadMax())){
+		LogError(("publish too large %d:%d", topicLen, payloadLen));
+		pubFail(handle, MQTTBadParameter);
 		return false;
 	}
 
-	if (pObserver != NULL){
-		pObserver->MQTTSend();
+	if (xTcpTrans.isMqtt5()){
+		//Worst case MQTT 5 packet, the broker disconnects if it is over its limit
+		uint32_t maxPacket = xTcpTrans.getCodec()->getServerMaxPacket();
+		if ((maxPacket > 0) && ((topicLen + payloadLen + 13) > maxPacket)){
+			LogError(("publish over broker max packet %d", maxPacket));
+			pubFail(handle, MQTTBadParameter);
+			return false;
+		}
 	}
 
-	return true;
+	//The agent task frees slots and window so must not wait on them
+	bool wait = (xTaskGetCurrentTaskHandle() != xHandle);
+
+	if ((QoS > 0) && !pubWindowTake(wait)){
+		LogError(("publish window full"));
+		pubFail(handle, MQTTNoMemory);
+		return false;
+	}
+
+	MQTTPubSlot_t *slot = pubSlotClaim(wait);
+	if (slot == NULL){
+		LogError(("publish no slot free"));
+		if (QoS > 0){
+			pubWindowGive();
+		}
+		pubFail(handle, MQTTNoMemory);
+		return false;
+	}
+
+	if (!pubFill(slot, payload, &payloadLen)){
+		LogError(("publish does not compress to fit %d", payloadLen));
+		pubSlotRelease(slot);
+		if (QoS > 0){
+			pubWindowGive();
+		}
+		pubFail(handle, MQTTBadParameter);
+		return false;
+	}
+	memcpy(slot->xTopic, topic, topicLen + 1);
+	slot->pHandle = handle;
+
+	return pubDispatch(slot, topicLen, payloadLen, QoS, wait ? 500 : 0);
 }
 
 /***
-* Close connection
-*/
-void MQTTAgent::close(){
-	xTcpTrans.transClose();
-	xRecon=false;
-	setConnState(Offline);
+ * Mark a handle failed for a publish that was never queued and wake any
+ * pubWait. The callback is not made, the caller already has false.
+ * @param handle - completion handle or NULL
+ * @param status - reason
+ */
+void MQTTAgent::pubFail(MQTTPubHandle *handle, MQTTStatus_t status){
+	if (handle != NULL){
+		handle->status = status;
+		handle->state = PubFailed;
+		xSemaphoreGive(handle->xDone);
+	}
 }
 
 /***
-* Route a message to the router object
-* @param topic - non zero terminated string
-* @param topicLen - topic length
-* @param payload - raw memory
-* @param payloadLen - payload length
-*/
-void MQTTAgent::route(const char * topic, size_t topicLen, const void * payload, size_t payloadLen){
-	if (pRouter != NULL){
-		pRouter->route(topic, topicLen, payload, payloadLen, this);
+ * Copy payload into a slot, compressed if enabled and it shrinks
+ * @param slot
+ * @param payload
+ * @param payloadLen - in length, out length held in the slot
+ * @return false if it does not fit the slot
+ */
+bool MQTTAgent::pubFill(MQTTPubSlot_t *slot, const void * payload, size_t *payloadLen){
+	if (xCompressOn && (*payloadLen >= MQTT_COMPRESS_MIN)){
+		size_t len = xCompress.compress(payload, *payloadLen, slot->xPayload, MQTT_PUB_PAYLOAD_MAX);
+		if (len > 0){
+			*payloadLen = len;
+			return true;
+		}
 	}
-	if (pObserver != NULL){
-		pObserver->MQTTRecv();
+	if (*payloadLen > MQTT_PUB_PAYLOAD_MAX){
+		return false;
 	}
+	memcpy(slot->xPayload, payload, *payloadLen);
+	return true;
 }
 
-
 /***
-* Call back function on connect
-* @param pCmdCallbackContext
-* @param pReturnInfo
-*/
-void MQTTAgent::connectCmdCallback( MQTTAgentCommandContext_t * pCmdCallbackContext,
-                         MQTTAgentReturnInfo_t * pReturnInfo ){
-	LogDebug(("ConnectCmdCallback called\n"));
+ * Largest payload that may be published
+ * @return
+ */
+size_t MQTTAgent::pubPayloadMax(){
+	return xCompressOn ? MQTT_COMPRESS_MAX_IN : MQTT_PUB_PAYLOAD_MAX;
 }
 
-
 /***
-* Connect to MQTT server
-* @return
-*/
-MQTTStatus_t  MQTTAgent::MQTTconn(){
-	MQTTStatus_t xResult;
-	MQTTConnectInfo_t xConnectInfo;
-	bool xSessionPresent = false;
+ * Queue a filled publish slot to the agent
+ * @param slot - slot with topic and payload copied in
+ * @param topicLen
+ * @param payloadLen
+ * @param QoS
+ * @param blockMs - max ms to wait for room in the command queue
+ * @return true if queued, slot and window are released if not
+ */
+bool MQTTAgent::pubDispatch(MQTTPubSlot_t *slot, size_t topicLen, size_t payloadLen,
+		uint8_t QoS, uint32_t blockMs){
+	MQTTStatus_t status;
+	MQTTPubHandle *handle = slot->pHandle;
 
-	/* Many fields not used in this demo so start with everything at 0. */
-	( void ) memset( ( void * ) &xConnectInfo, 0x00, sizeof( xConnectInfo ) );
+	slot->xCommandInfo.cmdCompleteCallback = MQTTAgent::publishCmdCompleteCb;
+	slot->xCommandInfo.pCmdCompleteCallbackContext = (MQTTAgentCommandContext_t *)slot;
+	slot->xCommandInfo.blockTimeMs = blockMs;
 
-	/* Start with a clean session i.e. direct the MQTT broker to discard any
-	 * previous session data. Also, establishing a connection with clean
-	 * session will ensure that the broker does not store any data when this
-	 * client gets disconnected. */
-	xConnectInfo.cleanSession = true;
+	// Fill the information for publish operation.
+	memset(&slot->xPublishInfo, 0, sizeof(MQTTPublishInfo_t));
+	slot->xPublishInfo.qos = (MQTTQoS_t)QoS;
+	slot->xPublishInfo.pTopicName = slot->xTopic;
+	slot->xPublishInfo.topicNameLength = topicLen;
+	slot->xPublishInfo.pPayload = slot->xPayload;
+	slot->xPublishInfo.payloadLength = payloadLen;
 
-	/* The client identifier is used to uniquely identify this MQTT client to
-	 * the MQTT broker. In a production device the identifier can be something
-	 * unique, such as a device serial number. */
-	xConnectInfo.pClientIdentifier = pId;
-	xConnectInfo.clientIdentifierLength = ( uint16_t ) strlen(pId);
-	xConnectInfo.pUserName = pUser;
-	xConnectInfo.userNameLength = ( uint16_t ) strlen(pUser);
-	xConnectInfo.pPassword = pPasswd;
-	xConnectInfo.passwordLength= ( uint16_t ) strlen(pPasswd);
+	LogDebug(("Publishing(%d, %d) %.*s:%.*s\n",
+			slot->xPublishInfo.topicNameLength,
+			slot->xPublishInfo.payloadLength,
+			slot->xPublishInfo.topicNameLength,
+			slot->xPublishInfo.pTopicName,
+			slot->xPublishInfo.payloadLength,
+			slot->xPublishInfo.pPayload
+			));
 
-	xWillInfo.qos = MQTTQoS1;
-	sprintf(pWillTopic, MQTTAgent::WILLTOPICFORMAT, pId);
-	xWillInfo.pTopicName = pWillTopic;
-	xWillInfo.topicNameLength = strlen( xWillInfo.pTopicName );
-	xWillInfo.pPayload = MQTTAgent::WILLPAYLOAD;
-	xWillInfo.payloadLength = strlen( MQTTAgent::WILLPAYLOAD );
+	slot->xQueuedUs = time_us_32();
+	status = MQTTAgent_Publish( &xGlobalMqttAgentContext, &slot->xPublishInfo, &slot->xCommandInfo );
+	if (status != MQTTSuccess ){
+		LogError(("publish error %d", status));
+		pubSlotRelease(slot);
+		if (QoS > 0){
+			pubWindowGive();
+		}
+		pubFail(handle, status);
+		return false;
+	}
 
+	taskENTER_CRITICAL();
+	xPubStats.published++;
+	taskEXIT_CRITICAL();
 
-	/* Set MQTT keep-alive period. It is the responsibility of the application
-	 * to ensure that the interval between Control Packets being sent does not
-	 * exceed the Keep Alive value.  In the absence of sending any other
-	 * Control Packets, the Client MUST send a PINGREQ Packet. */
-	xConnectInfo.keepAliveSeconds = MQTTKEEPALIVETIME;
+	if (pObserver != NULL){
+		pObserver->MQTTSend();
+	}
 
-	/* Send MQTT CONNECT packet to broker. LWT is not used in this demo, so it
-	 * is passed as NULL. */
-	LogDebug(("MQTT Connect \n"));
-	xResult = MQTT_Connect( &(xGlobalMqttAgentContext.mqttContext),
-							&xConnectInfo,
-							&xWillInfo,
-							30000U,
-							&xSessionPresent );
+	return true;
+}
 
-	if (xResult != MQTTSuccess){
-		LogError(("MQTTConnect error %d", xResult));
+/***
+ * Send publishes from the offline queue while slots and window allow,
+ * called by the agent task on each pass of the command loop
+ */
+void MQTTAgent::offlineService(){
+	MQTTOfflineRec_t rec;
+	uint32_t now;
+
+	if ((xConnState != Online) ||
+			(!xAnnouncePending && !xOfflineDraining && xOffline.isEmpty())){
+		return;
 	}
-	return xResult ;
-}
 
+	if (xAnnouncePending){
+		if (!pubAnnounce()){
+			return;
+		}
+		xAnnouncePending = false;
+	}
 
+	for (uint8_t i=0; i < MQTT_PUB_SLOTS; i++){
+		now = to_ms_since_boot(get_absolute_time ());
+		MQTTPubSlot_t *slot = pubSlotClaim(false);
+		if (slot == NULL){
+			return;
+		}
+		//Compressed into the slot after peek, so read the original first
+		uint8_t *payload = xCompressOn ? xInflate : slot->xPayload;
+		size_t payloadMax = xCompressOn ? MQTT_COMPRESS_MAX_IN : MQTT_PUB_PAYLOAD_MAX;
+		if (!xOffline.peek(&rec, slot->xTopic, MQTT_PUB_TOPIC_MAX,
+				payload, payloadMax, now)){
+			pubSlotRelease(slot);
+			if (xOfflineDraining){
+				xOffline.recordDrain(xOfflineDrainCount, now - xOfflineDrainStart);
+				xOfflineDraining = false;
+			}
+			return;
+		}
+		if (!xOfflineDraining){
+			xOfflineDraining = true;
+			xOfflineDrainStart = now;
+			xOfflineDrainCount = 0;
+		}
+		size_t payloadLen = rec.payloadLen;
+		if (xCompressOn && !pubFill(slot, xInflate, &payloadLen)){
+			LogError(("Offline publish does not compress to fit %d", payloadLen));
+			pubSlotRelease(slot);
+			xOffline.pop();
+			continue;
+		}
+		if ((rec.qos > 0) && !pubWindowTake(false)){
+			pubSlotRelease(slot);
+			xOffline.unpeek();
+			return;
+		}
+		slot->pHandle = NULL;
+		//Agent task is the reader of the command queue so must not block on it
+		if (!pubDispatch(slot, rec.topicLen, payloadLen, rec.qos, 0)){
+			xOffline.unpeek();
+			return;
+		}
+		xOffline.pop();
+		xOfflineDrainCount++;
+	}
+}
 
 /***
-* Get the router object handling all received messages
-* @return
-*/
+ * Publish the online lifecycle message without blocking, for the agent
+ * task as it comes Online
+ * @return false to retry as no slot or window is free or the command queue is full
+ */
+bool MQTTAgent::pubAnnounce(){
+	const char *online = (xContentType == ContentCBOR) ? ONLINECBORPAYLOAD : ONLINEPAYLOAD;
+	size_t payloadLen = strlen(online);
+
+	if ((pOnlineTopic == NULL) || (strlen(pOnlineTopic) >= MQTT_PUB_TOPIC_MAX)){
+		//Nothing that could be sent, do not retry
+		LogError(("No online topic to announce on"));
+		return true;
+	}
+	size_t topicLen = strlen(pOnlineTopic);
+
+	MQTTPubSlot_t *slot = pubSlotClaim(false);
+	if (slot == NULL){
+		return false;
+	}
+	if (!pubWindowTake(false)){
+		pubSlotRelease(slot);
+		return false;
+	}
+	memcpy(slot->xTopic, pOnlineTopic, topicLen + 1);
+	memcpy(slot->xPayload, online, payloadLen);
+	slot->pHandle = NULL;
+	return pubDispatch(slot, topicLen, payloadLen, 1, 0);
+}
+
+/***
+ * Get the offline store and forward queue, to set its spill store
+ * and drop policy or read its counters
+ * @return
+ */
+MQTTOfflineQueue *MQTTAgent::getOfflineQueue(){
+	return &xOffline;
+}
+
+/***
+ * Claim a free publish slot. The free count is a counting semaphore,
+ * the index is then taken in a short critical section as the M0+ has
+ * no compare and swap.
+ * @param wait - wait up to MQTT_PUB_SLOT_WAIT_MS for one
+ * @return slot or NULL if none free
+ */
+MQTTPubSlot_t *MQTTAgent::pubSlotClaim(bool wait){
+	MQTTPubSlot_t *slot = NULL;
+
+	if (xSemaphoreTake(xPubFree, 0) != pdTRUE){
+		if (!wait){
+			return NULL;
+		}
+		taskENTER_CRITICAL();
+		xPubStats.slotWaits++;
+		taskEXIT_CRITICAL();
+		if (xSemaphoreTake(xPubFree, pdMS_TO_TICKS(MQTT_PUB_SLOT_WAIT_MS)) != pdTRUE){
+			taskENTER_CRITICAL();
+			xPubStats.slotFails++;
+			taskEXIT_CRITICAL();
+			return NULL;
+		}
+	}
+
+	taskENTER_CRITICAL();
+	for (uint8_t i=0; i < MQTT_PUB_SLOTS; i++){
+		uint8_t n = (xPubNext + i) % MQTT_PUB_SLOTS;
+		if (!xPubSlots[n].xInUse){
+			slot = &xPubSlots[n];
+			slot->xInUse = true;
+			slot->pAgent = this;
+			slot->xResend = false;
+			xPubNext = (n + 1) % MQTT_PUB_SLOTS;
+			xPubInUse++;
+			if (xPubInUse > xPubStats.maxInUse){
+				xPubStats.maxInUse = xPubInUse;
+			}
+			break;
+		}
+	}
+	taskEXIT_CRITICAL();
+	return slot;
+}
+
+/***
+ * Return a publish slot to the pool
+ * @param slot
+ */
+void MQTTAgent::pubSlotRelease(MQTTPubSlot_t *slot){
+	taskENTER_CRITICAL();
+	slot->xInUse = false;
+	xPubInUse--;
+	taskEXIT_CRITICAL();
+	xSemaphoreGive(xPubFree);
+}
+
+/***
+ * Take room in the in-flight window for a QoS1/2 publish
+ * @param wait - wait up to MQTT_PUB_SLOT_WAIT_MS for room
+ * @return false if the window is full
+ */
+bool MQTTAgent::pubWindowTake(bool wait){
+	if (xSemaphoreTake(xPubWindow, 0) != pdTRUE){
+		if (!wait){
+			return false;
+		}
+		taskENTER_CRITICAL();
+		xPubStats.windowWaits++;
+		taskEXIT_CRITICAL();
+		if (xSemaphoreTake(xPubWindow, pdMS_TO_TICKS(MQTT_PUB_SLOT_WAIT_MS)) != pdTRUE){
+			taskENTER_CRITICAL();
+			xPubStats.slotFails++;
+			taskEXIT_CRITICAL();
+			return false;
+		}
+	}
+	taskENTER_CRITICAL();
+	xPubStats.windowInUse++;
+	if (xPubStats.windowInUse > xPubStats.maxWindow){
+		xPubStats.maxWindow = xPubStats.windowInUse;
+	}
+	taskEXIT_CRITICAL();
+	return true;
+}
+
+/***
+ * Return room in the in-flight window
+ */
+void MQTTAgent::pubWindowGive(){
+	taskENTER_CRITICAL();
+	xPubStats.windowInUse--;
+	taskEXIT_CRITICAL();
+	xSemaphoreGive(xPubWindow);
+}
+
+/***
+ * Resume the session after a reconnect. Unacked QoS1/2 publishes are
+ * retransmitted, by the agent if the broker kept the session or from the
+ * publish slots if it did not. Slot resends over the broker's Receive
+ * Maximum are deferred until acks come in.
+ */
+void MQTTAgent::pubResume(){
+	MQTTStatus_t status;
+
+	//Without a session the agent fails the pending acks, the completion
+	//callback marks those publishes for resending instead
+	xPubResuming = true;
+	status = MQTTAgent_ResumeSession(&xGlobalMqttAgentContext, xSessionPresent);
+	xPubResuming = false;
+	if (status != MQTTSuccess){
+		LogError(("Resume session error %d", status));
+	}
+
+	//Resends beyond the broker's Receive Maximum wait for acks, each
+	//deferred slot keeps its window token so counts against the deficit
+	uint8_t resends = 0;
+	for (uint8_t i=0; i < MQTT_PUB_SLOTS; i++){
+		if (xPubSlots[i].xInUse && xPubSlots[i].xResend){
+			resends++;
+		}
+	}
+	uint8_t defer = (xWindowDeficit > xWindowHeld) ? (xWindowDeficit - xWindowHeld) : 0;
+	if (defer > resends){
+		defer = resends;
+	}
+	xResendDeferred = defer;
+
+	for (uint8_t i=0; (i < MQTT_PUB_SLOTS) && (resends > defer); i++){
+		MQTTPubSlot_t *slot = &xPubSlots[i];
+		if (!slot->xInUse || !slot->xResend){
+			continue;
+		}
+		resends--;
+		pubResendSlot(slot);
+	}
+}
+
+/***
+ * Retransmit a publish slot kept over a reconnect
+ * @param slot
+ */
+void MQTTAgent::pubResendSlot(MQTTPubSlot_t *slot){
+	MQTTStatus_t status;
+
+	slot->xResend = false;
+	slot->xPublishInfo.dup = true;
+	slot->xCommandInfo.blockTimeMs = 0;
+	status = MQTTAgent_Publish( &xGlobalMqttAgentContext, &slot->xPublishInfo, &slot->xCommandInfo );
+	if (status == MQTTSuccess){
+		xPubStats.resent++;
+	} else {
+		LogError(("Resend error %d", status));
+		pubComplete(slot, status);
+	}
+}
+
+/***
+ * Return the window token of a completed QoS1/2 publish. A deferred
+ * resend takes its place in flight, and while the broker's Receive
+ * Maximum is not yet honoured the token is held back rather than freed.
+ */
+void MQTTAgent::pubWindowReturn(){
+	if (xResendDeferred > 0){
+		for (uint8_t i=0; i < MQTT_PUB_SLOTS; i++){
+			if (xPubSlots[i].xInUse && xPubSlots[i].xResend){
+				xResendDeferred--;
+				pubResendSlot(&xPubSlots[i]);
+				break;
+			}
+		}
+	}
+	if ((xWindowHeld + xResendDeferred) < xWindowDeficit){
+		taskENTER_CRITICAL();
+		xPubStats.windowInUse--;
+		taskEXIT_CRITICAL();
+		xWindowHeld++;
+		return;
+	}
+	pubWindowGive();
+}
+
+/***
+ * Wait for a publish to complete
+ * @param handle - handle given to publish
+ * @param timeoutMs - max ms to wait
+ * @return true if publish completed successfully
+ */
+bool MQTTAgent::pubWait(MQTTPubHandle *handle, uint32_t timeoutMs){
+	if (handle->state == PubPending){
+		xSemaphoreTake(handle->xDone, pdMS_TO_TICKS(timeoutMs));
+	}
+	return (handle->state == PubDone);
+}
+
+/***
+ * Get the publish slot counters
+ * @param stats - output
+ */
+void MQTTAgent::getPubStats(MQTTAgentPubStats *stats){
+	taskENTER_CRITICAL();
+	memcpy(stats, &xPubStats, sizeof(MQTTAgentPubStats));
+	taskEXIT_CRITICAL();
+}
+
+/***
+ * Publish message made up of several payload fragments. Header, topic
+ * and fragments are written straight into the socket TX memory and
+ * sent as one packet, so no copy of the payload is assembled.
+ * Blocks until sent, fragments must remain valid until return.
+ * Only QoS 0 is supported as coreMQTT does not track the packet.
+ * @param topic - zero terminated string
+ * @param frags - payload fragments
+ * @param count - number of fragments, at most TCP_MAX_FRAGS - 2
+ * @param QoS - must be 0
+ * @return true if sent
+ */
+bool MQTTAgent::pubToTopicV(const char * topic, const EthFragment *frags,
+		uint8_t count, const uint8_t QoS){
+	MQTTAgentCommand_t *cmd = NULL;
+	bool res = false;
+
+	if (QoS != 0){
+		LogError(("pubToTopicV only supports QoS 0"));
+		return false;
+	}
+	if (count > (TCP_MAX_FRAGS - 2)){
+		LogError(("pubToTopicV too many fragments %d", count));
+		return false;
+	}
+	if (xConnState != Online){
+		return false;
+	}
+
+	//Agent task can write directly, nothing else is mid packet
+	if (xTaskGetCurrentTaskHandle() == xHandle){
+		return sendPublishV(topic, frags, count);
+	}
+
+	if (xSemaphoreTake(xVecMutex, pdMS_TO_TICKS(MQTT_AGENT_VEC_WAIT_MS)) != pdTRUE){
+		LogError(("pubToTopicV busy"));
+		return false;
+	}
+
+	pVecTopic = topic;
+	pVecFrags = frags;
+	xVecCount = count;
+	xVecOk = false;
+	xVecState = VecQueued;
+
+	//Wake the agent with a NULL command
+	xQueueSend(xCommandQueue.xMsgCtx.queue, &cmd, 0);
+
+	if (xSemaphoreTake(xVecDone, pdMS_TO_TICKS(MQTT_AGENT_VEC_WAIT_MS)) != pdTRUE){
+		bool wait = false;
+		taskENTER_CRITICAL();
+		if (xVecState == VecQueued){
+			xVecState = VecIdle;
+		} else {
+			wait = true;
+		}
+		taskEXIT_CRITICAL();
+		if (wait){
+			//Agent has the fragments, must not return until it is done
+			xSemaphoreTake(xVecDone, portMAX_DELAY);
+		} else {
+			LogError(("pubToTopicV timeout"));
+		}
+	}
+
+	if (xVecState == VecDone){
+		res = xVecOk;
+	}
+	xVecState = VecIdle;
+	xSemaphoreGive(xVecMutex);
+	return res;
+}
+
+/***
+ * Build and send a QoS 0 publish from fragments, agent task only
+ * @param topic - zero terminated string
+ * @param frags - payload fragments
+ * @param count - number of fragments
+ * @return true if sent
+ */
+bool MQTTAgent::sendPublishV(const char * topic, const EthFragment *frags, uint8_t count){
+	EthFragment all[TCP_MAX_FRAGS];
+	uint8_t hdr[7];
+	uint8_t hdrLen = 0;
+	size_t topicLen = strlen(topic);
+	size_t remaining = 2 + topicLen;
+	size_t total;
+
+	for (uint8_t i=0; i < count; i++){
+		remaining += frags[i].length;
+	}
+	if (remaining > 268435455){
+		return false;
+	}
+
+	//Fixed header, PUBLISH QoS 0 and variable length remaining length
+	hdr[hdrLen++] = 0x30;
+	do {
+		uint8_t b = remaining % 128;
+		remaining = remaining / 128;
+		if (remaining > 0){
+			b |= 0x80;
+		}
+		hdr[hdrLen++] = b;
+	} while (remaining > 0);
+	//Topic length starts the variable header
+	hdr[hdrLen++] = topicLen >> 8;
+	hdr[hdrLen++] = topicLen & 0xFF;
+
+	all[0].pBuffer = hdr;
+	all[0].length = hdrLen;
+	all[1].pBuffer = topic;
+	all[1].length = topicLen;
+	total = hdrLen + topicLen;
+	for (uint8_t i=0; i < count; i++){
+		all[2 + i] = frags[i];
+		total += frags[i].length;
+	}
+
+	LogDebug(("PublishingV(%d, %d frags) %s\n", topicLen, count, topic));
+
+	if (xTcpTrans.transSendv(all, count + 2) != (int32_t)total){
+		LogError(("publishV error"));
+		return false;
+	}
+
+	if (pObserver != NULL){
+		pObserver->MQTTSend();
+	}
+	return true;
+}
+
+/***
+* Close connection
+*/
+void MQTTAgent::close(){
+	xRecon=false;
+	xTcpTrans.transClose();
+	setConnState(Offline);
+	xEventGroupSetBits(xEvents, MQTT_EVT_CLOSE);
+}
+
+/***
+ * Network joined or lost, called from EthHelper task
+ * @param joined
+ * @param ctx - this agent
+ */
+void MQTTAgent::linkCb(bool joined, void *ctx){
+	MQTTAgent *a = (MQTTAgent *)ctx;
+	xEventGroupSetBits(a->xEvents, MQTT_EVT_LINK);
+}
+
+/***
+ * Sleep until one of the events is posted
+ * @param events - event bits to wait for
+ * @param ticks - max time to wait
+ * @return events that were set
+ */
+EventBits_t MQTTAgent::waitEvents(EventBits_t events, TickType_t ticks){
+	return xEventGroupWaitBits(xEvents, events, pdTRUE, pdFALSE, ticks) & events;
+}
+
+/***
+* Route a message to the router object
+* @param topic - non zero terminated string
+* @param topicLen - topic length
+* @param payload - raw memory
+* @param payloadLen - payload length
+*/
+void MQTTAgent::route(const char * topic, size_t topicLen, const void * payload, size_t payloadLen){
+	if (pRouter != NULL){
+		pRouter->route(topic, topicLen, payload, payloadLen, this);
+	}
+	if (pObserver != NULL){
+		pObserver->MQTTRecv();
+	}
+}
+
+
+/***
+* Call back function on connect
+* @param pCmdCallbackContext
+* @param pReturnInfo
+*/
+void MQTTAgent::connectCmdCallback( MQTTAgentCommandContext_t * pCmdCallbackContext,
+                         MQTTAgentReturnInfo_t * pReturnInfo ){
+	LogDebug(("ConnectCmdCallback called\n"));
+}
+
+
+/***
+* Connect to MQTT server
+* @return
+*/
+MQTTStatus_t  MQTTAgent::MQTTconn(){
+	MQTTStatus_t xResult;
+
+	if (!xConnectInfoReady){
+		connInfoPrepare();
+	}
+
+	/* Start with a clean session i.e. direct the MQTT broker to discard any
+	 * previous session data, unless a persistent session has been asked for.
+	 * Then the broker keeps subscriptions and queued messages while we are
+	 * disconnected and reports session present on reconnect. */
+	xConnectInfo.cleanSession = !xPersistent;
+
+	/* Send MQTT CONNECT packet to broker. LWT is not used in this demo, so it
+	 * is passed as NULL. */
+	LogDebug(("MQTT Connect \n"));
+	xResult = MQTT_Connect( &(xGlobalMqttAgentContext.mqttContext),
+							&xConnectInfo,
+							&xWillInfo,
+							30000U,
+							&xSessionPresent );
+
+	if (xResult != MQTTSuccess){
+		LogError(("MQTTConnect error %d", xResult));
+	} else {
+		xConnectMs = to_ms_since_boot(get_absolute_time ());
+	}
+	return xResult ;
+}
+
+
+
+/***
+ * Build the connect and will info used by every connect
+ */
+void MQTTAgent::connInfoPrepare(){
+	/* Many fields not used in this demo so start with everything at 0. */
+	( void ) memset( ( void * ) &xConnectInfo, 0x00, sizeof( xConnectInfo ) );
+
+	/* The client identifier is used to uniquely identify this MQTT client to
+	 * the MQTT broker. In a production device the identifier can be something
+	 * unique, such as a device serial number. */
+	xConnectInfo.pClientIdentifier = pId;
+	xConnectInfo.clientIdentifierLength = ( uint16_t ) strlen(pId);
+	xConnectInfo.pUserName = pUser;
+	xConnectInfo.userNameLength = ( uint16_t ) strlen(pUser);
+	xConnectInfo.pPassword = pPasswd;
+	xConnectInfo.passwordLength= ( uint16_t ) strlen(pPasswd);
+
+	/* Set MQTT keep-alive period. It is the responsibility of the application
+	 * to ensure that the interval between Control Packets being sent does not
+	 * exceed the Keep Alive value.  In the absence of sending any other
+	 * Control Packets, the Client MUST send a PINGREQ Packet. */
+	xConnectInfo.keepAliveSeconds = MQTTKEEPALIVETIME;
+
+	xWillInfo.qos = MQTTQoS1;
+	sprintf(pWillTopic, MQTTAgent::WILLTOPICFORMAT, pId);
+	xWillInfo.pTopicName = pWillTopic;
+	xWillInfo.topicNameLength = strlen( xWillInfo.pTopicName );
+	xWillInfo.pPayload = MQTTAgent::WILLPAYLOAD;
+	xWillInfo.payloadLength = strlen( MQTTAgent::WILLPAYLOAD );
+
+	xConnectInfoReady = true;
+}
+
+/***
+* Get the router object handling all received messages
+* @return
+*/
 MQTTRouter* MQTTAgent::getRouter()  {
 	return pRouter;
 }
@@ -510,17 +1517,29 @@ void MQTTAgent::setRouter( MQTTRouter *pRouter) {
 }
 
 /***
- * Subscribe to routers list
+ * Subscribe to routers list. The router's filters are collected into the
+ * subscription table and the whole table is sent in as few SUBSCRIBE
+ * packets as fit the network buffer.
  * @return true if succeeds
  */
 bool MQTTAgent::MQTTsub(){
 
+	xSemaphoreTake(xSubMutex, portMAX_DELAY);
+	for (uint16_t i=0; i < xSubCount; i++){
+		pSubTable[i].xSent = false;
+	}
+	taskENTER_CRITICAL();
+	xSubOutstanding = 0;
+	xSubRound++;
+	taskEXIT_CRITICAL();
+	xSemaphoreGive(xSubMutex);
+
 	if (pRouter != NULL){
-		xCurrentSub = 0;
+		xSubBatching = true;
 		pRouter->subscribe(this);
-		return true;
+		xSubBatching = false;
 	}
-	return false;
+	return subFlush();
 }
 
 /***
@@ -530,78 +1549,290 @@ bool MQTTAgent::MQTTsub(){
  */
 void MQTTAgent::subscribeCmdCompleteCb( MQTTAgentCommandContext_t * pCmdCallbackContext,
 	                             MQTTAgentReturnInfo_t * pReturnInfo ){
-	LogDebug(("Subscription complete\n"));
-}
+	MQTTSubBatch_t *batch = (MQTTSubBatch_t *)pCmdCallbackContext;
+	MQTTAgent *a = batch->pAgent;
+	uint32_t fails = 0;
+
+	if (pReturnInfo->returnCode == MQTTSuccess){
+		for (size_t i=0; i < batch->xArgs.numSubscriptions; i++){
+			if ((pReturnInfo->pSubackCodes != NULL) &&
+					(pReturnInfo->pSubackCodes[i] == MQTTSubAckFailure)){
+				LogError(("Subscription refused %.*s",
+						batch->xInfo[i].topicFilterLength,
+						batch->xInfo[i].pTopicFilter));
+				fails++;
+			}
+		}
+	} else {
+		fails = batch->xArgs.numSubscriptions;
+	}
+	LogDebug(("Subscription complete %d filters %d\n",
+			pReturnInfo->returnCode, batch->xArgs.numSubscriptions));
 
-/***
-* Call back function when Publish completes
-* @param pCmdCallbackContext
-* @param pReturnInfo
-*/
-void MQTTAgent::publishCmdCompleteCb( MQTTAgentCommandContext_t * pCmdCallbackContext,
-            MQTTAgentReturnInfo_t * pReturnInfo ){
-	LogDebug(("Publish complete\n"));
+	taskENTER_CRITICAL();
+	a->xSubStats.failures += fails;
+	if (pReturnInfo->returnCode == MQTTSuccess){
+		a->xSubStats.subacks++;
+	}
+	//Only batches sent since the last connect count towards its time
+	if ((batch->xRound == a->xSubRound) && (a->xSubOutstanding > 0)){
+		a->xSubOutstanding--;
+		if (a->xSubOutstanding == 0){
+			uint32_t ms = to_ms_since_boot(get_absolute_time ()) - a->xConnectMs;
+			a->xSubStats.connectToSubackMs = ms;
+			if (ms > a->xSubStats.maxConnectToSubackMs){
+				a->xSubStats.maxConnectToSubackMs = ms;
+			}
+		}
+	}
+	taskEXIT_CRITICAL();
 
+	vPortFree(batch);
 }
 
 /***
- * Subscribe to a topic, mesg will be sent to router object
+ * Add filter to the subscription table, growing it if needed
  * @param topic
  * @param QoS
- * @return
+ * @return false if out of memory
  */
-bool MQTTAgent::subToTopic(const char * topic,  const uint8_t QoS){
-	MQTTStatus_t status = MQTTNoDataAvailable ;
-
-	// Fill the command information.
-	xSubCommandInfo.cmdCompleteCallback = MQTTAgent::subscribeCmdCompleteCb;
-	xSubCommandInfo.blockTimeMs = 500;
-	//xSubCommandInfo.pCmdCompleteCallbackContext = this;
-
-	uint8_t subNum = xCurrentSub++;
-	if (xCurrentSub > MAXSUBS){
-		LogError(("OVERFLOW"));
+bool MQTTAgent::subAdd(const char * topic, uint8_t QoS){
+	size_t len = strlen(topic);
+	bool res = true;
+
+	xSemaphoreTake(xSubMutex, portMAX_DELAY);
+	for (uint16_t i=0; i < xSubCount; i++){
+		if ((pSubTable[i].xLen == len) && (strncmp(pSubTable[i].pTopic, topic, len) == 0)){
+			//Already subscribed, resend if QoS has changed
+			if (pSubTable[i].xQoS != QoS){
+				pSubTable[i].xQoS = QoS;
+				pSubTable[i].xSent = false;
+			}
+			pSubTable[i].pTopic = topic;
+			xSemaphoreGive(xSubMutex);
+			return true;
+		}
 	}
-	MQTTSubscribeInfo_t      *pSubInfo = &xSubscribeInfo[subNum];
-	MQTTAgentSubscribeArgs_t *pSubArgs = &xSubscribeArgs[subNum];
 
+	if (xSubCount == xSubCap){
+		MQTTSubEntry_t *t = (MQTTSubEntry_t *)pvPortMalloc(
+				sizeof(MQTTSubEntry_t) * (xSubCap + MAXSUBS));
+		if (t == NULL){
+			LogError(("Subscription table full at %d", xSubCap));
+			res = false;
+		} else {
+			if (pSubTable != NULL){
+				memcpy(t, pSubTable, sizeof(MQTTSubEntry_t) * xSubCount);
+				vPortFree(pSubTable);
+			}
+			pSubTable = t;
+			xSubCap += MAXSUBS;
+		}
+	}
 
-	// Fill the information for topic filters to subscribe to.
-	switch(QoS){
-	case 0:{
-		pSubInfo->qos = MQTTQoS0;
-		break;
+	if (res){
+		MQTTSubEntry_t *e = &pSubTable[xSubCount++];
+		e->pTopic = topic;
+		e->xLen = len;
+		e->xQoS = QoS;
+		e->xSent = false;
+		xSubStats.filters = xSubCount;
 	}
-	case 1:{
-		pSubInfo->qos = MQTTQoS1;
-		break;
+	xSemaphoreGive(xSubMutex);
+	return res;
+}
+
+/***
+ * Send all unsent filters in the table as SUBSCRIBE packets, packing
+ * as many filters into each as fit the network buffer
+ * @return false if any batch could not be queued
+ */
+bool MQTTAgent::subFlush(){
+	//Fixed header of up to 5 bytes and the packet id
+	const size_t header = 7;
+	size_t len = header;
+	uint16_t first = 0;
+	uint16_t count = 0;
+	bool res = true;
+
+	xSemaphoreTake(xSubMutex, portMAX_DELAY);
+	for (uint16_t i=0; i < xSubCount; i++){
+		MQTTSubEntry_t *e = &pSubTable[i];
+		size_t need = e->xLen + 3;
+
+		if (e->xSent){
+			if (count > 0){
+				res &= subSend(first, count);
+				count = 0;
+			}
+			continue;
+		}
+		if ((header + need) > MQTT_AGENT_NETWORK_BUFFER_SIZE){
+			LogError(("Subscription too long %s", e->pTopic));
+			e->xSent = true;
+			taskENTER_CRITICAL();
+			xSubStats.failures++;
+			taskEXIT_CRITICAL();
+			continue;
+		}
+		if ((count > 0) && ((len + need) > MQTT_AGENT_NETWORK_BUFFER_SIZE)){
+			res &= subSend(first, count);
+			count = 0;
+		}
+		if (count == 0){
+			first = i;
+			len = header;
+		}
+		len += need;
+		count++;
 	}
-	case 2:{
-		pSubInfo->qos = MQTTQoS2;
-		break;
+	if (count > 0){
+		res &= subSend(first, count);
 	}
-	default:{
-		pSubInfo->qos = MQTTQoS1;
-		break;
+	xSemaphoreGive(xSubMutex);
+	return res;
+}
+
+/***
+ * Queue one SUBSCRIBE for a run of table entries
+ * @param first - index of first entry
+ * @param count - number of entries
+ * @return true if queued
+ */
+bool MQTTAgent::subSend(uint16_t first, uint16_t count){
+	MQTTStatus_t status;
+	MQTTSubBatch_t *batch = (MQTTSubBatch_t *)pvPortMalloc(
+			sizeof(MQTTSubBatch_t) + sizeof(MQTTSubscribeInfo_t) * (count - 1));
+	if (batch == NULL){
+		LogError(("Sub batch alloc failed"));
+		return false;
 	}
+
+	memset(batch, 0, sizeof(MQTTSubBatch_t));
+	batch->pAgent = this;
+	batch->xRound = xSubRound;
+	for (uint16_t i=0; i < count; i++){
+		MQTTSubEntry_t *e = &pSubTable[first + i];
+		batch->xInfo[i].qos = (e->xQoS > 2) ? MQTTQoS1 : (MQTTQoS_t)e->xQoS;
+		batch->xInfo[i].pTopicFilter = e->pTopic;
+		batch->xInfo[i].topicFilterLength = e->xLen;
 	}
-	pSubInfo->pTopicFilter = topic;
-	pSubInfo->topicFilterLength = strlen(topic);
-	pSubArgs->pSubscribeInfo = pSubInfo;
-	pSubArgs->numSubscriptions = 1U;
+	batch->xArgs.pSubscribeInfo = batch->xInfo;
+	batch->xArgs.numSubscriptions = count;
+	batch->xCommandInfo.cmdCompleteCallback = MQTTAgent::subscribeCmdCompleteCb;
+	batch->xCommandInfo.pCmdCompleteCallbackContext = (MQTTAgentCommandContext_t *)batch;
+	batch->xCommandInfo.blockTimeMs = 500;
+
+	taskENTER_CRITICAL();
+	xSubOutstanding++;
+	taskEXIT_CRITICAL();
 
-	status = MQTTAgent_Subscribe( &xGlobalMqttAgentContext, pSubArgs, &xSubCommandInfo );
+	status = MQTTAgent_Subscribe( &xGlobalMqttAgentContext, &batch->xArgs, &batch->xCommandInfo );
 	if (status != MQTTSuccess){
 		LogError(("Sub error %d", status));
+		taskENTER_CRITICAL();
+		xSubOutstanding--;
+		taskEXIT_CRITICAL();
+		vPortFree(batch);
 		return false;
 	}
 
+	for (uint16_t i=0; i < count; i++){
+		pSubTable[first + i].xSent = true;
+	}
+	taskENTER_CRITICAL();
+	xSubStats.batches++;
+	taskEXIT_CRITICAL();
+
 	if (pObserver != NULL){
 		pObserver->MQTTSend();
 	}
-
 	return true;
+}
+
+/***
+ * Get the subscription counters
+ * @param stats - output
+ */
+void MQTTAgent::getSubStats(MQTTAgentSubStats *stats){
+	taskENTER_CRITICAL();
+	memcpy(stats, &xSubStats, sizeof(MQTTAgentSubStats));
+	taskEXIT_CRITICAL();
+}
+
+/***
+* Call back function when Publish completes
+* @param pCmdCallbackContext
+* @param pReturnInfo
+*/
+void MQTTAgent::publishCmdCompleteCb( MQTTAgentCommandContext_t * pCmdCallbackContext,
+            MQTTAgentReturnInfo_t * pReturnInfo ){
+	MQTTPubSlot_t *slot = (MQTTPubSlot_t *)pCmdCallbackContext;
+	MQTTAgent *a = slot->pAgent;
+
+	if (a->xPubResuming && (slot->xPublishInfo.qos != MQTTQoS0)){
+		//Broker did not keep the session, keep for pubResume to resend
+		slot->xResend = true;
+		return;
+	}
+	a->pubComplete(slot, pReturnInfo->returnCode);
+}
+
+/***
+ * Finish a publish, release its slot and signal its handle
+ * @param slot
+ * @param status - result of the publish
+ */
+void MQTTAgent::pubComplete(MQTTPubSlot_t *slot, MQTTStatus_t status){
+	MQTTPubHandle *handle = slot->pHandle;
+	bool windowed = (slot->xPublishInfo.qos != MQTTQoS0);
+	uint32_t latency = time_us_32() - slot->xQueuedUs;
+
+	LogDebug(("Publish complete %d in %uus\n", status, latency));
+	taskENTER_CRITICAL();
+	xPubStats.completed++;
+	if (status == MQTTSuccess){
+		xPubStats.latencyUs += latency;
+		if (latency > xPubStats.maxLatencyUs){
+			xPubStats.maxLatencyUs = latency;
+		}
+	} else {
+		xPubStats.failed++;
+	}
+	taskEXIT_CRITICAL();
+	pubSlotRelease(slot);
+	if (windowed){
+		pubWindowReturn();
+	}
+
+	if (handle != NULL){
+		handle->status = status;
+		handle->latencyUs = latency;
+		handle->state = (status == MQTTSuccess) ? PubDone : PubFailed;
+		if (handle->cb != NULL){
+			handle->cb(status, latency, handle->ctx);
+		}
+		xSemaphoreGive(handle->xDone);
+	}
+}
+
+/***
+ * Subscribe to a topic, mesg will be sent to router object.
+ * Topic is added to the subscription table, which is resent on reconnect.
+ * @param topic - zero terminated string, must remain valid
+ * @param QoS
+ * @return
+ */
+bool MQTTAgent::subToTopic(const char * topic,  const uint8_t QoS){
+	if (!subAdd(topic, QoS)){
+		return false;
+	}
 
+	//While collecting the router's list the table is sent once at the end
+	if (xSubBatching || (xConnState != Online)){
+		return true;
+	}
+	return subFlush();
 }
 
 /***
@@ -610,7 +1841,11 @@ bool MQTTAgent::subToTopic(const char * topic,  const uint8_t QoS){
  */
 bool MQTTAgent::TCPconn(){
 	LogDebug(("TCP Connect...."));
+	xConnStartMs = to_ms_since_boot(get_absolute_time ());
 	if (xTcpTrans.transConnect(pTarget, xPort)){
+		if (xEventDriven){
+			xTcpTrans.transEnableEvents(MQTTAgent::sockEventCb, this);
+		}
 		setConnState(TCPConned);
 		LogDebug(("TCP Connected"));
 		return true;
@@ -621,6 +1856,82 @@ bool MQTTAgent::TCPconn(){
 	return false;
 }
 
+/***
+ * Next reconnect delay, capped exponential backoff with full jitter.
+ * Uses the link policy if our network is down, else the broker policy.
+ * @return delay in ms
+ */
+uint32_t MQTTAgent::backoffNext(){
+	uint32_t now = to_ms_since_boot(get_absolute_time ());
+	uint32_t base = MQTT_BACKOFF_BASE_MS;
+	uint32_t cap = MQTT_BACKOFF_MAX_MS;
+	uint32_t ceil;
+
+	//Held the connection long enough, start again from the base
+	if ((xOnlineMs != 0) && ((now - xOnlineMs) >= MQTT_BACKOFF_STABLE_MS)){
+		xReconStats.attempt = 0;
+	}
+	xOnlineMs = 0;
+
+	if (pEth->isJoined()){
+		xReconStats.brokerWaits++;
+	} else {
+		base = MQTT_BACKOFF_LINK_BASE_MS;
+		cap = MQTT_BACKOFF_LINK_MAX_MS;
+		xReconStats.linkWaits++;
+	}
+
+	ceil = base;
+	for (uint32_t i=0; (i < xReconStats.attempt) && (ceil < cap); i++){
+		ceil = ceil * 2;
+	}
+	if (ceil > cap){
+		ceil = cap;
+	}
+
+	uint32_t delay = backoffRand() % (ceil + 1);
+	xReconStats.attempt++;
+	xReconStats.reconnects++;
+	xReconStats.lastDelayMs = delay;
+	if (delay > xReconStats.maxDelayMs){
+		xReconStats.maxDelayMs = delay;
+	}
+	LogInfo(("Reconnect in %ums, attempt %u", delay, xReconStats.attempt));
+	return delay;
+}
+
+/***
+ * Pseudo random number, xorshift seeded from the board id
+ * @return
+ */
+uint32_t MQTTAgent::backoffRand(){
+	if (xRand == 0){
+		pico_unique_board_id_t id;
+		pico_get_unique_board_id(&id);
+		for (uint8_t i=0; i < PICO_UNIQUE_BOARD_ID_SIZE_BYTES; i++){
+			xRand = (xRand << 5) ^ (xRand >> 27) ^ id.id[i];
+		}
+		xRand ^= time_us_32();
+		if (xRand == 0){
+			xRand = 1;
+		}
+	}
+	xRand ^= xRand << 13;
+	xRand ^= xRand >> 17;
+	xRand ^= xRand << 5;
+	return xRand;
+}
+
+/***
+ * Get the reconnect counters
+ * @param stats - output
+ */
+void MQTTAgent::getReconStats(MQTTAgentReconStats *stats){
+	taskENTER_CRITICAL();
+	memcpy(stats, &xReconStats, sizeof(MQTTAgentReconStats));
+	taskEXIT_CRITICAL();
+}
+
 /***
  * Set a single observer to get call back on state changes
  * @param obs
@@ -653,24 +1964,75 @@ void MQTTAgent::stop(){
 void MQTTAgent::setConnState(MQTTState s){
 	xConnState = s;
 
-	if (pObserver != NULL){
-		switch(xConnState){
-		case Offline:{
+	switch(xConnState){
+	case Offline:{
+		if ((xOnlineCount > 0) && (xDroppedMs == 0)){
+			xDroppedMs = to_ms_since_boot(get_absolute_time ());
+		}
+		if (pObserver != NULL){
 			pObserver->MQTTOffline();
-			if (xRecon){
-				setConnState(MQTTRecon);
-			}
-			break;
 		}
-		case Online:{
-			pObserver->MQTTOnline();
-			break;
+		if (xRecon){
+			setConnState(MQTTRecon);
 		}
-		default:{
-			;
+		break;
+	}
+	case Online:{
+		xOnlineMs = to_ms_since_boot(get_absolute_time ());
+		if (xConnStartMs != 0){
+			uint32_t ms = xOnlineMs - xConnStartMs;
+			taskENTER_CRITICAL();
+			if (xTcpTrans.wasCachedConnect()){
+				xConnStats.fastConnects++;
+				xConnStats.fastMs = ms;
+				if (ms > xConnStats.maxFastMs){
+					xConnStats.maxFastMs = ms;
+				}
+			} else {
+				xConnStats.coldConnects++;
+				xConnStats.coldMs = ms;
+				if (ms > xConnStats.maxColdMs){
+					xConnStats.maxColdMs = ms;
+				}
+			}
+			taskEXIT_CRITICAL();
+			xConnStartMs = 0;
+		}
+		xOnlineCount++;
+		if (pOnlineCb != NULL){
+			MQTTOnlineInfo info;
+			info.onlineCount = xOnlineCount;
+			info.offlineMs = (xDroppedMs != 0) ? (xOnlineMs - xDroppedMs) : 0;
+			info.sessionPresent = xSessionPresent;
+			pOnlineCb(&info, pOnlineCtx);
 		}
+		xDroppedMs = 0;
+		if (pObserver != NULL){
+			pObserver->MQTTOnline();
 		}
+		break;
+	}
+	default:{
+		;
 	}
+	}
+}
+
+/***
+ * Get the receive path counters, SPI operations per publish is
+ * spiOps / publishes
+ * @param stats - output
+ */
+void MQTTAgent::getRxStats(MQTTAgentRxStats *stats){
+	TCPTransportStats trans;
+	EthReadStats eth;
+
+	xTcpTrans.getStats(&trans);
+	pEth->getReadStats(&eth);
+	stats->publishes = xRxPublishes;
+	stats->transportReads = trans.reads;
+	stats->chipReads = trans.chipReads;
+	stats->spiOps = eth.spiOps;
 }
 
 /***
@@ -12,6 +12,7 @@
 
 #include "MQTTConfig.h"
 #include "FreeRTOS.h"
+#include "event_groups.h"
 #include "core_mqtt.h"
 #include "core_mqtt_agent.h"
 #include "MQTTInterface.h"
@@ -20,6 +21,8 @@
 #include "TCPTransport.h"
 #include "EthHelper.h"
 #include "MQTTAgentObserver.h"
+#include "MQTTOfflineQueue.h"
+#include "MQTTCompress.h"
 
 extern "C" {
 #include "freertos_agent_message.h"
@@ -30,6 +33,7 @@ extern "C" {
 #define MQTT_AGENT_NETWORK_BUFFER_SIZE 512
 #endif
 
+//Initial size of the subscription table and the step it grows by
 #ifndef MAXSUBS
 #define MAXSUBS 12
 #endif
@@ -38,23 +42,312 @@ extern "C" {
 #define MQTTKEEPALIVETIME 10
 #endif
 
-#ifndef MQTT_RECON_DELAY
-#define MQTT_RECON_DELAY 10
+//Reconnect backoff when the broker is unreachable or refuses us, ms.
+//Delay is random between 0 and min(max, base * 2^attempt)
+#ifndef MQTT_BACKOFF_BASE_MS
+#define MQTT_BACKOFF_BASE_MS 1000
+#endif
+
+#ifndef MQTT_BACKOFF_MAX_MS
+#define MQTT_BACKOFF_MAX_MS 120000
+#endif
+
+//Reconnect backoff when our own link went down, ms
+#ifndef MQTT_BACKOFF_LINK_BASE_MS
+#define MQTT_BACKOFF_LINK_BASE_MS 500
+#endif
+
+#ifndef MQTT_BACKOFF_LINK_MAX_MS
+#define MQTT_BACKOFF_LINK_MAX_MS 5000
+#endif
+
+//ms online after which the backoff starts again from the base
+#ifndef MQTT_BACKOFF_STABLE_MS
+#define MQTT_BACKOFF_STABLE_MS 30000
+#endif
+
+//Max ticks to wait for a link event before checking the network again
+#ifndef MQTT_LINK_WAIT_DELAY
+#define MQTT_LINK_WAIT_DELAY 1000
+#endif
+
+//Collect packets from one pass of the command loop into one write
+#ifndef MQTT_WRITE_COMBINE
+#define MQTT_WRITE_COMBINE true
+#endif
+
+//Ask the broker to keep the session across reconnects
+#ifndef MQTT_PERSISTENT_SESSION
+#define MQTT_PERSISTENT_SESSION false
+#endif
+
+//Reconnect to the last good broker address without resolving again
+#ifndef MQTT_FAST_RECONNECT
+#define MQTT_FAST_RECONNECT true
+#endif
+
+//Speak MQTT 5 on the wire, falling back to 3.1.1 if the broker refuses
+#ifndef MQTT_PROTOCOL_V5
+#define MQTT_PROTOCOL_V5 false
+#endif
+
+//MQTT 5 Receive Maximum, inbound QoS1/2 publishes the broker may have in flight
+#ifndef MQTT_RECEIVE_MAX
+#define MQTT_RECEIVE_MAX 10
+#endif
+
+//MQTT 5 seconds the broker keeps a persistent session after disconnect
+#ifndef MQTT_SESSION_EXPIRY_S
+#define MQTT_SESSION_EXPIRY_S 3600
+#endif
+
+//Encoding used for state payloads on this connection
+#ifndef MQTT_CONTENT_TYPE
+#define MQTT_CONTENT_TYPE ContentJSON
+#endif
+
+//Max ms the agent sleeps waiting for a command or socket event
+#ifndef MQTT_AGENT_EVENT_WAIT_MS
+#define MQTT_AGENT_EVENT_WAIT_MS 500
+#endif
+
+//Max ms a caller of pubToTopicV waits for the agent to send
+#ifndef MQTT_AGENT_VEC_WAIT_MS
+#define MQTT_AGENT_VEC_WAIT_MS 2000
+#endif
+
+//Number of publishes that may be queued or awaiting ack at once
+#ifndef MQTT_PUB_SLOTS
+#define MQTT_PUB_SLOTS 8
+#endif
+
+//Number of QoS1/2 publishes that may be awaiting ack at once, the in-flight window
+#ifndef MQTT_PUB_WINDOW
+#define MQTT_PUB_WINDOW 4
+#endif
+
+//Largest topic and payload copied into a publish slot
+#ifndef MQTT_PUB_TOPIC_MAX
+#define MQTT_PUB_TOPIC_MAX 80
+#endif
+
+#ifndef MQTT_PUB_PAYLOAD_MAX
+#define MQTT_PUB_PAYLOAD_MAX MQTT_AGENT_NETWORK_BUFFER_SIZE
+#endif
+
+//Compress publish payloads, receivers decompress whenever the header is seen
+#ifndef MQTT_COMPRESS
+#define MQTT_COMPRESS false
+#endif
+
+//Smallest payload worth compressing
+#ifndef MQTT_COMPRESS_MIN
+#define MQTT_COMPRESS_MIN 256
+#endif
+
+//Largest payload before compression, also the largest inbound after decompression
+#ifndef MQTT_COMPRESS_MAX_IN
+#define MQTT_COMPRESS_MAX_IN 1024
+#endif
+
+#if MQTT_COMPRESS_MAX_IN < MQTT_PUB_PAYLOAD_MAX
+#error MQTT_COMPRESS_MAX_IN must be at least MQTT_PUB_PAYLOAD_MAX
+#endif
+
+//Max ms pubToTopic waits for a free publish slot
+#ifndef MQTT_PUB_SLOT_WAIT_MS
+#define MQTT_PUB_SLOT_WAIT_MS 500
 #endif
 
 
 // Enumerator used to control the state machine at centre of agent
 enum MQTTState {  Offline, TCPReq, TCPConned, MQTTReq, MQTTConned, MQTTRecon, Online};
 
+// Events that wake the state machine
+#define MQTT_EVT_CONNECT	0x01
+#define MQTT_EVT_CLOSE		0x02
+#define MQTT_EVT_LINK		0x04
+
+/***
+ * Receive path counters
+ */
+typedef struct {
+	uint32_t publishes;		//Incoming PUBLISH packets routed
+	uint32_t transportReads;//Reads made by coreMQTT
+	uint32_t chipReads;		//Reads that went to the W5x00
+	uint32_t spiOps;		//W5x00 accesses made by all TCP reads
+} MQTTAgentRxStats;
+
+/***
+ * Subscription counters, connectToSubackMs is the reconnect cost of
+ * the last connect
+ */
+typedef struct {
+	uint32_t filters;				//Filters in the subscription table
+	uint32_t batches;				//SUBSCRIBE packets sent
+	uint32_t subacks;				//SUBACKs received
+	uint32_t failures;				//Filters refused or not acked
+	uint32_t connectToSubackMs;		//ms from CONNACK to the last SUBACK
+	uint32_t maxConnectToSubackMs;	//Longest connectToSubackMs seen
+	uint32_t resumes;				//Connects that kept the broker session
+} MQTTAgentSubStats;
+
+/***
+ * Reconnect counters
+ */
+typedef struct {
+	uint32_t reconnects;	//Reconnect attempts made
+	uint32_t linkWaits;		//Backoffs using the link down policy
+	uint32_t brokerWaits;	//Backoffs using the broker policy
+	uint32_t attempt;		//Attempts since last stable connection
+	uint32_t lastDelayMs;	//Last backoff delay
+	uint32_t maxDelayMs;	//Longest backoff delay
+} MQTTAgentReconStats;
+
+/***
+ * Time from starting the TCP connect to Online, cold connects resolve the
+ * broker while fast reconnects reuse its last good address
+ */
+typedef struct {
+	uint32_t coldConnects;
+	uint32_t coldMs;		//Last cold connect
+	uint32_t maxColdMs;
+	uint32_t fastConnects;
+	uint32_t fastMs;		//Last fast reconnect
+	uint32_t maxFastMs;
+} MQTTAgentConnStats;
+
+class MQTTAgent;
+
+/***
+ * Entry in the subscription table
+ */
+typedef struct {
+	const char *pTopic;
+	uint16_t xLen;
+	uint8_t xQoS;
+	bool xSent;
+} MQTTSubEntry_t;
+
+/***
+ * One SUBSCRIBE packet of several filters, allocated when sent and
+ * freed when the SUBACK arrives
+ */
+typedef struct {
+	MQTTAgentCommandInfo_t xCommandInfo;
+	MQTTAgentSubscribeArgs_t xArgs;
+	MQTTAgent *pAgent;
+	uint32_t xRound;
+	MQTTSubscribeInfo_t xInfo[1];
+} MQTTSubBatch_t;
+
+enum MQTTPubState { PubPending, PubDone, PubFailed };
+
+//Encoding of state payloads, advertised on the online lifecycle topic
+enum MQTTContentType { ContentJSON, ContentCBOR };
+
+/***
+ * Callback on completion of a publish, runs in the agent task so must not block
+ * @param status - MQTTSuccess once sent (QoS0), acked (QoS1) or completed (QoS2)
+ * @param latencyUs - us from queuing to completion
+ * @param ctx - context given in the handle
+ */
+typedef void (*MQTTPubCallback)(MQTTStatus_t status, uint32_t latencyUs, void *ctx);
+
+/***
+ * What the agent knows about a connection as it goes Online, so twin state
+ * can choose between a full exchange and sending only what changed
+ */
+typedef struct {
+	uint32_t onlineCount;	//Times Online since boot, 1 on the first connect
+	uint32_t offlineMs;		//ms since the last connection dropped, 0 on the first
+	bool sessionPresent;	//Broker kept our session and subscriptions
+} MQTTOnlineInfo;
+
+/***
+ * Callback as the agent goes Online, before the observer is told. Runs in
+ * the agent task so must not block. Publishes without a handle go to the
+ * offline queue and are sent after the online announce once it returns,
+ * publishes with a handle fail rather than wait and must not be waited on.
+ * @param info - connection details
+ * @param ctx - context given to setOnlineCallback
+ */
+typedef void (*MQTTOnlineCallback)(const MQTTOnlineInfo *info, void *ctx);
+
+/***
+ * Completion handle for a publish. Owned by the caller and must stay valid
+ * until the publish completes. Set cb and ctx before publishing, or leave
+ * cb NULL and use pubWait.
+ */
+typedef struct {
+	MQTTPubCallback cb;
+	void *ctx;
+	volatile MQTTPubState state;
+	MQTTStatus_t status;
+	uint32_t latencyUs;
+	StaticSemaphore_t xDoneBuffer;
+	SemaphoreHandle_t xDone;
+} MQTTPubHandle;
+
+/***
+ * Publish slot, holds a copy of the message until the agent has
+ * completed the publish
+ */
+typedef struct {
+	MQTTPublishInfo_t xPublishInfo;
+	MQTTAgentCommandInfo_t xCommandInfo;
+	MQTTAgent *pAgent;
+	MQTTPubHandle *pHandle;
+	uint32_t xQueuedUs;
+	volatile bool xInUse;
+	bool xResend;
+	char xTopic[MQTT_PUB_TOPIC_MAX];
+	uint8_t xPayload[MQTT_PUB_PAYLOAD_MAX];
+} MQTTPubSlot_t;
+
+/***
+ * Publish slot counters
+ */
+typedef struct {
+	uint32_t published;		//Publishes queued to the agent
+	uint32_t completed;		//Publishes completed by the agent
+	uint32_t slotWaits;		//Publishes that waited for a slot
+	uint32_t slotFails;		//Publishes dropped with no slot free
+	uint32_t maxInUse;		//Most slots in use at once
+	uint32_t failed;		//Publishes completed with an error
+	uint32_t latencyUs;		//Total us from queuing to completion
+	uint32_t maxLatencyUs;	//Longest us from queuing to completion
+	uint32_t windowInUse;	//QoS1/2 publishes currently in flight
+	uint32_t maxWindow;		//Most QoS1/2 publishes in flight at once
+	uint32_t windowWaits;	//Publishes that waited for room in the window
+	uint32_t resent;		//Publishes retransmitted after a reconnect
+} MQTTAgentPubStats;
+
+// Command queue context with pointer back to the agent
+typedef struct {
+	MQTTAgentMessageContext_t xMsgCtx;
+	MQTTAgent *pAgent;
+} MQTTAgentQueueContext_t;
+
+// State of the vectored publish request
+enum MQTTVecState { VecIdle, VecQueued, VecBusy, VecDone };
+
 class MQTTAgent: public MQTTInterface{
 public:
 	/***
 	 * Constructor
-	 * @param sockNum - Socket Number to use
+	 * @param sockNum - Socket Number to use, if already in use another is
+	 * taken from the EthHelper allocator
 	 * @param eth - Ethernet helper for communicating to hardware
 	 */
 	MQTTAgent(uint8_t sockNum, EthHelper *eth);
 
+	/***
+	 * Constructor, socket is taken from the EthHelper allocator
+	 * @param eth - Ethernet helper for communicating to hardware
+	 */
+	MQTTAgent(EthHelper *eth);
+
 	/***
 	 * Distructor
 	 */
@@ -80,7 +373,111 @@ public:
 	 bool connect(const char * target, uint16_t  port, bool recon=false, bool ssl=false);
 
 	/***
-	 * Start the task running
+	 * Use the W5x00 socket interrupt rather than polling the socket.
+	 * The agent then sleeps until a command or socket event arrives.
+	 * Must be set before connect.
+	 * @param enable
+	 */
+	void setEventDriven(bool enable = true);
+
+	/***
+	 * Collect packets sent during one pass of the command loop and
+	 * write them as one SEND. Sizes and delay are set by TCP_TX_BUF_SIZE
+	 * and TCP_TX_MAX_DELAY_MS.
+	 * @param enable
+	 */
+	void setWriteCombining(bool enable = true);
+
+	/***
+	 * Connect without clean session so the broker keeps subscriptions and
+	 * queued QoS1/2 messages across reconnects. When the broker reports
+	 * the session is present the resubscribe is skipped. Must be set
+	 * before connect.
+	 * @param enable
+	 */
+	void setPersistentSession(bool enable = true);
+
+	/***
+	 * Did the last connect resume a session held by the broker
+	 * @return
+	 */
+	bool isSessionPresent();
+
+	/***
+	 * Reconnect to the last good broker address without resolving it
+	 * again, falling back to a lookup if that fails
+	 * @param enable
+	 */
+	void setFastReconnect(bool enable = true);
+
+	/***
+	 * Get the time to online counters
+	 * @param stats - output
+	 */
+	void getConnStats(MQTTAgentConnStats *stats);
+
+	/***
+	 * Speak MQTT 5 on the wire. Outbound publishes use topic aliases when
+	 * the broker allows them. If the broker refuses version 5 the agent
+	 * falls back to 3.1.1 for later connects. Must be set before connect.
+	 * @param enable
+	 */
+	void setMqtt5(bool enable = true);
+
+	/***
+	 * Is the agent using MQTT 5
+	 * @return
+	 */
+	bool isMqtt5();
+
+	/***
+	 * Get the MQTT 5 counters, including bytes saved by topic aliases
+	 * @param stats - output
+	 */
+	void getMqtt5Stats(MQTT5Stats *stats);
+
+	/***
+	 * Compress publish payloads of MQTT_COMPRESS_MIN bytes or more. Payloads
+	 * up to MQTT_COMPRESS_MAX_IN may then be published as long as they
+	 * compress to fit MQTT_PUB_PAYLOAD_MAX. Compressed inbound payloads are
+	 * always decompressed before routing, one that fails to decompress is
+	 * routed as received.
+	 * @param enable
+	 */
+	void setCompression(bool enable = true);
+
+	/***
+	 * Get the compression counters, ratio and time per byte
+	 * @param stats - output
+	 */
+	void getCompressStats(MQTTCompressStats *stats);
+
+	/***
+	 * Set callback made as the agent goes Online. Lets twin state decide
+	 * on reconnect whether it must resend anything. Runs in the agent task,
+	 * see MQTTOnlineCallback for publishing from it.
+	 * @param cb - callback or NULL
+	 * @param ctx - context passed to callback
+	 */
+	void setOnlineCallback(MQTTOnlineCallback cb, void *ctx);
+
+	/***
+	 * Set the encoding used for state payloads on this connection. It is
+	 * advertised on the online lifecycle topic so the other end can
+	 * decode state and send deltas to match. Must be set before connect.
+	 * @param type - ContentJSON or ContentCBOR
+	 */
+	void setContentType(MQTTContentType type);
+
+	/***
+	 * Encoding used for state payloads, CBOR uses CBOREncoder and
+	 * CBORDecoder in place of json_maker and tiny_json
+	 * @return
+	 */
+	MQTTContentType getContentType();
+
+	/***
+	 * Start the task running, not started if the agent has no socket
 	 * @param priority - priority to run within FreeRTOS
 	 */
 	void start(UBaseType_t priority = tskIDLE_PRIORITY);
@@ -98,22 +495,85 @@ public:
 	virtual const char * getId();
 
 	/***
-	 * Publish message to topic
+	 * Publish message to topic. Topic and payload are copied into a slot
+	 * from a pool of MQTT_PUB_SLOTS so several tasks may publish at once.
+	 * Waits up to MQTT_PUB_SLOT_WAIT_MS for a free slot.
 	 * @param topic - zero terminated string. Copied by function
-	 * @param payload - payload as pointer to memory block
-	 * @param payloadLen - length of memory block
+	 * @param payload - payload as pointer to memory block. Copied by function
+	 * @param payloadLen - length of memory block, up to MQTT_PUB_PAYLOAD_MAX
 	 */
 	virtual bool pubToTopic(const char * topic,  const void * payload,
 			size_t payloadLen, const uint8_t QoS=0);
 
 	/***
-	 * Subscribe to a topic, mesg will be sent to router object
-	 * @param topic
+	 * Publish message to topic and report completion through a handle.
+	 * Completion is when sent for QoS0, on PUBACK for QoS1 and on PUBCOMP for QoS2.
+	 * @param topic - zero terminated string. Copied by function
+	 * @param payload - payload as pointer to memory block. Copied by function
+	 * @param payloadLen - length of memory block, up to MQTT_PUB_PAYLOAD_MAX
+	 * While not online, while earlier offline publishes are still being
+	 * sent, or when made from the agent task, a publish without a handle is
+	 * stored in the offline queue.
+	 * @param QoS - 0, 1 or 2
+	 * @param handle - completion handle or NULL
+	 * @param expiryMs - ms an offline publish is kept, 0 for never
+	 * @return true if queued to the agent or the offline queue
+	 */
+	bool publish(const char * topic,  const void * payload,
+			size_t payloadLen, const uint8_t QoS, MQTTPubHandle *handle,
+			uint32_t expiryMs = MQTT_OFFLINE_EXPIRY_MS);
+
+	/***
+	 * Get the offline store and forward queue, to set its spill store
+	 * and drop policy or read its counters
+	 * @return
+	 */
+	MQTTOfflineQueue *getOfflineQueue();
+
+	/***
+	 * Wait for a publish to complete
+	 * @param handle - handle given to publish
+	 * @param timeoutMs - max ms to wait
+	 * @return true if publish completed successfully
+	 */
+	bool pubWait(MQTTPubHandle *handle, uint32_t timeoutMs);
+
+	/***
+	 * Publish message made up of several payload fragments. Header, topic
+	 * and fragments are written straight into the socket TX memory and
+	 * sent as one packet, so no copy of the payload is assembled.
+	 * Blocks until sent, fragments must remain valid until return.
+	 * Only QoS 0 is supported as coreMQTT does not track the packet.
+	 * @param topic - zero terminated string
+	 * @param frags - payload fragments
+	 * @param count - number of fragments, at most TCP_MAX_FRAGS - 2
+	 * @param QoS - must be 0
+	 * @return true if sent
+	 */
+	bool pubToTopicV(const char * topic, const EthFragment *frags,
+			uint8_t count, const uint8_t QoS=0);
+
+	/***
+	 * Subscribe to a topic, mesg will be sent to router object.
+	 * Topic is added to the subscription table, which is resent on reconnect.
+	 * @param topic - zero terminated string, must remain valid
 	 * @param QoS
 	 * @return
 	 */
 	virtual bool subToTopic(const char * topic, const uint8_t QoS=0);
 
+	/***
+	 * Get the subscription counters
+	 * @param stats - output
+	 */
+	void getSubStats(MQTTAgentSubStats *stats);
+
+	/***
+	 * Get the reconnect counters
+	 * @param stats - output
+	 */
+	void getReconStats(MQTTAgentReconStats *stats);
+
 
 	/***
 	 * Close connection
@@ -151,6 +611,19 @@ public:
 	virtual void setObserver(MQTTAgentObserver *obs);
 
 
+	/***
+	 * Get the receive path counters, SPI operations per publish is
+	 * spiOps / publishes
+	 * @param stats - output
+	 */
+	void getRxStats(MQTTAgentRxStats *stats);
+
+	/***
+	 * Get the publish slot counters
+	 * @param stats - output
+	 */
+	void getPubStats(MQTTAgentPubStats *stats);
+
 	/***
 	 * Get the FreeRTOS task being used
 	 * @return
@@ -158,6 +631,11 @@ public:
 	virtual TaskHandle_t getTask();
 
 private:
+	/***
+	 * Set up everything shared by the constructors, once xSock is chosen
+	 */
+	void setup();
+
 	/***
 	 * Initialisation code
 	 * @return
@@ -176,6 +654,73 @@ private:
             MQTTPublishInfo_t * pxPublishInfo );
 
 
+	/***
+	 * Receive next command for the agent, used in place of
+	 * Agent_MessageReceive
+	 * @param pMsgCtx - queue context
+	 * @param ppCommand - output command, NULL to run the process loop
+	 * @param blockTimeMs - time to wait in polled mode
+	 * @return true if something was received
+	 */
+	static bool commandRecv( MQTTAgentMessageContext_t * pMsgCtx,
+			MQTTAgentCommand_t ** ppCommand,
+			uint32_t blockTimeMs );
+
+	/***
+	 * Network joined or lost, called from EthHelper task
+	 * @param joined
+	 * @param ctx - this agent
+	 */
+	static void linkCb(bool joined, void *ctx);
+
+	/***
+	 * Sleep until one of the events is posted
+	 * @param events - event bits to wait for
+	 * @param ticks - max time to wait
+	 * @return events that were set
+	 */
+	EventBits_t waitEvents(EventBits_t events, TickType_t ticks);
+
+	/***
+	 * Build the connect and will info used by every connect
+	 */
+	void connInfoPrepare();
+
+	/***
+	 * Next reconnect delay, capped exponential backoff with full jitter.
+	 * Uses the link policy if our network is down, else the broker policy.
+	 * @return delay in ms
+	 */
+	uint32_t backoffNext();
+
+	/***
+	 * Pseudo random number, xorshift seeded from the board id
+	 * @return
+	 */
+	uint32_t backoffRand();
+
+	/***
+	 * Build and send a QoS 0 publish from fragments, agent task only
+	 * @param topic - zero terminated string
+	 * @param frags - payload fragments
+	 * @param count - number of fragments
+	 * @return true if sent
+	 */
+	bool sendPublishV(const char * topic, const EthFragment *frags, uint8_t count);
+
+	/***
+	 * Send any vectored publish waiting for the agent task
+	 * @param online - false to fail the request
+	 */
+	void vecService(bool online);
+
+	/***
+	 * Socket interrupt, called from interrupt context
+	 * @param sock - socket id
+	 * @param ctx - this agent
+	 */
+	static void sockEventCb(uint8_t sock, void *ctx);
+
 	/***
 	 * Task object running to manage MQTT interface
 	 * @param pvParameters
@@ -198,6 +743,29 @@ private:
 	static void subscribeCmdCompleteCb( MQTTAgentCommandContext_t * pCmdCallbackContext,
 	                             MQTTAgentReturnInfo_t * pReturnInfo );
 
+	/***
+	 * Add filter to the subscription table, growing it if needed
+	 * @param topic
+	 * @param QoS
+	 * @return false if out of memory
+	 */
+	bool subAdd(const char * topic, uint8_t QoS);
+
+	/***
+	 * Send all unsent filters in the table as SUBSCRIBE packets, packing
+	 * as many filters into each as fit the network buffer
+	 * @return false if any batch could not be queued
+	 */
+	bool subFlush();
+
+	/***
+	 * Queue one SUBSCRIBE for a run of table entries
+	 * @param first - index of first entry
+	 * @param count - number of entries
+	 * @return true if queued
+	 */
+	bool subSend(uint16_t first, uint16_t count);
+
 	/***
 	 * Call back function when Publish completes
 	 * @param pCmdCallbackContext
@@ -207,6 +775,120 @@ private:
             MQTTAgentReturnInfo_t * pReturnInfo );
 
 
+	/***
+	 * Claim a free publish slot
+	 * @param wait - wait up to MQTT_PUB_SLOT_WAIT_MS for one
+	 * @return slot or NULL if none free
+	 */
+	MQTTPubSlot_t *pubSlotClaim(bool wait = true);
+
+	/***
+	 * Publish through a slot straight away, bypassing the offline queue
+	 * @param topic - zero terminated string
+	 * @param topicLen
+	 * @param payload
+	 * @param payloadLen
+	 * @param QoS
+	 * @param handle - completion handle or NULL
+	 * @return true if queued to the agent
+	 */
+	bool pubNow(const char * topic, size_t topicLen, const void * payload,
+			size_t payloadLen, uint8_t QoS, MQTTPubHandle *handle);
+
+	/***
+	 * Mark a handle failed for a publish that was never queued and wake any
+	 * pubWait. The callback is not made, the caller already has false.
+	 * @param handle - completion handle or NULL
+	 * @param status - reason
+	 */
+	void pubFail(MQTTPubHandle *handle, MQTTStatus_t status);
+
+	/***
+	 * Copy payload into a slot, compressed if enabled and it shrinks
+	 * @param slot
+	 * @param payload
+	 * @param payloadLen - in length, out length held in the slot
+	 * @return false if it does not fit the slot
+	 */
+	bool pubFill(MQTTPubSlot_t *slot, const void * payload, size_t *payloadLen);
+
+	/***
+	 * Largest payload that may be published
+	 * @return
+	 */
+	size_t pubPayloadMax();
+
+	/***
+	 * Queue a filled publish slot to the agent
+	 * @param slot - slot with topic and payload copied in
+	 * @param topicLen
+	 * @param payloadLen
+	 * @param QoS
+	 * @param blockMs - max ms to wait for room in the command queue
+	 * @return true if queued, slot and window are released if not
+	 */
+	bool pubDispatch(MQTTPubSlot_t *slot, size_t topicLen, size_t payloadLen,
+			uint8_t QoS, uint32_t blockMs);
+
+	/***
+	 * Send publishes from the offline queue while slots and window allow,
+	 * called by the agent task on each pass of the command loop
+	 */
+	void offlineService();
+
+	/***
+	 * Publish the online lifecycle message without blocking, for the agent
+	 * task as it comes Online
+	 * @return false to retry as no slot or window is free or the command queue is full
+	 */
+	bool pubAnnounce();
+
+	/***
+	 * Return a publish slot to the pool
+	 * @param slot
+	 */
+	void pubSlotRelease(MQTTPubSlot_t *slot);
+
+	/***
+	 * Take room in the in-flight window for a QoS1/2 publish
+	 * @param wait - wait up to MQTT_PUB_SLOT_WAIT_MS for room
+	 * @return false if the window is full
+	 */
+	bool pubWindowTake(bool wait = true);
+
+	/***
+	 * Return room in the in-flight window
+	 */
+	void pubWindowGive();
+
+	/***
+	 * Finish a publish, release its slot and signal its handle
+	 * @param slot
+	 * @param status - result of the publish
+	 */
+	void pubComplete(MQTTPubSlot_t *slot, MQTTStatus_t status);
+
+	/***
+	 * Resume the session after a reconnect. Unacked QoS1/2 publishes are
+	 * retransmitted, by the agent if the broker kept the session or from the
+	 * publish slots if it did not. Slot resends over the broker's Receive
+	 * Maximum are deferred until acks come in.
+	 */
+	void pubResume();
+
+	/***
+	 * Retransmit a publish slot kept over a reconnect
+	 * @param slot
+	 */
+	void pubResendSlot(MQTTPubSlot_t *slot);
+
+	/***
+	 * Return the window token of a completed QoS1/2 publish. A deferred
+	 * resend takes its place in flight, and while the broker's Receive
+	 * Maximum is not yet honoured the token is held back rather than freed.
+	 */
+	void pubWindowReturn();
+
 	/***
 	 * Run loop for the task
 	 */
@@ -238,6 +920,7 @@ private:
 
 
 	EthHelper *pEth = NULL;
+	int8_t xSock = -1;
 	NetworkContext_t xNetworkContext;
 	TCPTransport xTcpTrans;
 
@@ -259,6 +942,7 @@ private:
 
 	//Topics and payload for connection
 	static const char * ONLINEPAYLOAD;
+	static const char * ONLINECBORPAYLOAD;
 	char *pOnlineTopic = NULL;
 	char *pKeepAliveTopic = NULL;
 
@@ -270,24 +954,99 @@ private:
 	uint8_t xNetworkBuffer[ MQTT_AGENT_NETWORK_BUFFER_SIZE ];
 	uint8_t xStaticQueueStorageArea[ MQTT_AGENT_COMMAND_QUEUE_LENGTH * sizeof( MQTTAgentCommand_t * ) ];
 	StaticQueue_t xStaticQueueStructure;
-	MQTTAgentMessageContext_t xCommandQueue;
+	MQTTAgentQueueContext_t xCommandQueue;
 	MQTTAgentContext_t xGlobalMqttAgentContext;
 	TaskHandle_t xHandle = NULL;
 
-	//State machine state
+	//State machine state and events to wake it
 	MQTTState xConnState = Offline;
+	StaticEventGroup_t xEventGroupBuffer;
+	EventGroupHandle_t xEvents = NULL;
 
+	//Event driven socket reads and write combining
+	bool xEventDriven = false;
+	bool xWriteCombine = MQTT_WRITE_COMBINE;
+	bool xPersistent = MQTT_PERSISTENT_SESSION;
+	MQTTContentType xContentType = MQTT_CONTENT_TYPE;
 
-	//Storage for publishing message
-	MQTTAgentCommandInfo_t xCommandInfo;
-	MQTTPublishInfo_t xPublishInfo;
+	//Publish window tokens held back to honour the broker's Receive Maximum,
+	//the deficit is how many held and deferred resends must cover
+	uint8_t xWindowHeld = 0;
+	uint8_t xWindowDeficit = 0;
+	uint8_t xResendDeferred = 0;
+
+	//Connect info built once per set of credentials
+	MQTTConnectInfo_t xConnectInfo;
+	bool xConnectInfoReady = false;
+
+	//Time to online
+	uint32_t xConnStartMs = 0;
+	MQTTAgentConnStats xConnStats;
+
+	//Told as we go Online
+	MQTTOnlineCallback pOnlineCb = NULL;
+	void *pOnlineCtx = NULL;
+	uint32_t xOnlineCount = 0;
+	uint32_t xDroppedMs = 0;
+
+	//Reconnect backoff
+	uint32_t xRand = 0;
+	uint32_t xOnlineMs = 0;
+	MQTTAgentReconStats xReconStats;
+	volatile bool xEventPosted = false;
+
+
+	//Pool of publish slots, xPubFree counts the free ones
+	MQTTPubSlot_t xPubSlots[MQTT_PUB_SLOTS];
+	uint8_t xPubNext = 0;
+	uint8_t xPubInUse = 0;
+	StaticSemaphore_t xPubFreeBuffer;
+	SemaphoreHandle_t xPubFree = NULL;
+	MQTTAgentPubStats xPubStats;
+	StaticSemaphore_t xPubWindowBuffer;
+	SemaphoreHandle_t xPubWindow = NULL;
+	bool xSessionPresent = false;
+	bool xPubResuming = false;
+
+	//Payload compression, xInflate is used only by the agent task for
+	//inbound payloads and offline publishes
+	MQTTCompress xCompress;
+	bool xCompressOn = MQTT_COMPRESS;
+	uint8_t xInflate[MQTT_COMPRESS_MAX_IN];
+
+	//Store and forward of publishes made while offline
+	MQTTOfflineQueue xOffline;
+	bool xOfflineDraining = false;
+	bool xAnnouncePending = false;
+	uint32_t xOfflineDrainStart = 0;
+	uint32_t xOfflineDrainCount = 0;
+
+	//Vectored publish handed to the agent task
+	StaticSemaphore_t xVecMutexBuffer;
+	SemaphoreHandle_t xVecMutex = NULL;
+	StaticSemaphore_t xVecDoneBuffer;
+	SemaphoreHandle_t xVecDone = NULL;
+	volatile MQTTVecState xVecState = VecIdle;
+	const char * pVecTopic = NULL;
+	const EthFragment *pVecFrags = NULL;
+	uint8_t xVecCount = 0;
+	bool xVecOk = false;
+
+	//Subscription table, grown from the FreeRTOS heap
+	MQTTSubEntry_t *pSubTable = NULL;
+	uint16_t xSubCount = 0;
+	uint16_t xSubCap = 0;
+	StaticSemaphore_t xSubMutexBuffer;
+	SemaphoreHandle_t xSubMutex = NULL;
+	bool xSubBatching = false;
+	uint16_t xSubOutstanding = 0;
+	uint32_t xSubRound = 0;
+	uint32_t xConnectMs = 0;
+	MQTTAgentSubStats xSubStats;
 
-	//Storage for subscribing to message
-	MQTTAgentCommandInfo_t xSubCommandInfo;
-	MQTTSubscribeInfo_t xSubscribeInfo[MAXSUBS] ;
-	MQTTAgentSubscribeArgs_t xSubscribeArgs [MAXSUBS];
-	uint8_t xCurrentSub = 0;
 
+	//Incoming publishes
+	uint32_t xRxPublishes = 0;
 
 	//Single Observer
 	MQTTAgentObserver *pObserver = NULL;
@@ -0,0 +1,246 @@
+/*
+ * MQTTCompress.cpp
+ *
+ * LZ style payload compression with a fixed window and no heap.
+ * The body is groups of a flag byte then eight items, a clear flag bit
+ * is a literal byte and a set bit a two byte match of 4 bits length-3
+ * and 12 bits distance.
+ */
+
+#include "MQTTCompress.h"
+#include "MQTTConfig.h"
+#include <string.h>
+
+extern "C" {
+#include <task.h>
+}
+#include "pico/stdlib.h"
+
+#define LZ_MAGIC		0x1F
+#define LZ_FORMAT		'L'
+#define LZ_MIN_MATCH	3
+#define LZ_MAX_MATCH	(LZ_MIN_MATCH + 15)
+#define LZ_WINDOW		4095
+#define LZ_EMPTY		0xFFFF
+
+/***
+ * Constructor
+ */
+MQTTCompress::MQTTCompress() {
+	xMutex = xSemaphoreCreateMutexStatic(&xMutexBuffer);
+	memset(&xStats, 0, sizeof(xStats));
+}
+
+/***
+ * Destructor
+ */
+MQTTCompress::~MQTTCompress() {
+	// NOP
+}
+
+/***
+ * Compress a payload. Safe to call from several tasks.
+ * @param src - payload
+ * @param len - length of payload, up to 65535
+ * @param dst - output, header then compressed body
+ * @param max - size of dst
+ * @return length written, 0 if it would not be smaller than len or fit
+ */
+size_t MQTTCompress::compress(const void *src, size_t len, uint8_t *dst, size_t max){
+	size_t res = 0;
+	uint32_t start = time_us_32();
+
+	if ((len > 0xFFFF) || (max <= MQTT_COMPRESS_HDR)){
+		return 0;
+	}
+	if (max > len){
+		//No use unless it comes out smaller
+		max = len;
+	}
+
+	xSemaphoreTake(xMutex, portMAX_DELAY);
+	size_t body = lzCompress((const uint8_t *)src, len, &dst[MQTT_COMPRESS_HDR],
+			max - MQTT_COMPRESS_HDR);
+	xSemaphoreGive(xMutex);
+
+	if (body > 0){
+		dst[0] = LZ_MAGIC;
+		dst[1] = LZ_FORMAT;
+		dst[2] = len >> 8;
+		dst[3] = len & 0xFF;
+		res = body + MQTT_COMPRESS_HDR;
+	}
+
+	uint32_t us = time_us_32() - start;
+	taskENTER_CRITICAL();
+	xStats.bytesIn += len;
+	xStats.compressUs += us;
+	if (res > 0){
+		xStats.compressed++;
+		xStats.bytesOut += res;
+	} else {
+		xStats.skipped++;
+		xStats.bytesOut += len;
+	}
+	taskEXIT_CRITICAL();
+	return res;
+}
+
+/***
+ * Compress body into dst, table must be held
+ * @param src
+ * @param len
+ * @param dst
+ * @param max
+ * @return length written, 0 if it did not fit
+ */
+size_t MQTTCompress::lzCompress(const uint8_t *src, size_t len, uint8_t *dst, size_t max){
+	size_t in = 0;
+	size_t out = 0;
+	size_t flagPos = 0;
+	uint8_t flagBit = 8;
+
+	for (uint32_t i=0; i < (1 << MQTT_COMPRESS_HASH_BITS); i++){
+		xTable[i] = LZ_EMPTY;
+	}
+
+	while (in < len){
+		if (flagBit == 8){
+			if (out >= max){
+				return 0;
+			}
+			flagPos = out++;
+			dst[flagPos] = 0;
+			flagBit = 0;
+		}
+
+		size_t matchLen = 0;
+		size_t dist = 0;
+		if ((len - in) >= LZ_MIN_MATCH){
+			uint32_t h = ((src[in] << 16) | (src[in+1] << 8) | src[in+2]) * 2654435761u;
+			h = h >> (32 - MQTT_COMPRESS_HASH_BITS);
+			uint16_t cand = xTable[h];
+			xTable[h] = in;
+			if ((cand != LZ_EMPTY) && ((in - cand) <= LZ_WINDOW)){
+				size_t limit = len - in;
+				if (limit > LZ_MAX_MATCH){
+					limit = LZ_MAX_MATCH;
+				}
+				while ((matchLen < limit) && (src[cand + matchLen] == src[in + matchLen])){
+					matchLen++;
+				}
+				dist = in - cand;
+			}
+		}
+
+		if (matchLen >= LZ_MIN_MATCH){
+			if ((out + 2) > max){
+				return 0;
+			}
+			dst[flagPos] |= (1 << flagBit);
+			dst[out++] = ((matchLen - LZ_MIN_MATCH) << 4) | (dist >> 8);
+			dst[out++] = dist & 0xFF;
+			in += matchLen;
+		} else {
+			if (out >= max){
+				return 0;
+			}
+			dst[out++] = src[in++];
+		}
+		flagBit++;
+	}
+	return out;
+}
+
+/***
+ * Decompress a payload
+ * @param src - compressed payload including header
+ * @param len - length of src
+ * @param dst - output
+ * @param max - size of dst
+ * @return length of payload, 0 if malformed or too large
+ */
+size_t MQTTCompress::decompress(const void *src, size_t len, uint8_t *dst, size_t max){
+	const uint8_t *s = (const uint8_t *)src;
+	uint32_t start = time_us_32();
+	size_t in = MQTT_COMPRESS_HDR;
+	size_t out = 0;
+	size_t total;
+	bool ok = isCompressed(src, len);
+
+	total = ok ? ((s[2] << 8) | s[3]) : 0;
+	if (total > max){
+		ok = false;
+	}
+
+	while (ok && (out < total)){
+		if (in >= len){
+			ok = false;
+			break;
+		}
+		uint8_t flags = s[in++];
+		for (uint8_t b=0; ok && (b < 8) && (out < total); b++){
+			if (flags & (1 << b)){
+				if ((in + 2) > len){
+					ok = false;
+					break;
+				}
+				size_t matchLen = (s[in] >> 4) + LZ_MIN_MATCH;
+				size_t dist = ((s[in] & 0x0F) << 8) | s[in+1];
+				in += 2;
+				if ((dist == 0) || (dist > out) || ((out + matchLen) > total)){
+					ok = false;
+					break;
+				}
+				//Byte at a time as the match may overlap what it writes
+				for (size_t i=0; i < matchLen; i++){
+					dst[out] = dst[out - dist];
+					out++;
+				}
+			} else {
+				if (in >= len){
+					ok = false;
+					break;
+				}
+				dst[out++] = s[in++];
+			}
+		}
+	}
+
+	uint32_t us = time_us_32() - start;
+	taskENTER_CRITICAL();
+	xStats.inflateUs += us;
+	if (ok){
+		xStats.inflated++;
+	} else {
+		xStats.inflateFails++;
+	}
+	taskEXIT_CRITICAL();
+
+	if (!ok){
+		LogError(("Bad compressed payload"));
+		return 0;
+	}
+	return total;
+}
+
+/***
+ * Does the payload carry the compressed header
+ * @param src
+ * @param len
+ * @return
+ */
+bool MQTTCompress::isCompressed(const void *src, size_t len){
+	const uint8_t *s = (const uint8_t *)src;
+	return (len > MQTT_COMPRESS_HDR) && (s[0] == LZ_MAGIC) && (s[1] == LZ_FORMAT);
+}
+
+/***
+ * Copy of the counters
+ * @param stats - output
+ */
+void MQTTCompress::getStats(MQTTCompressStats *stats){
+	taskENTER_CRITICAL();
+	memcpy(stats, &xStats, sizeof(MQTTCompressStats));
+	taskEXIT_CRITICAL();
+}
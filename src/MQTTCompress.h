@@ -0,0 +1,106 @@
+/*
+ * MQTTCompress.h
+ *
+ * LZ style payload compression with a fixed window and no heap. A
+ * compressed payload starts with a four byte header, 0x1F 'L' and the
+ * original length, 0x1F can not start a JSON or CBOR document so the
+ * receiver can tell compressed payloads apart.
+ */
+
+#ifndef SRC_MQTTCOMPRESS_H_
+#define SRC_MQTTCOMPRESS_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+extern "C" {
+#include <FreeRTOS.h>
+#include <semphr.h>
+}
+
+//Bits of the match hash table, table is 2 bytes per entry
+#ifndef MQTT_COMPRESS_HASH_BITS
+#define MQTT_COMPRESS_HASH_BITS 8
+#endif
+
+//Bytes of compressed header
+#define MQTT_COMPRESS_HDR 4
+
+/***
+ * Counters, compressUs over bytesIn gives cost per byte
+ */
+typedef struct {
+	uint32_t compressed;	//Payloads sent compressed
+	uint32_t skipped;		//Payloads sent raw as they did not shrink
+	uint32_t bytesIn;		//Bytes given to compress
+	uint32_t bytesOut;		//Bytes produced by compress, raw if skipped
+	uint32_t compressUs;	//Time spent compressing
+	uint32_t inflated;		//Payloads decompressed
+	uint32_t inflateFails;	//Payloads with a bad compressed body
+	uint32_t inflateUs;		//Time spent decompressing
+} MQTTCompressStats;
+
+class MQTTCompress {
+public:
+	/***
+	 * Constructor
+	 */
+	MQTTCompress();
+
+	/***
+	 * Destructor
+	 */
+	virtual ~MQTTCompress();
+
+	/***
+	 * Compress a payload. Safe to call from several tasks.
+	 * @param src - payload
+	 * @param len - length of payload, up to 65535
+	 * @param dst - output, header then compressed body
+	 * @param max - size of dst
+	 * @return length written, 0 if it would not be smaller than len or fit
+	 */
+	size_t compress(const void *src, size_t len, uint8_t *dst, size_t max);
+
+	/***
+	 * Decompress a payload
+	 * @param src - compressed payload including header
+	 * @param len - length of src
+	 * @param dst - output
+	 * @param max - size of dst
+	 * @return length of payload, 0 if malformed or too large
+	 */
+	size_t decompress(const void *src, size_t len, uint8_t *dst, size_t max);
+
+	/***
+	 * Does the payload carry the compressed header
+	 * @param src
+	 * @param len
+	 * @return
+	 */
+	static bool isCompressed(const void *src, size_t len);
+
+	/***
+	 * Copy of the counters
+	 * @param stats - output
+	 */
+	void getStats(MQTTCompressStats *stats);
+
+private:
+	/***
+	 * Compress body into dst, table must be held
+	 * @param src
+	 * @param len
+	 * @param dst
+	 * @param max
+	 * @return length written, 0 if it did not fit
+	 */
+	size_t lzCompress(const uint8_t *src, size_t len, uint8_t *dst, size_t max);
+
+	uint16_t xTable[1 << MQTT_COMPRESS_HASH_BITS];
+	StaticSemaphore_t xMutexBuffer;
+	SemaphoreHandle_t xMutex = NULL;
+	MQTTCompressStats xStats;
+};
+
+#endif /* SRC_MQTTCOMPRESS_H_ */
@@ -0,0 +1,368 @@
+/*
+ * MQTTOfflineQueue.cpp
+ *
+ * Bounded store and forward queue for publishes made while the agent is
+ * not online.
+ */
+
+#include "MQTTOfflineQueue.h"
+#include "MQTTConfig.h"
+#include <string.h>
+
+extern "C" {
+#include <task.h>
+}
+
+//Written at the end of the ring when a record wraps to the start
+#define OFFLINE_WRAP 0xFFFF
+
+/***
+ * Constructor
+ */
+MQTTOfflineQueue::MQTTOfflineQueue() {
+	xMutex = xSemaphoreCreateMutexStatic(&xMutexBuffer);
+	memset(&xStats, 0, sizeof(xStats));
+}
+
+/***
+ * Destructor
+ */
+MQTTOfflineQueue::~MQTTOfflineQueue() {
+	// NOP
+}
+
+/***
+ * Set the external spill store
+ * @param spill - store or NULL for RAM only
+ */
+void MQTTOfflineQueue::setSpill(MQTTOfflineSpill *spill){
+	xSemaphoreTake(xMutex, portMAX_DELAY);
+	pSpill = spill;
+	xSemaphoreGive(xMutex);
+}
+
+/***
+ * Set what is dropped when the queue is full
+ * @param policy
+ */
+void MQTTOfflineQueue::setDropPolicy(MQTTOfflineDrop policy){
+	xPolicy = policy;
+}
+
+/***
+ * Store a publish
+ * @param topic - topic, not terminated
+ * @param topicLen
+ * @param payload
+ * @param payloadLen
+ * @param qos
+ * @param expiryMs - ms to keep the publish, 0 for never
+ * @param nowMs - current time in ms
+ * @return false if dropped
+ */
+bool MQTTOfflineQueue::push(const char *topic, uint16_t topicLen, const void *payload,
+		uint16_t payloadLen, uint8_t qos, uint32_t expiryMs, uint32_t nowMs){
+	MQTTOfflineRec_t rec;
+	size_t len = sizeof(MQTTOfflineRec_t) + topicLen + payloadLen;
+	int32_t pos;
+
+	if (len > MQTT_OFFLINE_QUEUE_SIZE){
+		LogError(("Offline publish too large %d", len));
+		taskENTER_CRITICAL();
+		xStats.dropped++;
+		taskEXIT_CRITICAL();
+		return false;
+	}
+
+	rec.topicLen = topicLen;
+	rec.payloadLen = payloadLen;
+	rec.qos = qos;
+	rec.storedMs = nowMs;
+	rec.expiryMs = expiryMs;
+
+	xSemaphoreTake(xMutex, portMAX_DELAY);
+	pos = ramAlloc(len);
+	while (pos < 0){
+		if (!ramEvict()){
+			taskENTER_CRITICAL();
+			xStats.dropped++;
+			taskEXIT_CRITICAL();
+			xSemaphoreGive(xMutex);
+			return false;
+		}
+		pos = ramAlloc(len);
+	}
+
+	memcpy(&xBuf[pos], &rec, sizeof(MQTTOfflineRec_t));
+	memcpy(&xBuf[pos + sizeof(MQTTOfflineRec_t)], topic, topicLen);
+	memcpy(&xBuf[pos + sizeof(MQTTOfflineRec_t) + topicLen], payload, payloadLen);
+	xTail = pos + len;
+	xCount++;
+
+	uint32_t d = depth();
+	taskENTER_CRITICAL();
+	xStats.queued++;
+	xStats.depth = d;
+	if (d > xStats.maxDepth){
+		xStats.maxDepth = d;
+	}
+	taskEXIT_CRITICAL();
+	xSemaphoreGive(xMutex);
+	return true;
+}
+
+/***
+ * Copy out the oldest publish that has not expired, leaving it queued
+ * @param rec - output header
+ * @param topic - output, topicMax bytes, zero terminated
+ * @param topicMax
+ * @param payload - output, payloadMax bytes
+ * @param payloadMax
+ * @param nowMs - current time in ms
+ * @return false if empty
+ */
+bool MQTTOfflineQueue::peek(MQTTOfflineRec_t *rec, char *topic, size_t topicMax,
+		uint8_t *payload, size_t payloadMax, uint32_t nowMs){
+	bool res = false;
+
+	xSemaphoreTake(xMutex, portMAX_DELAY);
+	xPeeked = false;
+	for (;;){
+		bool fromSpill = (pSpill != NULL) && (pSpill->spillCount() > 0);
+		if (fromSpill){
+			pSpill->spillRead(0, (uint8_t *)rec, sizeof(MQTTOfflineRec_t));
+		} else if (xCount > 0){
+			memcpy(rec, &xBuf[xHead], sizeof(MQTTOfflineRec_t));
+		} else {
+			break;
+		}
+
+		bool expired = (rec->expiryMs != 0) && ((nowMs - rec->storedMs) >= rec->expiryMs);
+		bool tooBig = (rec->topicLen >= topicMax) || (rec->payloadLen > payloadMax);
+		if (expired || tooBig){
+			taskENTER_CRITICAL();
+			if (expired){
+				xStats.expired++;
+			} else {
+				xStats.dropped++;
+			}
+			taskEXIT_CRITICAL();
+			if (fromSpill){
+				pSpill->spillPop();
+			} else {
+				ramPop();
+			}
+			continue;
+		}
+
+		if (fromSpill){
+			pSpill->spillRead(sizeof(MQTTOfflineRec_t), (uint8_t *)topic, rec->topicLen);
+			pSpill->spillRead(sizeof(MQTTOfflineRec_t) + rec->topicLen, payload, rec->payloadLen);
+		} else {
+			memcpy(topic, &xBuf[xHead + sizeof(MQTTOfflineRec_t)], rec->topicLen);
+			memcpy(payload, &xBuf[xHead + sizeof(MQTTOfflineRec_t) + rec->topicLen], rec->payloadLen);
+		}
+		topic[rec->topicLen] = 0;
+		xPeeked = true;
+		xPeekSpill = fromSpill;
+		res = true;
+		break;
+	}
+
+	uint32_t d = depth();
+	taskENTER_CRITICAL();
+	xStats.depth = d;
+	taskEXIT_CRITICAL();
+	xSemaphoreGive(xMutex);
+	return res;
+}
+
+/***
+ * Remove the publish returned by peek
+ */
+void MQTTOfflineQueue::pop(){
+	xSemaphoreTake(xMutex, portMAX_DELAY);
+	if (xPeekEvicted){
+		//Already removed to make room
+		xPeekEvicted = false;
+		taskENTER_CRITICAL();
+		xStats.sent++;
+		taskEXIT_CRITICAL();
+	} else if (xPeeked){
+		if (xPeekSpill){
+			pSpill->spillPop();
+		} else {
+			ramPop();
+		}
+		xPeeked = false;
+		uint32_t d = depth();
+		taskENTER_CRITICAL();
+		xStats.sent++;
+		xStats.depth = d;
+		taskEXIT_CRITICAL();
+	}
+	xSemaphoreGive(xMutex);
+}
+
+/***
+ * Leave the publish returned by peek queued as it could not be sent.
+ * If it was evicted meanwhile it is counted as dropped.
+ */
+void MQTTOfflineQueue::unpeek(){
+	xSemaphoreTake(xMutex, portMAX_DELAY);
+	if (xPeekEvicted){
+		taskENTER_CRITICAL();
+		xStats.dropped++;
+		taskEXIT_CRITICAL();
+	}
+	xPeeked = false;
+	xPeekEvicted = false;
+	xSemaphoreGive(xMutex);
+}
+
+/***
+ * Is the queue empty
+ * @return
+ */
+bool MQTTOfflineQueue::isEmpty(){
+	bool res;
+	xSemaphoreTake(xMutex, portMAX_DELAY);
+	res = (depth() == 0);
+	xSemaphoreGive(xMutex);
+	return res;
+}
+
+/***
+ * Record a completed drain
+ * @param count - publishes sent
+ * @param ms - time taken
+ */
+void MQTTOfflineQueue::recordDrain(uint32_t count, uint32_t ms){
+	taskENTER_CRITICAL();
+	xStats.drainCount = count;
+	xStats.drainMs = ms;
+	taskEXIT_CRITICAL();
+}
+
+/***
+ * Copy of the counters
+ * @param stats - output
+ */
+void MQTTOfflineQueue::getStats(MQTTOfflineStats *stats){
+	taskENTER_CRITICAL();
+	memcpy(stats, &xStats, sizeof(MQTTOfflineStats));
+	taskEXIT_CRITICAL();
+}
+
+/***
+ * Length of record held at offset in RAM
+ * @param pos
+ * @return
+ */
+size_t MQTTOfflineQueue::recLen(size_t pos){
+	MQTTOfflineRec_t rec;
+	memcpy(&rec, &xBuf[pos], sizeof(MQTTOfflineRec_t));
+	return sizeof(MQTTOfflineRec_t) + rec.topicLen + rec.payloadLen;
+}
+
+/***
+ * Move head past the oldest RAM record, wrapping if needed
+ */
+void MQTTOfflineQueue::ramPop(){
+	xHead += recLen(xHead);
+	xCount--;
+	ramWrap();
+}
+
+/***
+ * Wrap head at end of ring
+ */
+void MQTTOfflineQueue::ramWrap(){
+	uint16_t marker;
+
+	if (xCount == 0){
+		xHead = 0;
+		xTail = 0;
+		return;
+	}
+	if ((MQTT_OFFLINE_QUEUE_SIZE - xHead) < sizeof(uint16_t)){
+		xHead = 0;
+		return;
+	}
+	memcpy(&marker, &xBuf[xHead], sizeof(uint16_t));
+	if (marker == OFFLINE_WRAP){
+		xHead = 0;
+	}
+}
+
+/***
+ * Find room for a record in the RAM ring. Records are kept contiguous,
+ * if one does not fit at the end a wrap marker is left and it goes at
+ * the start.
+ * @param len
+ * @return offset or -1 if no room
+ */
+int32_t MQTTOfflineQueue::ramAlloc(size_t len){
+	if (xCount == 0){
+		xHead = 0;
+		xTail = 0;
+		return 0;
+	}
+	if (xTail > xHead){
+		if (len <= (MQTT_OFFLINE_QUEUE_SIZE - xTail)){
+			return xTail;
+		}
+		if (len <= xHead){
+			if ((MQTT_OFFLINE_QUEUE_SIZE - xTail) >= sizeof(uint16_t)){
+				uint16_t marker = OFFLINE_WRAP;
+				memcpy(&xBuf[xTail], &marker, sizeof(uint16_t));
+			}
+			return 0;
+		}
+		return -1;
+	}
+	if ((xTail < xHead) && (len <= (xHead - xTail))){
+		return xTail;
+	}
+	return -1;
+}
+
+/***
+ * Make room by spilling or dropping the oldest RAM record
+ * @return false if nothing could be removed
+ */
+bool MQTTOfflineQueue::ramEvict(){
+	if (xCount == 0){
+		return false;
+	}
+
+	if (xPeeked && !xPeekSpill){
+		//Oldest record is already with the agent, pop or unpeek counts it
+		xPeeked = false;
+		xPeekEvicted = true;
+	} else if ((pSpill != NULL) && pSpill->spillPush(&xBuf[xHead], recLen(xHead))){
+		taskENTER_CRITICAL();
+		xStats.spilled++;
+		taskEXIT_CRITICAL();
+	} else if (xPolicy == OfflineDropNewest){
+		return false;
+	} else {
+		taskENTER_CRITICAL();
+		xStats.dropped++;
+		taskEXIT_CRITICAL();
+	}
+	ramPop();
+	return true;
+}
+
+/***
+ * Count of publishes held
+ * @return
+ */
+uint32_t MQTTOfflineQueue::depth(){
+	uint32_t d = xCount;
+	if (pSpill != NULL){
+		d += pSpill->spillCount();
+	}
+	return d;
+}
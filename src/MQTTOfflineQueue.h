@@ -0,0 +1,233 @@
+/*
+ * MQTTOfflineQueue.h
+ *
+ * Bounded store and forward queue for publishes made while the agent is
+ * not online. Records are held in a RAM ring and, when it fills, the
+ * oldest may be spilled to an optional external store such as flash.
+ * Records are returned oldest first, spill before RAM.
+ */
+
+#ifndef SRC_MQTTOFFLINEQUEUE_H_
+#define SRC_MQTTOFFLINEQUEUE_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+extern "C" {
+#include <FreeRTOS.h>
+#include <semphr.h>
+}
+
+//Bytes of RAM used to hold publishes while offline
+#ifndef MQTT_OFFLINE_QUEUE_SIZE
+#define MQTT_OFFLINE_QUEUE_SIZE 2048
+#endif
+
+//Default ms an offline publish is kept before it expires, 0 for never
+#ifndef MQTT_OFFLINE_EXPIRY_MS
+#define MQTT_OFFLINE_EXPIRY_MS 300000
+#endif
+
+//What to drop when both RAM and spill are full
+enum MQTTOfflineDrop { OfflineDropOldest, OfflineDropNewest };
+
+/***
+ * Header of a stored record, followed by topic then payload
+ */
+typedef struct {
+	uint16_t topicLen;
+	uint16_t payloadLen;
+	uint8_t qos;
+	uint32_t storedMs;
+	uint32_t expiryMs;
+} MQTTOfflineRec_t;
+
+/***
+ * Counters for the queue
+ */
+typedef struct {
+	uint32_t queued;		//Publishes stored
+	uint32_t sent;			//Publishes handed back to the agent
+	uint32_t dropped;		//Publishes lost to the drop policy
+	uint32_t expired;		//Publishes discarded after their expiry
+	uint32_t spilled;		//Publishes moved from RAM to the spill store
+	uint32_t depth;			//Publishes currently held
+	uint32_t maxDepth;		//Most publishes held at once
+	uint32_t drainCount;	//Publishes sent by the last drain
+	uint32_t drainMs;		//ms taken by the last drain
+} MQTTOfflineStats;
+
+/***
+ * External store for records that do not fit in RAM, for example a
+ * flash sector ring. Records are written and read back in order.
+ */
+class MQTTOfflineSpill {
+public:
+	virtual ~MQTTOfflineSpill(){};
+
+	/***
+	 * Append a record
+	 * @param rec - record, header followed by topic and payload
+	 * @param len - length of record
+	 * @return false if the store is full
+	 */
+	virtual bool spillPush(const uint8_t *rec, size_t len) = 0;
+
+	/***
+	 * Read part of the oldest record
+	 * @param offset - offset within the record
+	 * @param buf - output
+	 * @param len - bytes to read
+	 * @return bytes read, 0 if empty
+	 */
+	virtual size_t spillRead(size_t offset, uint8_t *buf, size_t len) = 0;
+
+	/***
+	 * Remove the oldest record
+	 */
+	virtual void spillPop() = 0;
+
+	/***
+	 * Number of records held
+	 * @return
+	 */
+	virtual uint32_t spillCount() = 0;
+};
+
+class MQTTOfflineQueue {
+public:
+	/***
+	 * Constructor
+	 */
+	MQTTOfflineQueue();
+
+	/***
+	 * Destructor
+	 */
+	virtual ~MQTTOfflineQueue();
+
+	/***
+	 * Set the external spill store
+	 * @param spill - store or NULL for RAM only
+	 */
+	void setSpill(MQTTOfflineSpill *spill);
+
+	/***
+	 * Set what is dropped when the queue is full
+	 * @param policy
+	 */
+	void setDropPolicy(MQTTOfflineDrop policy);
+
+	/***
+	 * Store a publish
+	 * @param topic - topic, not terminated
+	 * @param topicLen
+	 * @param payload
+	 * @param payloadLen
+	 * @param qos
+	 * @param expiryMs - ms to keep the publish, 0 for never
+	 * @param nowMs - current time in ms
+	 * @return false if dropped
+	 */
+	bool push(const char *topic, uint16_t topicLen, const void *payload,
+			uint16_t payloadLen, uint8_t qos, uint32_t expiryMs, uint32_t nowMs);
+
+	/***
+	 * Copy out the oldest publish that has not expired, leaving it queued
+	 * @param rec - output header
+	 * @param topic - output, topicMax bytes, zero terminated
+	 * @param topicMax
+	 * @param payload - output, payloadMax bytes
+	 * @param payloadMax
+	 * @param nowMs - current time in ms
+	 * @return false if empty
+	 */
+	bool peek(MQTTOfflineRec_t *rec, char *topic, size_t topicMax,
+			uint8_t *payload, size_t payloadMax, uint32_t nowMs);
+
+	/***
+	 * Remove the publish returned by peek
+	 */
+	void pop();
+
+	/***
+	 * Leave the publish returned by peek queued as it could not be sent.
+	 * If it was evicted meanwhile it is counted as dropped.
+	 */
+	void unpeek();
+
+	/***
+	 * Is the queue empty
+	 * @return
+	 */
+	bool isEmpty();
+
+	/***
+	 * Record a completed drain
+	 * @param count - publishes sent
+	 * @param ms - time taken
+	 */
+	void recordDrain(uint32_t count, uint32_t ms);
+
+	/***
+	 * Copy of the counters
+	 * @param stats - output
+	 */
+	void getStats(MQTTOfflineStats *stats);
+
+private:
+	/***
+	 * Length of record held at offset in RAM
+	 * @param pos
+	 * @return
+	 */
+	size_t recLen(size_t pos);
+
+	/***
+	 * Move head past the oldest RAM record, wrapping if needed
+	 */
+	void ramPop();
+
+	/***
+	 * Wrap head at end of ring
+	 */
+	void ramWrap();
+
+	/***
+	 * Find room for a record in the RAM ring. Records are kept contiguous,
+	 * if one does not fit at the end a wrap marker is left and it goes at
+	 * the start.
+	 * @param len
+	 * @return offset or -1 if no room
+	 */
+	int32_t ramAlloc(size_t len);
+
+	/***
+	 * Make room by spilling or dropping the oldest RAM record
+	 * @return false if nothing could be removed
+	 */
+	bool ramEvict();
+
+	/***
+	 * Count of publishes held
+	 * @return
+	 */
+	uint32_t depth();
+
+	uint8_t xBuf[MQTT_OFFLINE_QUEUE_SIZE];
+	size_t xHead = 0;
+	size_t xTail = 0;
+	uint32_t xCount = 0;
+	bool xPeeked = false;
+	bool xPeekSpill = false;
+	bool xPeekEvicted = false;
+
+	MQTTOfflineSpill *pSpill = NULL;
+	MQTTOfflineDrop xPolicy = OfflineDropOldest;
+
+	StaticSemaphore_t xMutexBuffer;
+	SemaphoreHandle_t xMutex = NULL;
+	MQTTOfflineStats xStats;
+};
+
+#endif /* SRC_MQTTOFFLINEQUEUE_H_ */
@@ -17,7 +17,7 @@
  * @param eth - Ethernet Helper object
  */
 TCPTransport::TCPTransport(uint8_t sockNum, EthHelper *eth) {
-	init(xSock, pEth);
+	init(sockNum, eth);
 }
 
 /***
@@ -35,6 +35,7 @@ TCPTransport::TCPTransport(){
 void TCPTransport::init(uint8_t sockNum, EthHelper *eth) {
 	xSock = sockNum;
 	pEth = eth;
+	xCodec.setIO(codecWrite, codecRead, this);
 }
 
 /***
@@ -61,15 +62,155 @@ uint32_t TCPTransport::getCurrentTime(){
  * @return number of bytes sent
  */
 int32_t TCPTransport::transSend(NetworkContext_t * pNetworkContext, const void * pBuffer, size_t bytesToSend){
+	xStats.sends++;
+	if (xMqtt5){
+		return xCodec.encode(pBuffer, bytesToSend);
+	}
+	return rawSend(pBuffer, bytesToSend);
+}
+
+/***
+ * Send without protocol translation, through write combining if enabled
+ * @param pBuffer - buffer to send from
+ * @param bytesToSend - bytes to send
+ * @return bytes sent, negative on error
+ */
+int32_t TCPTransport::rawSend(const void *pBuffer, size_t bytesToSend){
+	if (xTxFailed){
+		return -1;
+	}
+	if (!xTxCombine){
+		return chipWrite(pBuffer, bytesToSend);
+	}
+
+	if ((xTxCount + bytesToSend) > TCP_TX_BUF_SIZE){
+		if (!transFlush()){
+			return -1;
+		}
+		if (bytesToSend > TCP_TX_BUF_SIZE){
+			return chipWrite(pBuffer, bytesToSend);
+		}
+	}
+
+	if (xTxCount == 0){
+		xTxFirstMs = getCurrentTime();
+	}
+	memcpy(&xTxBuf[xTxCount], pBuffer, bytesToSend);
+	xTxCount += bytesToSend;
+
+	if ((getCurrentTime() - xTxFirstMs) >= TCP_TX_MAX_DELAY_MS){
+		if (!transFlush()){
+			return -1;
+		}
+	}
+	return bytesToSend;
+}
+
+/***
+ * Send several fragments as one write to the socket. Anything held by
+ * write combining goes first so ordering is kept.
+ * @param frags - array of fragments
+ * @param count - number of fragments, at most TCP_MAX_FRAGS
+ * @return number of bytes sent from frags, negative on error
+ */
+int32_t TCPTransport::transSendv(const EthFragment *frags, uint8_t count){
+	EthFragment all[TCP_MAX_FRAGS + 1];
+	uint8_t n = 0;
+	size_t total = 0;
+	int32_t dataOut;
+
+	if (count > TCP_MAX_FRAGS){
+		LogError(("Too many fragments %d\n", count));
+		return -1;
+	}
+	if (xTxFailed){
+		return -1;
+	}
+
+	xStats.sends++;
+	if (xMqtt5){
+		//Packet is rewritten so fragments go through the codec in turn
+		for (uint8_t i=0; i < count; i++){
+			if (xCodec.encode(frags[i].pBuffer, frags[i].length) < 0){
+				return -1;
+			}
+			total += frags[i].length;
+		}
+		return total;
+	}
+
+	if (xTxCount > 0){
+		all[n].pBuffer = xTxBuf;
+		all[n].length = xTxCount;
+		n++;
+	}
+	for (uint8_t i=0; i < count; i++){
+		all[n++] = frags[i];
+		total += frags[i].length;
+	}
+
+	dataOut = pEth->tcpSockWritev(xSock, all, n);
+	xStats.chipWrites++;
+	if (dataOut != (int32_t)(total + xTxCount)){
+		LogError(("Send failed %d\n", dataOut));
+		xTxCount = 0;
+		return -1;
+	}
+	xStats.sentBytes += dataOut;
+	xTxCount = 0;
+	return total;
+}
+
+/***
+ * Write directly to socket
+ * @param buf - buffer to send from
+ * @param len - bytes to send
+ * @return bytes sent, negative on error
+ */
+int32_t TCPTransport::chipWrite(const void *buf, size_t len){
 	uint32_t dataOut;
 	//dataOut = send(xSock, (uint8_t *)pBuffer, bytesToSend);
-	dataOut = pEth->tcpSockWrite(xSock, (uint8_t *)pBuffer, bytesToSend);
-	if (dataOut != bytesToSend){
+	dataOut = pEth->tcpSockWrite(xSock, (uint8_t *)buf, len);
+	xStats.chipWrites++;
+	if (dataOut != len){
 		LogError(("Send failed %d\n", dataOut));
+	} else {
+		xStats.sentBytes += len;
 	}
 	return dataOut;
 }
 
+/***
+ * Write out anything held by write combining
+ * @return true if successful or nothing to write. A failure also fails
+ * the next read or send so the broken connection is seen.
+ */
+bool TCPTransport::transFlush(){
+	if (xTxCount == 0){
+		return true;
+	}
+	int32_t dataOut = chipWrite(xTxBuf, xTxCount);
+	bool res = (dataOut == xTxCount);
+	xTxCount = 0;
+	if (!res){
+		//Sends already reported as done are lost, fail the connection
+		xTxFailed = true;
+	}
+	return res;
+}
+
+/***
+ * Enable collection of sends into one write. Disabling flushes
+ * anything held.
+ * @param enable
+ */
+void TCPTransport::setWriteCombining(bool enable){
+	if (!enable){
+		transFlush();
+	}
+	xTxCombine = enable;
+}
+
 /***
  * Read data from socket
  * @param pNetworkContext - pointer to this object
@@ -78,12 +219,126 @@ int32_t TCPTransport::transSend(NetworkContext_t * pNetworkContext, const void *
  * @return returns number of bytes read. 0 if none waiting. negative if error
  */
 int32_t TCPTransport::transRead(NetworkContext_t * pNetworkContext, void * pBuffer, size_t bytesToRecv){
+	xStats.reads++;
+	if (xMqtt5){
+		return xCodec.decode(pBuffer, bytesToRecv);
+	}
+	return rawRead(pBuffer, bytesToRecv);
+}
+
+/***
+ * Read without protocol translation, through the read ahead buffer
+ * @param pBuffer - buffer to read into
+ * @param bytesToRecv - bytes to read
+ * @return bytes read, 0 if none waiting, negative on error
+ */
+int32_t TCPTransport::rawRead(void * pBuffer, size_t bytesToRecv){
 	int32_t dataIn=0;
 
-	dataIn = pEth->tcpSockRead(xSock, (uint8_t *)pBuffer, bytesToRecv);
+	if ((xTxCount > 0) && ((getCurrentTime() - xTxFirstMs) >= TCP_TX_MAX_DELAY_MS)){
+		transFlush();
+	}
+	if (xTxFailed){
+		return -1;
+	}
+	if (xRxCount == 0){
+		xRxHead = 0;
+		xStats.chipReads++;
+		if (bytesToRecv >= TCP_RX_BUF_SIZE){
+			//Large read goes straight to the caller's buffer
+			dataIn = (int32_t)pEth->tcpSockRead(xSock, (uint8_t *)pBuffer, bytesToRecv);
+			if (dataIn > 0){
+				xStats.bytes += dataIn;
+			}
+			return dataIn;
+		}
+
+		//Take all the chip has waiting in one burst
+		dataIn = (int32_t)pEth->tcpSockRead(xSock, xRxBuf, TCP_RX_BUF_SIZE);
+		if (dataIn <= 0){
+			return dataIn;
+		}
+		xRxCount = dataIn;
+	} else {
+		xStats.bufferedReads++;
+	}
+
+	dataIn = (bytesToRecv < xRxCount) ? bytesToRecv : xRxCount;
+	memcpy(pBuffer, &xRxBuf[xRxHead], dataIn);
+	xRxHead += dataIn;
+	xRxCount -= dataIn;
+	xStats.bytes += dataIn;
 	return dataIn;
 }
 
+/***
+ * Discard anything in the read ahead and write combining buffers
+ */
+void TCPTransport::rxReset(){
+	xRxHead = 0;
+	xRxCount = 0;
+	xTxCount = 0;
+	xTxFailed = false;
+	xCodec.reset();
+}
+
+/***
+ * Speak MQTT 5 on the wire, translating to and from the 3.1.1 used by
+ * coreMQTT. Takes effect from the next connect.
+ * @param enable
+ */
+void TCPTransport::setMqtt5(bool enable){
+	xMqtt5 = enable;
+}
+
+/***
+ * Is the connection translated to MQTT 5
+ * @return
+ */
+bool TCPTransport::isMqtt5(){
+	return xMqtt5;
+}
+
+/***
+ * Get the MQTT 5 codec, for broker limits and counters
+ * @return
+ */
+MQTT5Codec * TCPTransport::getCodec(){
+	return &xCodec;
+}
+
+/***
+ * Raw write used by the MQTT 5 codec
+ * @param ctx - this object
+ * @param buf - buffer to send from
+ * @param len - bytes to send
+ * @return bytes sent, negative on error
+ */
+int32_t TCPTransport::codecWrite(void *ctx, const void *buf, size_t len){
+	TCPTransport *t = (TCPTransport *)ctx;
+	return t->rawSend(buf, len);
+}
+
+/***
+ * Raw read used by the MQTT 5 codec
+ * @param ctx - this object
+ * @param buf - buffer to read into
+ * @param len - bytes to read
+ * @return bytes read, 0 if none waiting, negative on error
+ */
+int32_t TCPTransport::codecRead(void *ctx, void *buf, size_t len){
+	TCPTransport *t = (TCPTransport *)ctx;
+	return t->rawRead(buf, len);
+}
+
+/***
+ * Get the read and write counters
+ * @param stats - output
+ */
+void TCPTransport::getStats(TCPTransportStats *stats){
+	memcpy(stats, &xStats, sizeof(TCPTransportStats));
+}
+
 /***
  * Send data to socket in format used by FreeRTOS MQTT Lib
  * @param pNetworkContext - pointer to this object
@@ -110,16 +365,72 @@ int32_t TCPTransport::staticRead(NetworkContext_t * pNetworkContext, void * pBuf
 }
 
 /***
- * Connect TCP Socket
+ * Connect TCP Socket. If reuse of the host address is enabled the
+ * address of the last good connect to this host is tried first,
+ * falling back to a lookup that bypasses the DNS cache if that fails.
  * @param host - hostname
  * @param port - port number
  * @return true if successful
  */
 bool TCPTransport::transConnect(const char * host, uint16_t port){
-	if (!pEth->dnsClient(xHost, host)){
+	if ((pHostName == NULL) || (strcmp(pHostName, host) != 0)){
+		xHostValid = false;
+	}
+	pHostName = host;
+
+	//The DNS cache, stale entries included, would hand back an address
+	//that has just failed so the lookup then goes to the server
+	bool fresh = false;
+	if (xReuseHost && xHostValid){
+		xCachedConnect = true;
+		if (transConnect(xHost, port)){
+			return true;
+		}
+		LogDebug(("Cached address failed, resolving %s\n", host));
+		fresh = true;
+	}
+
+	xCachedConnect = false;
+	xHostValid = false;
+	if (!pEth->dnsClient(xHost, host, fresh)){
 		return false;
 	}
-	return transConnect(xHost, port);
+	xHostValid = transConnect(xHost, port);
+	return xHostValid;
+}
+
+/***
+ * Reuse the address of the last good connect rather than resolving
+ * the host again
+ * @param enable
+ */
+void TCPTransport::setReuseHost(bool enable){
+	xReuseHost = enable;
+}
+
+/***
+ * Did the last connect use the cached host address
+ * @return
+ */
+bool TCPTransport::wasCachedConnect(){
+	return xCachedConnect;
+}
+
+/***
+ * Next local port from the ephemeral range
+ * @return
+ */
+uint16_t TCPTransport::nextLocalPort(){
+	const uint32_t range = TCP_LOCAL_PORT_MAX - TCP_LOCAL_PORT_MIN + 1;
+	if (xLocalPort == 0){
+		//Start at a different point each boot and for each socket
+		xLocalPort = TCP_LOCAL_PORT_MIN + ((time_us_32() + xSock * 997) % range);
+	} else if (xLocalPort >= TCP_LOCAL_PORT_MAX){
+		xLocalPort = TCP_LOCAL_PORT_MIN;
+	} else {
+		xLocalPort++;
+	}
+	return xLocalPort;
 }
 
 /***
@@ -134,8 +445,9 @@ bool TCPTransport::transConnect(uint8_t * ip, uint16_t port){
 	if (ip != xHost){
 		memcpy(xHost, ip, 4);
 	}
+	rxReset();
 
-	return pEth->tcpSockConnect(xSock, 1080, xHost, port);
+	return pEth->tcpSockConnect(xSock, nextLocalPort(), xHost, port);
 }
 
 /***
@@ -148,6 +460,24 @@ uint8_t TCPTransport::status(){
 	return stat;
 }
 
+/***
+ * Switch socket to event driven reads using the W5x00 interrupt
+ * @param cb - callback made from interrupt context
+ * @param ctx - context passed to callback
+ * @return true if successful
+ */
+bool TCPTransport::transEnableEvents(EthSockEventCallback cb, void *ctx){
+	return pEth->enableSockEvents(xSock, cb, ctx);
+}
+
+/***
+ * Is there possibly data waiting to be read
+ * @return
+ */
+bool TCPTransport::isReady(){
+	return (xRxCount > 0) || xCodec.isPending() || pEth->tcpSockReady(xSock);
+}
+
 /***
  * Close Socket
  * @return
@@ -155,5 +485,6 @@ uint8_t TCPTransport::status(){
 bool TCPTransport::transClose(){
 	pEth->tcpSockClose(xSock);
 	//disconnect(xSock);
+	rxReset();
 	return true;
 }
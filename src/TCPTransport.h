@@ -13,6 +13,7 @@
 #include "core_mqtt.h"
 #include "core_mqtt_agent.h"
 #include "EthHelper.h"
+#include "MQTT5Codec.h"
 
 extern "C" {
 #include <FreeRTOS.h>
@@ -28,6 +29,49 @@ extern "C" {
 #include "socket.h"
 }
 
+//Read ahead buffer, small reads from coreMQTT are served from here
+#ifndef TCP_RX_BUF_SIZE
+#define TCP_RX_BUF_SIZE 1024
+#endif
+
+//Write combining buffer, sends are collected and written as one SEND
+#ifndef TCP_TX_BUF_SIZE
+#define TCP_TX_BUF_SIZE 1024
+#endif
+
+//Max ms data is held in the write combining buffer
+#ifndef TCP_TX_MAX_DELAY_MS
+#define TCP_TX_MAX_DELAY_MS 5
+#endif
+
+//Range local ports are rotated through, so a quick reconnect does not
+//reuse a port the broker still holds in TIME_WAIT
+#ifndef TCP_LOCAL_PORT_MIN
+#define TCP_LOCAL_PORT_MIN 49152
+#endif
+
+#ifndef TCP_LOCAL_PORT_MAX
+#define TCP_LOCAL_PORT_MAX 65535
+#endif
+
+//Max fragments in one vectored send
+#ifndef TCP_MAX_FRAGS
+#define TCP_MAX_FRAGS 8
+#endif
+
+/***
+ * Counters for reads and writes through the transport
+ */
+typedef struct {
+	uint32_t reads;			//transRead calls
+	uint32_t bufferedReads;	//transRead served from the read ahead buffer
+	uint32_t chipReads;		//Reads that went to the EthHelper
+	uint32_t bytes;			//Bytes returned to caller
+	uint32_t sends;			//transSend calls
+	uint32_t chipWrites;	//Writes that went to the EthHelper
+	uint32_t sentBytes;		//Bytes written to the chip
+} TCPTransportStats;
+
 class TCPTransport {
 public:
 	/***
@@ -55,13 +99,28 @@ public:
 	void init(uint8_t sockNum, EthHelper* eth);
 
 	/***
-	 * Connect TCP Socket
+	 * Connect TCP Socket. If reuse of the host address is enabled the
+	 * address of the last good connect to this host is tried first,
+	 * falling back to a lookup that bypasses the DNS cache if that fails.
 	 * @param host - hostname
 	 * @param port - port number
 	 * @return true if successful
 	 */
 	bool transConnect(const char * host, uint16_t port);
 
+	/***
+	 * Reuse the address of the last good connect rather than resolving
+	 * the host again
+	 * @param enable
+	 */
+	void setReuseHost(bool enable);
+
+	/***
+	 * Did the last connect use the cached host address
+	 * @return
+	 */
+	bool wasCachedConnect();
+
 	/***
 	 * Connect TCP Socket
 	 * @param ip - ip address
@@ -82,6 +141,20 @@ public:
 	 */
 	bool transClose();
 
+	/***
+	 * Switch socket to event driven reads using the W5x00 interrupt
+	 * @param cb - callback made from interrupt context
+	 * @param ctx - context passed to callback
+	 * @return true if successful
+	 */
+	bool transEnableEvents(EthSockEventCallback cb, void *ctx);
+
+	/***
+	 * Is there possibly data waiting to be read
+	 * @return
+	 */
+	bool isReady();
+
 	/***
 	 * Send data to socket in format used by FreeRTOS MQTT Lib
 	 * @param pNetworkContext - pointer to this object
@@ -91,6 +164,15 @@ public:
 	 */
 	int32_t transSend(NetworkContext_t * pNetworkContext, const void * pBuffer, size_t bytesToSend);
 
+	/***
+	 * Send several fragments as one write to the socket. Anything held by
+	 * write combining goes first so ordering is kept.
+	 * @param frags - array of fragments
+	 * @param count - number of fragments, at most TCP_MAX_FRAGS
+	 * @return number of bytes sent from frags, negative on error
+	 */
+	int32_t transSendv(const EthFragment *frags, uint8_t count);
+
 	/***
 	 * Read data from socket
 	 * @param pNetworkContext - pointer to this object
@@ -101,6 +183,45 @@ public:
 	int32_t transRead(NetworkContext_t * pNetworkContext, void * pBuffer, size_t bytesToRecv);
 
 
+	/***
+	 * Enable collection of sends into one write. Disabling flushes
+	 * anything held.
+	 * @param enable
+	 */
+	void setWriteCombining(bool enable);
+
+	/***
+	 * Write out anything held by write combining
+	 * @return true if successful or nothing to write. A failure also fails
+	 * the next read or send so the broken connection is seen.
+	 */
+	bool transFlush();
+
+	/***
+	 * Get the read and write counters
+	 * @param stats - output
+	 */
+	void getStats(TCPTransportStats *stats);
+
+	/***
+	 * Speak MQTT 5 on the wire, translating to and from the 3.1.1 used by
+	 * coreMQTT. Takes effect from the next connect.
+	 * @param enable
+	 */
+	void setMqtt5(bool enable);
+
+	/***
+	 * Is the connection translated to MQTT 5
+	 * @return
+	 */
+	bool isMqtt5();
+
+	/***
+	 * Get the MQTT 5 codec, for broker limits and counters
+	 * @return
+	 */
+	MQTT5Codec * getCodec();
+
 	/***
 	 * Static time function used by FreeRtos MQTT
 	 * @return
@@ -127,14 +248,91 @@ public:
 
 
 private:
+	/***
+	 * Discard anything in the read ahead and write combining buffers
+	 */
+	void rxReset();
+
+	/***
+	 * Send without protocol translation, through write combining if enabled
+	 * @param pBuffer - buffer to send from
+	 * @param bytesToSend - bytes to send
+	 * @return bytes sent, negative on error
+	 */
+	int32_t rawSend(const void *pBuffer, size_t bytesToSend);
 
+	/***
+	 * Read without protocol translation, through the read ahead buffer
+	 * @param pBuffer - buffer to read into
+	 * @param bytesToRecv - bytes to read
+	 * @return bytes read, 0 if none waiting, negative on error
+	 */
+	int32_t rawRead(void * pBuffer, size_t bytesToRecv);
+
+	/***
+	 * Raw write used by the MQTT 5 codec
+	 * @param ctx - this object
+	 * @param buf - buffer to send from
+	 * @param len - bytes to send
+	 * @return bytes sent, negative on error
+	 */
+	static int32_t codecWrite(void *ctx, const void *buf, size_t len);
+
+	/***
+	 * Raw read used by the MQTT 5 codec
+	 * @param ctx - this object
+	 * @param buf - buffer to read into
+	 * @param len - bytes to read
+	 * @return bytes read, 0 if none waiting, negative on error
+	 */
+	static int32_t codecRead(void *ctx, void *buf, size_t len);
+
+	/***
+	 * Next local port from the ephemeral range
+	 * @return
+	 */
+	uint16_t nextLocalPort();
+
+	/***
+	 * Write directly to socket
+	 * @param buf - buffer to send from
+	 * @param len - bytes to send
+	 * @return bytes sent, negative on error
+	 */
+	int32_t chipWrite(const void *buf, size_t len);
 
 	uint8_t xSock = 0;
 
 	uint8_t xHost[4];
 	uint16_t xPort=80;
+	uint16_t xLocalPort = 0;
+
+	//Address of last good connect by host name
+	const char *pHostName = NULL;
+	bool xHostValid = false;
+	bool xReuseHost = false;
+	bool xCachedConnect = false;
 	EthHelper *pEth;
 
+	//Read ahead buffer
+	uint8_t xRxBuf[TCP_RX_BUF_SIZE];
+	uint16_t xRxHead = 0;
+	uint16_t xRxCount = 0;
+
+	//Write combining buffer
+	bool xTxCombine = false;
+	uint8_t xTxBuf[TCP_TX_BUF_SIZE];
+	uint16_t xTxCount = 0;
+	uint32_t xTxFirstMs = 0;
+	//A flush failed where it could not be reported, next read or send fails
+	bool xTxFailed = false;
+
+	TCPTransportStats xStats = {0, 0, 0, 0, 0, 0, 0};
+
+	//MQTT 5 translation
+	bool xMqtt5 = false;
+	MQTT5Codec xCodec;
+
 };
 
 #endif /* TCPTRANSPORT_H_ */
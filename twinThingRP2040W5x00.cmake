@@ -7,6 +7,13 @@ target_sources(twinThingRP2040W5x00 INTERFACE
     ${CMAKE_CURRENT_LIST_DIR}/src/EthHelper.cpp
     ${CMAKE_CURRENT_LIST_DIR}/src/MQTTAgent.cpp
     ${CMAKE_CURRENT_LIST_DIR}/src/TCPTransport.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/src/DNSCache.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/src/DNSResolver.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/src/MQTTOfflineQueue.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/src/MQTT5Codec.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/src/CBOREncoder.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/src/CBORDecoder.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/src/MQTTCompress.cpp
     
     ${CMAKE_CURRENT_LIST_DIR}/lib/twinThingPicoESP/src/MQTTInterface.cpp
     ${CMAKE_CURRENT_LIST_DIR}/lib/twinThingPicoESP/src/MQTTRouter.cpp